@@ -0,0 +1,332 @@
+#pragma once
+
+#include "binary_stream.hpp"
+#include "stream.hpp"
+#include <functional>
+#include <new>
+
+// 类型擦除的对象存储: 不超过 inline_size 且可以 noexcept 移动的对象直接放在内部, 否则放在堆上
+template <size_t inline_size>
+class small_box
+{
+    struct operations
+    {
+        void (*destroy)(void*);
+        void (*relocate)(void* from, void* to); // 移动内部存放的对象并销毁原对象; 堆上的对象为 nullptr
+    };
+
+    template <typename T>
+    static constexpr bool fits = sizeof(T) <= inline_size && alignof(T) <= alignof(max_align_t) && is_nothrow_move_constructible_v<T>;
+
+    template <typename T>
+    static constexpr operations inline_operations {
+        [](void* p) { static_cast<T*>(p)->~T(); },
+        [](void* from, void* to)
+        {
+            ::new (to) T(std::move(*static_cast<T*>(from)));
+            static_cast<T*>(from)->~T();
+        },
+    };
+
+    template <typename T>
+    static constexpr operations heap_operations {[](void* p) { delete static_cast<T*>(p); }, nullptr};
+
+    alignas(max_align_t) byte storage[inline_size];
+    void* object {nullptr};
+    const operations* ops {nullptr};
+
+    void reset()
+    {
+        if (object == nullptr) { return; }
+        ops->destroy(object);
+        object = nullptr;
+        ops = nullptr;
+    }
+
+    void take(small_box& other)
+    {
+        if (other.object == nullptr) { return; }
+
+        ops = other.ops;
+        if (ops->relocate != nullptr)
+        {
+            ops->relocate(other.object, storage);
+            object = storage;
+        }
+        else { object = other.object; }
+
+        other.object = nullptr;
+        other.ops = nullptr;
+    }
+
+public:
+    small_box() = default;
+    small_box(small_box&& other) noexcept { take(other); }
+    small_box& operator=(small_box&& other) noexcept
+    {
+        if (this != &other)
+        {
+            reset();
+            take(other);
+        }
+        return *this;
+    }
+    ~small_box() { reset(); }
+
+    template <typename T, typename... Args>
+    T& emplace(Args&&... args)
+    {
+        reset();
+        if constexpr (fits<T>)
+        {
+            object = ::new (static_cast<void*>(storage)) T(std::forward<Args>(args)...);
+            ops = &inline_operations<T>;
+        }
+        else
+        {
+            object = new T(std::forward<Args>(args)...);
+            ops = &heap_operations<T>;
+        }
+        return *static_cast<T*>(object);
+    }
+
+    [[nodiscard]]
+    void* get() const
+    {
+        return object;
+    }
+};
+
+template <typename T>
+T& unwrap_ref(T& t)
+{
+    return t;
+}
+
+template <typename T>
+T& unwrap_ref(reference_wrapper<T> t)
+{
+    return t.get();
+}
+
+// 运行时选择的输入源, 可以存放任何 buffered_input: IBUfStream, ISpanStream, mmap_istream ...
+// 传入 ref(source) 时只引用输入源, 不拥有它
+// 只有当前窗口读完时才通过函数指针访问输入源, 窗口内的 get()/peek()/read() 是内联的
+// 本身也是 buffered_input, 可以交给 csv_reader, read_varint 等使用
+class any_istream : public InputStream<any_istream>
+{
+    struct operations
+    {
+        span<const byte> (*window)(void*);
+        size_t (*refill)(void*);
+        void (*consume)(void*, size_t);
+    };
+
+    template <typename S>
+    static constexpr operations operations_for {
+        [](void* p) -> span<const byte> { return unwrap_ref(*static_cast<S*>(p)).window(); },
+        [](void* p) -> size_t { return unwrap_ref(*static_cast<S*>(p)).refill(); },
+        [](void* p, size_t n) { unwrap_ref(*static_cast<S*>(p)).consume(n); },
+    };
+
+    small_box<128> source;
+    const operations* ops {nullptr};
+    span<const byte> buf; // 输入源的窗口
+    size_t pos {};        // buf 中已经读过但还没有通知输入源的字节数
+
+    // 把读过的字节告诉输入源
+    void sync()
+    {
+        if (pos == 0) { return; }
+        ops->consume(source.get(), pos);
+        buf = buf.subspan(pos);
+        pos = 0;
+    }
+
+    bool next_window()
+    {
+        sync();
+        buf = ops->window(source.get());
+        return !buf.empty();
+    }
+
+public:
+    using InputStream::get;
+    using InputStream::read;
+
+    template <typename S>
+        requires(!is_same_v<decay_t<S>, any_istream> && buffered_input<remove_reference_t<decltype(unwrap_ref(declval<decay_t<S>&>()))>>)
+    explicit any_istream(S&& s)
+    {
+        source.emplace<decay_t<S>>(std::forward<S>(s));
+        ops = &operations_for<decay_t<S>>;
+    }
+
+    any_istream(any_istream&& other) noexcept : ops {other.ops}
+    {
+        // 输入源移动后窗口可能失效, 重新获取
+        other.sync();
+        other.buf = {};
+        source = std::move(other.source);
+    }
+
+    any_istream& operator=(any_istream&& other) noexcept
+    {
+        if (this != &other)
+        {
+            sync();
+            other.sync();
+            other.buf = {};
+            source = std::move(other.source);
+            ops = other.ops;
+            buf = {};
+        }
+        return *this;
+    }
+
+    ~any_istream()
+    {
+        if (source.get() != nullptr) { sync(); }
+    }
+
+    span<const byte> window()
+    {
+        if (pos == size(buf)) { next_window(); }
+        return buf.subspan(pos);
+    }
+
+    void consume(size_t n) { pos += n; }
+
+    size_t refill()
+    {
+        sync();
+        size_t n = ops->refill(source.get());
+        buf = ops->window(source.get());
+        return n;
+    }
+
+    int get()
+    {
+        if (pos == size(buf) && !next_window()) { return EOF; }
+        return to_integer<unsigned char>(buf[pos++]);
+    }
+
+    int peek()
+    {
+        if (pos == size(buf) && !next_window()) { return EOF; }
+        return to_integer<unsigned char>(buf[pos]);
+    }
+
+    // 只能退回当前窗口中的字节
+    void unget()
+    {
+        if (pos > 0) { --pos; }
+    }
+
+    size_t read(span<byte> s)
+    {
+        size_t done {};
+        while (done < size(s))
+        {
+            if (pos == size(buf) && !next_window()) { break; }
+
+            size_t n = min(size(buf) - pos, size(s) - done);
+            copy_n(buf.begin() + static_cast<ptrdiff_t>(pos), n, s.begin() + static_cast<ptrdiff_t>(done));
+            pos += n;
+            done += n;
+        }
+        return done;
+    }
+
+    size_t read(span<char> s) { return read(as_writable_bytes(s)); }
+};
+
+// 运行时选择的输出, 可以存放任何 output_sink: fd_ostream, stdio_ostream, span_ostream ...
+// 传入 ref(sink) 时只引用输出, 不拥有它
+// 数据先写到内部的缓冲区, 缓冲区满或 flush() 时才通过函数指针写出, 格式化和 put() 是内联的
+class any_ostream : public OutputStream<any_ostream>
+{
+    struct operations
+    {
+        void (*write)(void*, span<const char>);
+        void (*flush)(void*);
+    };
+
+    template <typename S>
+    static constexpr operations operations_for {
+        [](void* p, span<const char> s) { unwrap_ref(*static_cast<S*>(p)).write(s); },
+        [](void* p)
+        {
+            auto& sink = unwrap_ref(*static_cast<S*>(p));
+            if constexpr (requires { sink.flush(); }) { sink.flush(); }
+        },
+    };
+
+    small_box<128> sink;
+    const operations* ops {nullptr};
+    unique_ptr<char[]> buffer;
+    size_t capacity {};
+    size_t used {};
+
+    void flush_buffer()
+    {
+        if (used == 0) { return; }
+        ops->write(sink.get(), {buffer.get(), used});
+        used = 0;
+    }
+
+public:
+    template <typename S>
+        requires(!is_same_v<decay_t<S>, any_ostream> && output_sink<remove_reference_t<decltype(unwrap_ref(declval<decay_t<S>&>()))>>)
+    explicit any_ostream(S&& s, size_t buffer_size = 8192) : buffer {make_unique_for_overwrite<char[]>(buffer_size)}, capacity {buffer_size}
+    {
+        sink.emplace<decay_t<S>>(std::forward<S>(s));
+        ops = &operations_for<decay_t<S>>;
+    }
+
+    any_ostream(any_ostream&& other) noexcept
+        : sink {std::move(other.sink)}, ops {other.ops}, buffer {std::move(other.buffer)}, capacity {exchange(other.capacity, 0)}, used {exchange(other.used, 0)}
+    {}
+
+    ~any_ostream()
+    {
+        if (sink.get() != nullptr) { discard_errors([this] { flush_buffer(); }); }
+    }
+
+    // 缓冲区中空闲的部分, 直接写入后调用 commit()
+    span<char> window()
+    {
+        if (used == capacity) { flush_buffer(); }
+        return {buffer.get() + used, capacity - used};
+    }
+
+    void commit(size_t n) { used += n; }
+
+    void put(char c)
+    {
+        if (used == capacity) { flush_buffer(); }
+        buffer[used++] = c;
+    }
+
+    void write(span<const char> s)
+    {
+        if (size(s) > capacity - used)
+        {
+            flush_buffer();
+            if (size(s) >= capacity)
+            {
+                ops->write(sink.get(), s);
+                return;
+            }
+        }
+
+        copy(s.begin(), s.end(), buffer.get() + used);
+        used += size(s);
+    }
+
+    void flush()
+    {
+        flush_buffer();
+        ops->flush(sink.get());
+    }
+};
@@ -0,0 +1,291 @@
+#pragma once
+
+#include "stream.hpp"
+#include <bit>
+#include <cstdint>
+#include <cstring>
+#include <limits>
+
+#if defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+// 任何提供 write(span<const char>) 的输出: span_ostream, buffered_ostream, fd_ostream ...
+template <typename T>
+concept output_sink = requires(T& out, span<const char> s) { out.write(s); };
+
+template <typename T>
+constexpr bool has_byte_order = is_arithmetic_v<T> || is_enum_v<T>;
+
+// 定长二进制值
+// 算术类型和枚举按 order 指定的字节序读写, 其它 trivially copyable 类型按内存布局原样读写
+
+template <typename T, output_sink Sink>
+    requires is_trivially_copyable_v<T>
+void write_binary(Sink& out, const T& value, endian order = endian::little)
+{
+    array<char, sizeof(T)> bytes;
+    memcpy(data(bytes), &value, sizeof(T));
+    if constexpr (has_byte_order<T>)
+    {
+        if (order != endian::native) { ranges::reverse(bytes); }
+    }
+
+    out.write(span<const char> {bytes});
+}
+
+template <typename T, output_sink Sink>
+    requires is_trivially_copyable_v<T>
+void write_binaries(Sink& out, span<const T> values, endian order = endian::little)
+{
+    if (!has_byte_order<T> || order == endian::native)
+    {
+        out.write(span<const char> {reinterpret_cast<const char*>(data(values)), values.size_bytes()});
+        return;
+    }
+
+    for (const T& value : values) { write_binary(out, value, order); }
+}
+
+template <typename T, buffered_input Source>
+    requires is_trivially_copyable_v<T>
+T read_binary(Source& in, endian order = endian::little)
+{
+    span<const byte> w = require_window(in, sizeof(T));
+
+    array<byte, sizeof(T)> bytes;
+    copy_n(w.begin(), sizeof(T), bytes.begin());
+    in.consume(sizeof(T));
+
+    if constexpr (has_byte_order<T>)
+    {
+        if (order != endian::native) { ranges::reverse(bytes); }
+    }
+
+    return bit_cast<T>(bytes);
+}
+
+// 整块拷贝窗口中的数据, 再原地调整字节序
+template <typename T, buffered_input Source>
+    requires is_trivially_copyable_v<T>
+void read_binaries(Source& in, span<T> values, endian order = endian::little)
+{
+    auto out = as_writable_bytes(values);
+    while (!out.empty())
+    {
+        span<const byte> w = require_window(in, 1);
+
+        size_t n = min(size(w), size(out));
+        copy_n(w.begin(), n, out.begin());
+        in.consume(n);
+        out = out.subspan(n);
+    }
+
+    if constexpr (has_byte_order<T>)
+    {
+        if (order == endian::native) { return; }
+
+        for (T& value : values)
+        {
+            auto bytes = bit_cast<array<byte, sizeof(T)>>(value);
+            ranges::reverse(bytes);
+            value = bit_cast<T>(bytes);
+        }
+    }
+}
+
+// varint (LEB128): 每个字节的低 7 位是数据, 最高位为 1 表示后面还有字节
+// zigzag 把有符号数映射为无符号数 (0, -1, 1, -2 ... -> 0, 1, 2, 3 ...), 使绝对值小的负数也编码得短
+
+template <unsigned_integral U>
+constexpr size_t max_varint_size = (numeric_limits<U>::digits + 6) / 7;
+
+template <signed_integral I>
+constexpr make_unsigned_t<I> zigzag_encode(I value)
+{
+    using U = make_unsigned_t<I>;
+    return static_cast<U>(static_cast<U>(value) << 1) ^ static_cast<U>(value >> (numeric_limits<I>::digits));
+}
+
+template <unsigned_integral U>
+constexpr make_signed_t<U> zigzag_decode(U value)
+{
+    return static_cast<make_signed_t<U>>((value >> 1) ^ (~(value & 1) + 1));
+}
+
+// 返回写入的字节数, out 至少要有 max_varint_size<U> 个字节
+template <unsigned_integral U>
+size_t encode_varint(U value, char* out)
+{
+    size_t n {};
+    while (value >= 0x80)
+    {
+        out[n++] = static_cast<char>(value | 0x80);
+        value >>= 7;
+    }
+    out[n++] = static_cast<char>(value);
+    return n;
+}
+
+// 返回下一个 varint 的起始位置; 数据不完整时返回 nullptr
+template <unsigned_integral U>
+const byte* decode_varint(const byte* first, const byte* last, U& value)
+{
+    U result {};
+    for (size_t i = 0; i < max_varint_size<U>; ++i)
+    {
+        if (first == last) { return nullptr; }
+
+        auto b = to_integer<uint8_t>(*first++);
+        if (i == max_varint_size<U> - 1 && (b >> (numeric_limits<U>::digits - 7 * i)) != 0) { break; }
+
+        result |= static_cast<U>(static_cast<U>(b & 0x7f) << (7 * i));
+        if (b < 0x80)
+        {
+            value = result;
+            return first;
+        }
+    }
+
+    throw system_error(make_error_code(errc::value_too_large));
+}
+
+template <unsigned_integral U, output_sink Sink>
+void write_varint(Sink& out, U value)
+{
+    array<char, max_varint_size<U>> bytes;
+    out.write(span<const char> {data(bytes), encode_varint(value, data(bytes))});
+}
+
+template <signed_integral I, output_sink Sink>
+void write_zigzag(Sink& out, I value)
+{
+    write_varint(out, zigzag_encode(value));
+}
+
+// 先编码到栈上的缓冲区, 凑满一块再写, 避免每个值调用一次 write
+template <unsigned_integral U, output_sink Sink>
+void write_varints(Sink& out, span<const U> values)
+{
+    array<char, 4096> bytes;
+    size_t n {};
+    for (U value : values)
+    {
+        if (size(bytes) - n < max_varint_size<U>)
+        {
+            out.write(span<const char> {data(bytes), n});
+            n = 0;
+        }
+        n += encode_varint(value, data(bytes) + n);
+    }
+    if (n > 0) { out.write(span<const char> {data(bytes), n}); }
+}
+
+template <unsigned_integral U, buffered_input Source>
+U read_varint(Source& in)
+{
+    U value {};
+
+    span<const byte> w = in.window();
+    const byte* next = decode_varint(data(w), data(w) + size(w), value);
+    while (next == nullptr) // 跨越了缓冲区边界
+    {
+        if (in.refill() == 0) { throw_stream_error(stream_error::end_of_stream); }
+        w = in.window();
+        next = decode_varint(data(w), data(w) + size(w), value);
+    }
+
+    in.consume(static_cast<size_t>(next - data(w)));
+    return value;
+}
+
+template <signed_integral I, buffered_input Source>
+I read_zigzag(Source& in)
+{
+    return zigzag_decode(read_varint<make_unsigned_t<I>>(in));
+}
+
+// 从 in 中解码尽可能多的 varint 到 out, 返回 {消费的字节数, 解码的个数}
+// 末尾不完整的 varint 保留在 in 中
+inline pair<size_t, size_t> decode_varints(span<const byte> in, span<uint64_t> out)
+{
+    const byte* p = data(in);
+    const byte* last = p + size(in);
+    size_t n {};
+
+#if defined(__SSE2__)
+    // 每次看 16 字节: movemask 取出续位, 续位为 0 的字节就是一个 varint 的结尾
+    // 保证从块内任何位置都能安全地读 8 字节
+    while (last - p >= 24 && size(out) - n >= 16)
+    {
+        auto continuation = static_cast<uint32_t>(_mm_movemask_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i*>(p))));
+
+        if (continuation == 0) // 16 个单字节 varint
+        {
+            for (size_t i = 0; i < 16; ++i) { out[n + i] = to_integer<uint8_t>(p[i]); }
+            p += 16;
+            n += 16;
+            continue;
+        }
+
+        uint32_t ends = ~continuation & 0xffff;
+        if (ends == 0) { break; } // 超过 16 字节的 varint 一定非法, 交给后面的逐字节解码报错
+
+        size_t start {};
+        while (ends != 0)
+        {
+            auto end = static_cast<size_t>(countr_zero(ends));
+            size_t length = end - start + 1;
+
+            if (length <= 8)
+            {
+                uint64_t word;
+                memcpy(&word, p + start, sizeof(word));
+                if constexpr (endian::native == endian::big) { word = byteswap(word); }
+                if (length < 8) { word &= (uint64_t {1} << (8 * length)) - 1; }
+#if defined(__BMI2__)
+                out[n++] = _pext_u64(word, 0x7f7f7f7f7f7f7f7f);
+#else
+                uint64_t value {};
+                for (size_t i = 0; i < length; ++i) { value |= ((word >> (8 * i)) & 0x7f) << (7 * i); }
+                out[n++] = value;
+#endif
+            }
+            else { decode_varint(p + start, last, out[n++]); }
+
+            start = end + 1;
+            ends &= ends - 1;
+        }
+        p += start;
+    }
+#endif
+
+    while (n < size(out) && p != last)
+    {
+        const byte* next = decode_varint(p, last, out[n]);
+        if (next == nullptr) { break; }
+        p = next;
+        ++n;
+    }
+
+    return {static_cast<size_t>(p - data(in)), n};
+}
+
+// 批量读取, 返回读到的个数; 少于 size(out) 说明到了 EOF
+template <buffered_input Source>
+size_t read_varints(Source& in, span<uint64_t> out)
+{
+    size_t count {};
+    while (count < size(out))
+    {
+        span<const byte> w = in.window();
+        if (w.empty()) { break; }
+
+        auto [consumed, decoded] = decode_varints(w, out.subspan(count));
+        in.consume(consumed);
+        count += decoded;
+
+        if (decoded == 0 && in.refill() == 0) { throw_stream_error(stream_error::end_of_stream); }
+    }
+    return count;
+}
@@ -0,0 +1,250 @@
+#pragma once
+
+#include "binary_stream.hpp"
+#include "stream.hpp"
+#include <array>
+#include <cstring>
+
+#if defined(__SSE4_2__)
+#include <immintrin.h>
+#endif
+#if __has_include(<xxhash.h>)
+#include <xxhash.h>
+#endif
+
+// 校验和: update() 依次加入数据, value() 得到目前为止的结果
+template <typename H>
+concept stream_hasher = requires(H h, span<const byte> s) {
+    h.update(s);
+    h.value();
+};
+
+namespace crc32c_detail
+{
+    constexpr uint32_t poly = 0x82f63b78; // Castagnoli 多项式, 按位反转
+
+    // 反转表示下的 a * b mod P, 最高位是 x^0; a 不能为 0
+    constexpr uint32_t multmodp(uint32_t a, uint32_t b)
+    {
+        uint32_t m = uint32_t {1} << 31;
+        uint32_t p {};
+        while (true)
+        {
+            if ((a & m) != 0)
+            {
+                p ^= b;
+                if ((a & (m - 1)) == 0) { break; }
+            }
+            m >>= 1;
+            b = (b & 1) != 0 ? (b >> 1) ^ poly : b >> 1;
+        }
+        return p;
+    }
+
+    // x^n mod P
+    constexpr uint32_t xnmodp(uint64_t n)
+    {
+        uint32_t result = uint32_t {1} << 31;
+        uint32_t square = uint32_t {1} << 30;
+        for (; n != 0; n >>= 1)
+        {
+            if ((n & 1) != 0) { result = multmodp(square, result); }
+            square = multmodp(square, square);
+        }
+        return result;
+    }
+
+    // slicing-by-8 查找表
+    constexpr auto tables = []
+    {
+        array<array<uint32_t, 256>, 8> t {};
+        for (uint32_t i = 0; i < 256; ++i)
+        {
+            uint32_t c = i;
+            for (int k = 0; k < 8; ++k) { c = (c & 1) != 0 ? (c >> 1) ^ poly : c >> 1; }
+            t[0][i] = c;
+        }
+        for (size_t k = 1; k < 8; ++k)
+        {
+            for (size_t i = 0; i < 256; ++i) { t[k][i] = (t[k - 1][i] >> 8) ^ t[0][t[k - 1][i] & 0xff]; }
+        }
+        return t;
+    }();
+
+    inline uint32_t update_table(uint32_t crc, const unsigned char* p, size_t n)
+    {
+        const auto& t = tables;
+        for (; n >= 8; n -= 8, p += 8)
+        {
+            uint32_t lo = crc ^ (p[0] | uint32_t {p[1]} << 8 | uint32_t {p[2]} << 16 | uint32_t {p[3]} << 24);
+            uint32_t hi = p[4] | uint32_t {p[5]} << 8 | uint32_t {p[6]} << 16 | uint32_t {p[7]} << 24;
+            crc = t[7][lo & 0xff] ^ t[6][(lo >> 8) & 0xff] ^ t[5][(lo >> 16) & 0xff] ^ t[4][lo >> 24] ^ t[3][hi & 0xff] ^ t[2][(hi >> 8) & 0xff]
+                  ^ t[1][(hi >> 16) & 0xff] ^ t[0][hi >> 24];
+        }
+        for (; n > 0; --n, ++p) { crc = (crc >> 8) ^ t[0][(crc ^ *p) & 0xff]; }
+        return crc;
+    }
+
+#if defined(__SSE4_2__)
+    // crc32 指令的延迟是 3 个周期, 三段数据交错计算才能每个周期处理 8 字节, 最后把三段的结果合并
+    // 合并时把前一段的结果乘以 x^(8 * length): 有 PCLMUL 时用无进位乘法再由 crc32 指令取模
+#if defined(__PCLMUL__)
+    constexpr uint32_t shift_constant(size_t length)
+    {
+        return xnmodp(8 * length - 33);
+    }
+
+    inline uint32_t shift(uint32_t crc, uint32_t k)
+    {
+        __m128i product = _mm_clmulepi64_si128(_mm_cvtsi32_si128(static_cast<int>(crc)), _mm_cvtsi32_si128(static_cast<int>(k)), 0);
+        return static_cast<uint32_t>(_mm_crc32_u64(0, static_cast<uint64_t>(_mm_cvtsi128_si64(product))));
+    }
+#else
+    constexpr uint32_t shift_constant(size_t length)
+    {
+        return xnmodp(8 * length);
+    }
+
+    inline uint32_t shift(uint32_t crc, uint32_t k)
+    {
+        return multmodp(k, crc);
+    }
+#endif
+
+    inline uint64_t load64(const unsigned char* p)
+    {
+        uint64_t v;
+        memcpy(&v, p, sizeof(v));
+        return v;
+    }
+
+    template <size_t lane>
+    uint32_t update_lanes(uint32_t crc, const unsigned char*& p, size_t& n)
+    {
+        static constexpr uint32_t k = shift_constant(lane);
+
+        uint64_t c0 = crc;
+        for (; n >= 3 * lane; p += 3 * lane, n -= 3 * lane)
+        {
+            uint64_t c1 {};
+            uint64_t c2 {};
+            for (size_t i = 0; i < lane; i += 8)
+            {
+                c0 = _mm_crc32_u64(c0, load64(p + i));
+                c1 = _mm_crc32_u64(c1, load64(p + lane + i));
+                c2 = _mm_crc32_u64(c2, load64(p + 2 * lane + i));
+            }
+            c0 = shift(static_cast<uint32_t>(c0), k) ^ c1;
+            c0 = shift(static_cast<uint32_t>(c0), k) ^ c2;
+        }
+        return static_cast<uint32_t>(c0);
+    }
+
+    inline uint32_t update_hardware(uint32_t crc, const unsigned char* p, size_t n)
+    {
+        crc = update_lanes<4096>(crc, p, n);
+        crc = update_lanes<256>(crc, p, n);
+
+        uint64_t c = crc;
+        for (; n >= 8; p += 8, n -= 8) { c = _mm_crc32_u64(c, load64(p)); }
+        for (; n > 0; ++p, --n) { c = _mm_crc32_u8(static_cast<uint32_t>(c), *p); }
+        return static_cast<uint32_t>(c);
+    }
+#endif
+
+    inline uint32_t update(uint32_t crc, span<const byte> s)
+    {
+        auto p = reinterpret_cast<const unsigned char*>(data(s));
+#if defined(__SSE4_2__)
+        return update_hardware(crc, p, size(s));
+#else
+        return update_table(crc, p, size(s));
+#endif
+    }
+} // namespace crc32c_detail
+
+// CRC-32C (iSCSI, ext4, RocksDB 使用的校验和), 有 SSE4.2 时使用 crc32 指令
+class crc32c
+{
+    uint32_t crc {~uint32_t {}};
+
+public:
+    void update(span<const byte> s) { crc = crc32c_detail::update(crc, s); }
+
+    [[nodiscard]]
+    uint32_t value() const
+    {
+        return ~crc;
+    }
+
+    void reset() { crc = ~uint32_t {}; }
+};
+
+#if __has_include(<xxhash.h>)
+
+// 64 位 XXH3, 使用系统的 libxxhash
+class xxh3_64
+{
+    unique_ptr<XXH3_state_t, XXH_errorcode (*)(XXH3_state_t*)> state {XXH3_createState(), XXH3_freeState};
+    uint64_t seed;
+
+public:
+    explicit xxh3_64(uint64_t seed_ = 0) : seed {seed_}
+    {
+        if (state == nullptr) { throw bad_alloc {}; }
+        reset();
+    }
+
+    void update(span<const byte> s) { XXH3_64bits_update(state.get(), data(s), size(s)); }
+
+    [[nodiscard]]
+    uint64_t value() const
+    {
+        return XXH3_64bits_digest(state.get());
+    }
+
+    void reset() { XXH3_64bits_reset_withSeed(state.get(), seed); }
+};
+
+#endif
+
+// 包装 IBUfStream 的 InputHandler, 计算读到的每个字节的校验和
+// 每块数据刚读进 IBUfStream 的缓冲区, 还在缓存中时就计算, 不需要再读一遍文件
+template <typename Handler, stream_hasher Hasher>
+class checksum_reader
+{
+    Handler handler;
+    Hasher& hasher;
+
+public:
+    checksum_reader(Handler handler_, Hasher& hasher_) : handler {std::move(handler_)}, hasher {hasher_} {}
+
+    size_t read(span<byte> s)
+    {
+        size_t n = handler.read(s);
+        hasher.update(s.first(n));
+        return n;
+    }
+};
+
+// 计算写入 sink 的每个字节的校验和, 放在 buffered_ostream 下面时每次计算一整个缓冲区
+template <output_sink Sink, stream_hasher Hasher>
+class checksum_sink
+{
+    Sink& sink;
+    Hasher& hasher;
+
+public:
+    checksum_sink(Sink& sink_, Hasher& hasher_) : sink {sink_}, hasher {hasher_} {}
+
+    void write(span<const char> s)
+    {
+        hasher.update(as_bytes(s));
+        sink.write(s);
+    }
+
+    void flush()
+    {
+        if constexpr (requires { sink.flush(); }) { sink.flush(); }
+    }
+};
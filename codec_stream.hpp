@@ -0,0 +1,494 @@
+#pragma once
+
+#include "filter_stream.hpp"
+#include "stream.hpp"
+#include "utf8_stream.hpp"
+#include <array>
+#include <string_view>
+
+#if defined(__SSSE3__)
+#include <immintrin.h>
+#endif
+
+// base64 和十六进制的编码与解码, 都是 stream_filter:
+// 解码输入用 filter_reader, 编码输出用 filter_sink, 数据可以在任意位置被缓冲区边界切开
+// 非法的输入抛出 encoding_error, 位置是出错的那一组字符的开头
+
+// 把输入按 in_block 字节一组变换为 out_block 字节, 处理跨越缓冲区的组和放不下的输出
+// Codec 提供:
+//   bulk(in, blocks, out): 连续变换多组, 返回成功的组数, 遇到需要特殊处理的组时提前返回
+//   block(in, out):        变换一组, 返回输出的字节数, 非法时返回 invalid
+//   tail(in, n, out):      输入结束时变换不足一组的 n 个字节
+template <typename Codec>
+class block_filter
+{
+    array<byte, 4> carry {};
+    size_t carried {};
+    array<byte, 4> pending {};
+    size_t pending_first {};
+    size_t pending_last {};
+    uint64_t position {};
+    bool finished {false};
+
+    Codec& codec() { return static_cast<Codec&>(*this); }
+
+    void drain(span<byte> out, size_t& o)
+    {
+        size_t n = min(pending_last - pending_first, size(out) - o);
+        copy_n(pending.begin() + static_cast<ptrdiff_t>(pending_first), n, out.begin() + static_cast<ptrdiff_t>(o));
+        pending_first += n;
+        o += n;
+    }
+
+    void emit(const array<byte, 4>& bytes, size_t n, span<byte> out, size_t& o)
+    {
+        pending = bytes;
+        pending_first = 0;
+        pending_last = n;
+        drain(out, o);
+    }
+
+    [[noreturn]]
+    void fail(uint64_t offset)
+    {
+        throw encoding_error(Codec::error_message, offset);
+    }
+
+public:
+    static constexpr size_t invalid = ~size_t {};
+
+    filter_result transform(span<const byte> in, span<byte> out, filter_flush mode)
+    {
+        constexpr size_t in_block = Codec::in_block;
+        constexpr size_t out_block = Codec::out_block;
+
+        size_t i {};
+        size_t o {};
+        drain(out, o);
+
+        while (pending_first == pending_last && o < size(out))
+        {
+            array<byte, 4> block {};
+            size_t n {};
+
+            if (carried > 0 || size(in) - i < in_block)
+            {
+                // 上一次剩下的字节和这一次的开头凑成一组
+                size_t k = min(in_block - carried, size(in) - i);
+                copy_n(in.begin() + static_cast<ptrdiff_t>(i), k, carry.begin() + static_cast<ptrdiff_t>(carried));
+                carried += k;
+                i += k;
+                if (carried < in_block) { break; }
+
+                carried = 0;
+                n = codec().block(data(carry), data(block));
+                if (n == invalid) { fail(position + i - in_block); }
+            }
+            else
+            {
+                size_t blocks = min((size(in) - i) / in_block, (size(out) - o) / out_block);
+                size_t done = blocks > 0 ? codec().bulk(data(in) + i, blocks, data(out) + o) : 0;
+                i += done * in_block;
+                o += done * out_block;
+                if (done == blocks && blocks > 0) { continue; }
+                if (size(in) - i < in_block) { continue; }
+
+                // 需要特殊处理的组, 或者输出空间不够一组
+                n = codec().block(data(in) + i, data(block));
+                if (n == invalid) { fail(position + i); }
+                i += in_block;
+            }
+            emit(block, n, out, o);
+        }
+
+        if (mode == filter_flush::finish && i == size(in) && pending_first == pending_last && !finished)
+        {
+            array<byte, 4> block {};
+            size_t n = codec().tail(data(carry), carried, data(block));
+            if (n == invalid) { fail(position + i - carried); }
+
+            carried = 0;
+            finished = true;
+            emit(block, n, out, o);
+        }
+
+        position += i;
+        return {i, o, finished && pending_first == pending_last};
+    }
+};
+
+enum class base64_alphabet
+{
+    standard, // RFC 4648 第 4 节, + 和 /
+    url,      // RFC 4648 第 5 节, - 和 _
+};
+
+namespace codec_detail
+{
+    constexpr string_view base64_standard_chars {"ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/"};
+    constexpr string_view base64_url_chars {"ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789-_"};
+
+    constexpr string_view base64_chars(base64_alphabet alphabet)
+    {
+        return alphabet == base64_alphabet::standard ? base64_standard_chars : base64_url_chars;
+    }
+
+    // 字符到 6 位值的查找表, 非法字符为 -1
+    constexpr array<int8_t, 256> base64_values(base64_alphabet alphabet)
+    {
+        array<int8_t, 256> t {};
+        t.fill(-1);
+        string_view chars = base64_chars(alphabet);
+        for (size_t i = 0; i < size(chars); ++i) { t[static_cast<unsigned char>(chars[i])] = static_cast<int8_t>(i); }
+        return t;
+    }
+
+    constexpr array<int8_t, 256> base64_standard_values = base64_values(base64_alphabet::standard);
+    constexpr array<int8_t, 256> base64_url_values = base64_values(base64_alphabet::url);
+
+    constexpr array<int8_t, 256> hex_values = []
+    {
+        array<int8_t, 256> t {};
+        t.fill(-1);
+        for (int i = 0; i < 10; ++i) { t['0' + i] = static_cast<int8_t>(i); }
+        for (int i = 0; i < 6; ++i)
+        {
+            t['a' + i] = static_cast<int8_t>(10 + i);
+            t['A' + i] = static_cast<int8_t>(10 + i);
+        }
+        return t;
+    }();
+
+#if defined(__SSSE3__)
+    // Muła, Lemire: Faster Base64 Encoding and Decoding Using AVX2 Instructions, 这里是 SSSE3 版本
+    // 12 字节拆成 16 个 6 位的值, 再按值所在的区间加上偏移量得到字符
+    inline __m128i base64_encode_vector(__m128i in, __m128i shift_lut)
+    {
+        in = _mm_shuffle_epi8(in, _mm_set_epi8(10, 11, 9, 10, 7, 8, 6, 7, 4, 5, 3, 4, 1, 2, 0, 1));
+        __m128i t0 = _mm_and_si128(in, _mm_set1_epi32(0x0fc0fc00));
+        __m128i t1 = _mm_mulhi_epu16(t0, _mm_set1_epi32(0x04000040));
+        __m128i t2 = _mm_and_si128(in, _mm_set1_epi32(0x003f03f0));
+        __m128i t3 = _mm_mullo_epi16(t2, _mm_set1_epi32(0x01000010));
+        __m128i indices = _mm_or_si128(t1, t3);
+
+        __m128i range = _mm_subs_epu8(indices, _mm_set1_epi8(51));
+        __m128i less = _mm_cmpgt_epi8(_mm_set1_epi8(26), indices);
+        range = _mm_or_si128(range, _mm_and_si128(less, _mm_set1_epi8(13)));
+        return _mm_add_epi8(_mm_shuffle_epi8(shift_lut, range), indices);
+    }
+
+    // 16 个字符还原为 12 字节, 有标准字母表以外的字符时返回 false
+    inline bool base64_decode_vector(__m128i in, __m128i& out)
+    {
+        const __m128i lut_lo = _mm_setr_epi8(0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x13, 0x1a, 0x1b, 0x1b, 0x1b, 0x1a);
+        const __m128i lut_hi = _mm_setr_epi8(0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10);
+        const __m128i lut_roll = _mm_setr_epi8(0, 16, 19, 4, -65, -65, -71, -71, 0, 0, 0, 0, 0, 0, 0, 0);
+
+        __m128i hi_nibbles = _mm_and_si128(_mm_srli_epi32(in, 4), _mm_set1_epi8(0x0f));
+        __m128i lo_nibbles = _mm_and_si128(in, _mm_set1_epi8(0x0f));
+        __m128i lo = _mm_shuffle_epi8(lut_lo, lo_nibbles);
+        __m128i hi = _mm_shuffle_epi8(lut_hi, hi_nibbles);
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_and_si128(lo, hi), _mm_setzero_si128())) != 0xffff) { return false; }
+
+        __m128i eq_2f = _mm_cmpeq_epi8(in, _mm_set1_epi8(0x2f));
+        __m128i roll = _mm_shuffle_epi8(lut_roll, _mm_add_epi8(eq_2f, hi_nibbles));
+        __m128i values = _mm_add_epi8(in, roll);
+
+        __m128i merged = _mm_maddubs_epi16(values, _mm_set1_epi32(0x01400140));
+        merged = _mm_madd_epi16(merged, _mm_set1_epi32(0x00011000));
+        out = _mm_shuffle_epi8(merged, _mm_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1));
+        return true;
+    }
+#endif
+} // namespace codec_detail
+
+class base64_encoder : public block_filter<base64_encoder>
+{
+    base64_alphabet alphabet;
+    bool padding;
+
+public:
+    static constexpr size_t in_block = 3;
+    static constexpr size_t out_block = 4;
+    static constexpr const char* error_message = "Invalid base64 input.";
+
+    // URL 安全的 base64 通常不加 '=' 填充
+    explicit base64_encoder(base64_alphabet alphabet_ = base64_alphabet::standard, bool padding_ = true) : alphabet {alphabet_}, padding {padding_} {}
+
+    size_t bulk(const byte* in, size_t blocks, byte* out) const
+    {
+        size_t done {};
+        string_view chars = codec_detail::base64_chars(alphabet);
+
+#if defined(__SSSE3__)
+        bool url = alphabet == base64_alphabet::url;
+        const __m128i shift_lut = _mm_setr_epi8('a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+                                                '0' - 52, static_cast<char>((url ? '-' : '+') - 62), static_cast<char>((url ? '_' : '/') - 63), 'A', 0, 0);
+
+        // 每次读 16 字节, 用其中的 12 字节
+        for (; done + 6 <= blocks; done += 4)
+        {
+            __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(in + 3 * done));
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(out + 4 * done), codec_detail::base64_encode_vector(v, shift_lut));
+        }
+#endif
+
+        for (; done < blocks; ++done)
+        {
+            const byte* p = in + 3 * done;
+            uint32_t v = to_integer<uint32_t>(p[0]) << 16 | to_integer<uint32_t>(p[1]) << 8 | to_integer<uint32_t>(p[2]);
+            byte* q = out + 4 * done;
+            q[0] = static_cast<byte>(chars[v >> 18]);
+            q[1] = static_cast<byte>(chars[v >> 12 & 0x3f]);
+            q[2] = static_cast<byte>(chars[v >> 6 & 0x3f]);
+            q[3] = static_cast<byte>(chars[v & 0x3f]);
+        }
+        return blocks;
+    }
+
+    size_t block(const byte* in, byte* out) const
+    {
+        bulk(in, 1, out);
+        return 4;
+    }
+
+    size_t tail(const byte* in, size_t n, byte* out) const
+    {
+        if (n == 0) { return 0; }
+
+        string_view chars = codec_detail::base64_chars(alphabet);
+        uint32_t v = to_integer<uint32_t>(in[0]) << 16 | (n > 1 ? to_integer<uint32_t>(in[1]) << 8 : 0);
+        out[0] = static_cast<byte>(chars[v >> 18]);
+        out[1] = static_cast<byte>(chars[v >> 12 & 0x3f]);
+        if (n > 1) { out[2] = static_cast<byte>(chars[v >> 6 & 0x3f]); }
+        if (!padding) { return n + 1; }
+
+        if (n == 1) { out[2] = byte {'='}; }
+        out[3] = byte {'='};
+        return 4;
+    }
+};
+
+// 接受有 '=' 填充和没有填充的输入, 填充之后不能再有数据
+class base64_decoder : public block_filter<base64_decoder>
+{
+    base64_alphabet alphabet;
+    const array<int8_t, 256>* values;
+    bool ended {false};
+
+    // n 个字符 (2 到 4 个) 还原为 n - 1 个字节
+    size_t decode(const byte* in, size_t n, byte* out) const
+    {
+        uint32_t v {};
+        for (size_t k = 0; k < n; ++k)
+        {
+            int8_t x = (*values)[to_integer<unsigned char>(in[k])];
+            if (x < 0) { return invalid; }
+            v = v << 6 | static_cast<uint32_t>(x);
+        }
+        v <<= 6 * (4 - n);
+
+        out[0] = static_cast<byte>(v >> 16);
+        if (n > 2) { out[1] = static_cast<byte>(v >> 8); }
+        if (n > 3) { out[2] = static_cast<byte>(v); }
+        return n - 1;
+    }
+
+public:
+    static constexpr size_t in_block = 4;
+    static constexpr size_t out_block = 3;
+    static constexpr const char* error_message = "Invalid base64 input.";
+
+    explicit base64_decoder(base64_alphabet alphabet_ = base64_alphabet::standard)
+        : alphabet {alphabet_}, values {alphabet_ == base64_alphabet::standard ? &codec_detail::base64_standard_values : &codec_detail::base64_url_values}
+    {}
+
+    size_t bulk(const byte* in, size_t blocks, byte* out) const
+    {
+        if (ended) { return 0; }
+
+        size_t done {};
+#if defined(__SSSE3__)
+        // 每次写 16 字节, 用其中的 12 字节
+        for (; done + 6 <= blocks; done += 4)
+        {
+            __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(in + 4 * done));
+            if (alphabet == base64_alphabet::url)
+            {
+                // 先排除 + 和 /, 再把 - 和 _ 换成它们
+                __m128i plus = _mm_cmpeq_epi8(v, _mm_set1_epi8('+'));
+                __m128i slash = _mm_cmpeq_epi8(v, _mm_set1_epi8('/'));
+                if (_mm_movemask_epi8(_mm_or_si128(plus, slash)) != 0) { break; }
+
+                __m128i minus = _mm_cmpeq_epi8(v, _mm_set1_epi8('-'));
+                __m128i underscore = _mm_cmpeq_epi8(v, _mm_set1_epi8('_'));
+                v = _mm_add_epi8(v, _mm_and_si128(minus, _mm_set1_epi8('+' - '-')));
+                v = _mm_add_epi8(v, _mm_and_si128(underscore, _mm_set1_epi8('/' - '_')));
+            }
+
+            __m128i decoded;
+            if (!codec_detail::base64_decode_vector(v, decoded)) { break; }
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(out + 3 * done), decoded);
+        }
+#endif
+
+        for (; done < blocks; ++done)
+        {
+            if (decode(in + 4 * done, 4, out + 3 * done) == invalid) { break; }
+        }
+        return done;
+    }
+
+    size_t block(const byte* in, byte* out)
+    {
+        if (ended) { return invalid; }
+
+        size_t n = 4;
+        if (in[3] == byte {'='}) { n = in[2] == byte {'='} ? 2 : 3; }
+        if (n < 4) { ended = true; }
+        return decode(in, n, out);
+    }
+
+    size_t tail(const byte* in, size_t n, byte* out)
+    {
+        if (n == 0) { return 0; }
+        if (n == 1 || ended) { return invalid; }
+        return decode(in, n, out);
+    }
+};
+
+class hex_encoder : public block_filter<hex_encoder>
+{
+    const char* digits;
+
+public:
+    static constexpr size_t in_block = 1;
+    static constexpr size_t out_block = 2;
+    static constexpr const char* error_message = "Invalid hex input.";
+
+    explicit hex_encoder(bool uppercase = false) : digits {uppercase ? "0123456789ABCDEF" : "0123456789abcdef"} {}
+
+    size_t bulk(const byte* in, size_t blocks, byte* out) const
+    {
+        size_t done {};
+#if defined(__SSSE3__)
+        const __m128i lut = _mm_loadu_si128(reinterpret_cast<const __m128i*>(digits));
+        for (; done + 16 <= blocks; done += 16)
+        {
+            __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(in + done));
+            __m128i hi = _mm_shuffle_epi8(lut, _mm_and_si128(_mm_srli_epi16(v, 4), _mm_set1_epi8(0x0f)));
+            __m128i lo = _mm_shuffle_epi8(lut, _mm_and_si128(v, _mm_set1_epi8(0x0f)));
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(out + 2 * done), _mm_unpacklo_epi8(hi, lo));
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(out + 2 * done + 16), _mm_unpackhi_epi8(hi, lo));
+        }
+#endif
+
+        for (; done < blocks; ++done)
+        {
+            auto c = to_integer<unsigned char>(in[done]);
+            out[2 * done] = static_cast<byte>(digits[c >> 4]);
+            out[2 * done + 1] = static_cast<byte>(digits[c & 0x0f]);
+        }
+        return blocks;
+    }
+
+    size_t block(const byte* in, byte* out) const { return 2 * bulk(in, 1, out); }
+
+    size_t tail(const byte*, size_t, byte*) const { return 0; }
+};
+
+// 大小写都接受
+class hex_decoder : public block_filter<hex_decoder>
+{
+public:
+    static constexpr size_t in_block = 2;
+    static constexpr size_t out_block = 1;
+    static constexpr const char* error_message = "Invalid hex input.";
+
+    size_t bulk(const byte* in, size_t blocks, byte* out) const
+    {
+        size_t done {};
+#if defined(__SSSE3__)
+        // 32 个字符还原为 16 字节
+        auto values = [](__m128i v, __m128i& valid)
+        {
+            __m128i digit = _mm_sub_epi8(v, _mm_set1_epi8('0'));
+            __m128i is_digit = _mm_cmpeq_epi8(_mm_min_epu8(digit, _mm_set1_epi8(9)), digit);
+            __m128i letter = _mm_sub_epi8(_mm_or_si128(v, _mm_set1_epi8(0x20)), _mm_set1_epi8('a'));
+            __m128i is_letter = _mm_cmpeq_epi8(_mm_min_epu8(letter, _mm_set1_epi8(5)), letter);
+            valid = _mm_and_si128(valid, _mm_or_si128(is_digit, is_letter));
+            return _mm_or_si128(_mm_and_si128(is_digit, digit), _mm_and_si128(is_letter, _mm_add_epi8(letter, _mm_set1_epi8(10))));
+        };
+
+        for (; done + 16 <= blocks; done += 16)
+        {
+            __m128i valid = _mm_set1_epi8(-1);
+            __m128i a = values(_mm_loadu_si128(reinterpret_cast<const __m128i*>(in + 2 * done)), valid);
+            __m128i b = values(_mm_loadu_si128(reinterpret_cast<const __m128i*>(in + 2 * done + 16)), valid);
+            if (_mm_movemask_epi8(valid) != 0xffff) { break; }
+
+            // 相邻两个值合并为 hi * 16 + lo
+            __m128i weights = _mm_set1_epi16(0x0110);
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(out + done), _mm_packus_epi16(_mm_maddubs_epi16(a, weights), _mm_maddubs_epi16(b, weights)));
+        }
+#endif
+
+        for (; done < blocks; ++done)
+        {
+            if (block(in + 2 * done, out + done) == invalid) { break; }
+        }
+        return done;
+    }
+
+    size_t block(const byte* in, byte* out) const
+    {
+        int8_t hi = codec_detail::hex_values[to_integer<unsigned char>(in[0])];
+        int8_t lo = codec_detail::hex_values[to_integer<unsigned char>(in[1])];
+        if (hi < 0 || lo < 0) { return invalid; }
+
+        out[0] = static_cast<byte>(hi << 4 | lo);
+        return 1;
+    }
+
+    size_t tail(const byte*, size_t n, byte*) const { return n == 0 ? 0 : invalid; }
+};
+
+// 整段数据的编码和解码, 用于记录中嵌入的字段
+template <stream_filter Filter>
+vector<byte> apply_filter(Filter filter, span<const byte> in, size_t expected_size)
+{
+    vector<byte> out(expected_size + 4);
+    size_t produced {};
+    while (true)
+    {
+        filter_result r = filter.transform(in, span<byte>(out).subspan(produced), filter_flush::finish);
+        in = in.subspan(r.consumed);
+        produced += r.produced;
+        if (r.end) { break; }
+        if (produced == size(out)) { out.resize(size(out) * 2); }
+    }
+    out.resize(produced);
+    return out;
+}
+
+inline string encode_base64(span<const byte> in, base64_alphabet alphabet = base64_alphabet::standard, bool padding = true)
+{
+    vector<byte> out = apply_filter(base64_encoder {alphabet, padding}, in, (size(in) + 2) / 3 * 4);
+    return {reinterpret_cast<const char*>(data(out)), size(out)};
+}
+
+inline vector<byte> decode_base64(string_view in, base64_alphabet alphabet = base64_alphabet::standard)
+{
+    return apply_filter(base64_decoder {alphabet}, as_bytes(span {in}), size(in) / 4 * 3 + 3);
+}
+
+inline string encode_hex(span<const byte> in, bool uppercase = false)
+{
+    vector<byte> out = apply_filter(hex_encoder {uppercase}, in, size(in) * 2);
+    return {reinterpret_cast<const char*>(data(out)), size(out)};
+}
+
+inline vector<byte> decode_hex(string_view in)
+{
+    return apply_filter(hex_decoder {}, as_bytes(span {in}), size(in) / 2);
+}
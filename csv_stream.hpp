@@ -0,0 +1,170 @@
+#pragma once
+
+#include "simd.hpp"
+#include "stream.hpp"
+#include <bit>
+#include <cstdint>
+#include <string_view>
+
+// 分隔符文本 (CSV/TSV) 的记录读取器
+// 每次取 64 字节, 用位掩码同时找出分隔符, 引号和换行, 引号内的分隔符和换行被忽略
+// 每个块只扫描一次, 位掩码在多次 next() 之间保留, 短记录不会重复扫描
+// 字段是指向 in 缓冲区的 string_view, 只在下一次调用 next() 之前有效
+// 被引号包围的字段去掉引号, 其中的 "" 还原为 ", 行尾的 \r 被去掉
+template <buffered_input Source>
+class csv_reader
+{
+    struct field_range
+    {
+        size_t first;
+        size_t last;
+    };
+
+    Source& in;
+    char delimiter;
+    char quote;
+
+    size_t record_size {};
+    size_t field_start {};
+    // 已经建立索引的最后一个 64 字节块: 相对窗口开头的位置 (消费之后可能为负), 其中还没有处理的结构字符
+    // 一个块只扫描一次, 块中的多条短记录依次从 pending 中取出
+    ptrdiff_t block {-64};
+    uint64_t pending {};
+    uint64_t quoted {}; // 已经扫描的部分结束时是否在引号内, 全 0 或全 1
+    bool at_end {false}; // 已经扫描到了 EOF
+    vector<field_range> ranges;
+    vector<string_view> fields;
+    string unescaped;
+
+    // 64 字节块中分隔符和换行的位置, 引号内的除外; 只看前 length 个
+    uint64_t index_block(const char* data, size_t length)
+    {
+        uint64_t valid = length == 64 ? ~uint64_t {} : (uint64_t {1} << length) - 1;
+
+        uint64_t inside {};
+        if (quote != '\0')
+        {
+            inside = prefix_xor(char_mask(data, quote) & valid) ^ quoted;
+            quoted = static_cast<uint64_t>(static_cast<int64_t>(inside) >> 63);
+        }
+
+        return (char_mask(data, delimiter) | char_mask(data, '\n')) & ~inside & valid;
+    }
+
+    span<const string_view> make_fields(const char* base)
+    {
+        fields.clear();
+        unescaped.clear();
+        unescaped.reserve(record_size); // 保证追加时不会扩容, 之前的 string_view 保持有效
+
+        for (const field_range& r : ranges)
+        {
+            string_view field {base + r.first, r.last - r.first};
+            if (&r == &ranges.back() && field.ends_with('\r')) { field.remove_suffix(1); }
+
+            if (quote != '\0' && size(field) >= 2 && field.front() == quote && field.back() == quote)
+            {
+                field = field.substr(1, size(field) - 2);
+                if (field.find(quote) != string_view::npos)
+                {
+                    size_t begin = size(unescaped);
+                    for (size_t i = 0; i < size(field); ++i)
+                    {
+                        unescaped.push_back(field[i]);
+                        if (field[i] == quote) { ++i; }
+                    }
+                    field = string_view(unescaped).substr(begin);
+                }
+            }
+
+            fields.push_back(field);
+        }
+
+        return fields;
+    }
+
+public:
+    // quote 为 '\0' 时不处理引号, 适用于 TSV
+    explicit csv_reader(Source& in_, char delimiter_ = ',', char quote_ = '"') : in {in_}, delimiter {delimiter_}, quote {quote_} {}
+
+    // 读取下一条记录, EOF 时返回 nullopt
+    optional<span<const string_view>> next()
+    {
+        in.consume(record_size);
+        block -= static_cast<ptrdiff_t>(record_size);
+        record_size = 0;
+        field_start = 0;
+        ranges.clear();
+
+        // 记录总是从窗口开头开始, refill() 保留未消费的字节, 所以偏移量在补充数据之后仍然有效
+        span<const byte> w = in.window();
+        while (true)
+        {
+            const char* base = reinterpret_cast<const char*>(data(w));
+            for (; pending != 0; pending &= pending - 1)
+            {
+                size_t i = static_cast<size_t>(block) + static_cast<size_t>(countr_zero(pending));
+                ranges.push_back({field_start, i});
+                field_start = i + 1;
+
+                if (base[i] == '\n')
+                {
+                    record_size = i + 1;
+                    pending &= pending - 1;
+                    return make_fields(base);
+                }
+            }
+            if (at_end) { break; }
+
+            auto next = static_cast<size_t>(block + 64);
+            if (next + 64 <= size(w))
+            {
+                pending = index_block(base + next, 64);
+                block = static_cast<ptrdiff_t>(next);
+                continue;
+            }
+
+            bool more = in.refill() != 0;
+            w = in.window();
+            if (more) { continue; }
+
+            // 最后不足 64 字节的部分
+            base = reinterpret_cast<const char*>(data(w));
+            array<char, 64> padded {};
+            copy_n(base + next, size(w) - next, begin(padded));
+            pending = index_block(data(padded), size(w) - next);
+            block = static_cast<ptrdiff_t>(next);
+            at_end = true;
+        }
+
+        if (quoted != 0) { throw runtime_error("Unterminated quoted field."); }
+        if (size(w) == 0) { return nullopt; }
+
+        // 最后一条记录没有换行
+        ranges.push_back({field_start, size(w)});
+        record_size = size(w);
+        return make_fields(reinterpret_cast<const char*>(data(w)));
+    }
+
+    [[nodiscard]]
+    span<const string_view> current() const
+    {
+        return fields;
+    }
+
+    // 把字段交给 ISpanStream 解析, 可以先设置进制或浮点格式
+    [[nodiscard]]
+    ISpanStream parse(size_t i) const
+    {
+        return ISpanStream {fields.at(i)};
+    }
+
+    template <typename T>
+        requires integral<T> || floating_point<T>
+    T field_as(size_t i) const
+    {
+        T value {};
+        parse(i) << value;
+        return value;
+    }
+};
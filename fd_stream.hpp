@@ -1,36 +1,270 @@
+#pragma once
+
 #include "stream.hpp"
+#include <array>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/inotify.h>
 #include <unistd.h>
 
+// follow 模式下等待文件被追加, 截断或轮转 (改名或删除后在原路径创建新文件) 的 inotify 通知
+// 同时监视文件本身和所在的目录, 目录中只关心同名文件的创建和移入
+class file_follower
+{
+    string path;
+    string name; // 路径的最后一部分
+    int inotify_fd {-1};
+    int stop_fd {-1};
+    shared_ptr<void> close_guard;
+    int file_watch {-1};
+
+    static constexpr uint32_t file_events = IN_MODIFY | IN_ATTRIB | IN_CLOSE_WRITE | IN_MOVE_SELF | IN_DELETE_SELF;
+
+    // 读出所有已经到达的事件, 返回其中是否有和这个文件有关的
+    bool drain()
+    {
+        alignas(inotify_event) array<char, 4096> buffer;
+        bool relevant {false};
+        while (true)
+        {
+            auto ret = ::read(inotify_fd, data(buffer), size(buffer));
+            if (ret == -1)
+            {
+                if (errno == EINTR) { continue; }
+                if (errno == EAGAIN) { return relevant; }
+                throw system_error {errno, system_category()};
+            }
+
+            for (size_t i = 0; i < static_cast<size_t>(ret);)
+            {
+                auto* event = reinterpret_cast<const inotify_event*>(data(buffer) + i);
+                if (event->wd == file_watch || (event->len > 0 && string_view {event->name} == name) || (event->mask & IN_Q_OVERFLOW) != 0)
+                {
+                    relevant = true;
+                }
+                i += sizeof(inotify_event) + event->len;
+            }
+        }
+    }
+
+public:
+    file_follower(string_view path_, int fd) : path {path_}
+    {
+        size_t slash = path.rfind('/');
+        name = slash == string::npos ? path : path.substr(slash + 1);
+        string directory = slash == string::npos ? "." : slash == 0 ? "/" : path.substr(0, slash);
+
+        inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+        if (inotify_fd == -1) { throw system_error {errno, system_category()}; }
+        stop_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (stop_fd == -1)
+        {
+            close(inotify_fd);
+            throw system_error {errno, system_category()};
+        }
+        close_guard = shared_ptr<void> {nullptr, [inotify_fd = inotify_fd, stop_fd = stop_fd](void*)
+                                        {
+                                            close(inotify_fd);
+                                            close(stop_fd);
+                                        }};
+
+        if (inotify_add_watch(inotify_fd, directory.c_str(), IN_CREATE | IN_MOVED_TO) == -1) { throw system_error {errno, system_category()}; }
+        watch(fd);
+    }
+
+    // 事件循环或协程中使用: 等待它可读, 再调用 fd_istream::read_available()
+    int get() { return inotify_fd; }
+
+    [[nodiscard]]
+    const string& file_path() const
+    {
+        return path;
+    }
+
+    // 监视新打开的文件; 通过 /proc/self/fd 添加, 监视的一定是 fd 打开的文件, 而不是路径现在指向的文件
+    void watch(int fd)
+    {
+        string self = "/proc/self/fd/" + to_string(fd);
+        int wd = inotify_add_watch(inotify_fd, self.c_str(), file_events);
+        if (wd == -1) { wd = inotify_add_watch(inotify_fd, path.c_str(), file_events); }
+        if (wd == -1) { throw system_error {errno, system_category()}; }
+
+        if (file_watch != -1 && file_watch != wd) { inotify_rm_watch(inotify_fd, file_watch); }
+        file_watch = wd;
+    }
+
+    // 路径已经指向另一个文件 (轮转); 路径暂时不存在时返回 false, 等新文件被创建
+    [[nodiscard]]
+    bool replaced(int fd) const
+    {
+        struct stat current;
+        struct stat opened;
+        if (stat(path.c_str(), &current) == -1) { return false; }
+        if (fstat(fd, &opened) == -1) { throw system_error {errno, system_category()}; }
+        return current.st_ino != opened.st_ino || current.st_dev != opened.st_dev;
+    }
+
+    // 阻塞到有相关的事件, stop() 之后返回 false
+    bool wait()
+    {
+        while (true)
+        {
+            array<pollfd, 2> fds {pollfd {inotify_fd, POLLIN, 0}, pollfd {stop_fd, POLLIN, 0}};
+            if (poll(data(fds), size(fds), -1) == -1)
+            {
+                if (errno == EINTR) { continue; }
+                throw system_error {errno, system_category()};
+            }
+
+            if ((fds[1].revents & POLLIN) != 0) { return false; }
+            if (drain()) { return true; }
+        }
+    }
+
+    // 可以在其它线程中调用, 正在等待的 read() 返回 0
+    void stop()
+    {
+        uint64_t one = 1;
+        (void)::write(stop_fd, &one, sizeof(one));
+    }
+
+    [[nodiscard]]
+    bool stopped() const
+    {
+        pollfd p {stop_fd, POLLIN, 0};
+        return poll(&p, 1, 0) == 1;
+    }
+
+    // 丢弃已经到达的事件, 用于非阻塞的读取
+    void clear() { drain(); }
+};
+
+enum class read_mode
+{
+    normal,
+    follow, // 到了文件末尾时等待追加的数据, 文件被截断时从头读, 被轮转时打开原路径上的新文件
+};
+
 class fd_istream
 {
     int fd;
-    shared_ptr<void> close_guard {nullptr, [](void* p) { close(fd); }};
+    shared_ptr<void> close_guard;
+    shared_ptr<file_follower> follower;
+    cache_policy policy;
+    shared_ptr<page_cache_advisor> cache;
 
     size_t get_count {};
     bool eof {false};
 
+    ssize_t read_once(span<byte> bytes)
+    {
+        while (true)
+        {
+            auto ret = ::read(fd, data(bytes), size(bytes));
+            if (ret > 0 && cache != nullptr) { cache->consumed(static_cast<size_t>(ret)); }
+            if (ret != -1 || errno != EINTR) { return ret; }
+        }
+    }
+
+    // 文件末尾时检查截断和轮转, 返回 true 表示可以再读一次
+    bool recover()
+    {
+        if (follower->replaced(fd))
+        {
+            int new_fd = open(follower->file_path().c_str(), O_RDONLY | O_CLOEXEC);
+            if (new_fd == -1) { return false; }
+
+            cache.reset(); // 先于旧的 fd 关闭
+            fd = new_fd;
+            close_guard = shared_ptr<void> {nullptr, [fd = fd](void*) { close(fd); }};
+            if (policy.mode == cache_mode::streaming) { cache = make_shared<page_cache_advisor>(fd, policy.window); }
+            follower->watch(fd);
+            return true;
+        }
+
+        struct stat info;
+        if (fstat(fd, &info) == -1) { throw system_error {errno, system_category()}; }
+        off_t pos = lseek(fd, 0, SEEK_CUR);
+        if (pos != -1 && info.st_size < pos)
+        {
+            lseek(fd, 0, SEEK_SET);
+            if (cache != nullptr) { cache->reset(0); }
+            return true;
+        }
+        return false;
+    }
+
+    // follow 模式下读到文件末尾时等待, stop() 之后返回 false
+    bool follow_end()
+    {
+        if (follower == nullptr || follower->stopped()) { return false; }
+        if (recover()) { return true; }
+        return follower->wait();
+    }
+
 public:
-    explicit fd_istream(string_view path) : fd {open(path.c_str())}
+    explicit fd_istream(string_view path, read_mode mode = read_mode::normal, cache_policy policy_ = {}) : fd {open(data(path), O_RDONLY)}, policy {policy_}
     {
         if (fd == -1) { throw std::system_error {errno, std::system_category()}; }
+        close_guard = shared_ptr<void> {nullptr, [fd = fd](void*) { close(fd); }};
+        if (policy.mode == cache_mode::streaming) { cache = make_shared<page_cache_advisor>(fd, policy.window); }
+
+        if (mode == read_mode::follow) { follower = make_shared<file_follower>(path, fd); }
     }
 
     int get() { return fd; }
     size_t gcount() const { return get_count; }
 
+    // follow 模式下的 inotify 描述符, 可以交给事件循环
+    int notify_fd() { return follower == nullptr ? -1 : follower->get(); }
+
+    // follow 模式下结束等待, 可以在其它线程中调用
+    void stop()
+    {
+        if (follower != nullptr) { follower->stop(); }
+    }
+
     void read(span<char> bytes)
     {
+        get_count = 0;
         while (size(bytes) > 0)
         {
-            auto ret = ::read(fd, data(bytes), size(bytes));
+            auto ret = read_once(as_writable_bytes(bytes));
             if (ret == -1) { throw std::system_error {errno, std::system_category()}; }
             if (ret == 0)
             {
+                if (follow_end()) { continue; }
                 eof = true;
                 break;
             }
-            get_count += ret;
-            bytes = bytes.subspan(get_count);
+            get_count += static_cast<size_t>(ret);
+            bytes = bytes.subspan(static_cast<size_t>(ret));
         }
     }
+
+    // 读取已经可以得到的数据, 返回 0 表示文件结束; 可以作为 IBUfStream 的 InputHandler
+    // follow 模式下只有 stop() 之后才返回 0
+    size_t read(span<byte> bytes)
+    {
+        while (true)
+        {
+            auto ret = read_once(bytes);
+            if (ret == -1) { throw std::system_error {errno, std::system_category()}; }
+            if (ret == 0 && follow_end()) { continue; }
+            if (ret == 0) { eof = true; }
+            return static_cast<size_t>(ret);
+        }
+    }
+
+    // 不等待的读取, 用于事件循环: notify_fd() 可读时调用, 返回 0 表示暂时没有数据
+    size_t read_available(span<byte> bytes)
+    {
+        if (follower != nullptr) { follower->clear(); }
+
+        auto ret = read_once(bytes);
+        if (ret == -1) { throw std::system_error {errno, std::system_category()}; }
+        if (ret == 0 && follower != nullptr && recover()) { ret = read_once(bytes); }
+        if (ret == -1) { throw std::system_error {errno, std::system_category()}; }
+        return static_cast<size_t>(ret);
+    }
 };
@@ -0,0 +1,558 @@
+#pragma once
+
+#include "binary_stream.hpp"
+#include "stream.hpp"
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <limits>
+#include <mutex>
+#include <thread>
+#include <utility>
+
+#if __has_include(<zlib.h>)
+#include <zlib.h>
+#endif
+#if __has_include(<zstd.h>)
+#include <zstd.h>
+#endif
+#if __has_include(<lz4frame.h>)
+#include <lz4frame.h>
+#endif
+
+// 在输入源和消费者之间, 或在输出和 sink 之间, 对整块数据做变换 (解压, 压缩 ...)
+//
+//   IBUfStream<fd_istream> raw {fd_istream {path}};
+//   IBUfStream<filter_reader<IBUfStream<fd_istream>, zlib_decoder>> in {filter_reader {raw, zlib_decoder {}}};
+//
+//   filter_sink<fd_ostream, zstd_encoder> out {file};
+//
+// 每个阶段可以放到独立的线程中: 输入端用 async_source 包装, 输出端用 tee_stream.hpp 中的 async_sink 包装
+
+enum class filter_flush
+{
+    none,   // 可以把数据留在 filter 内部
+    sync,   // 把已经输入的数据全部输出, 流还可以继续
+    finish, // 输入已经结束
+};
+
+struct filter_result
+{
+    size_t consumed; // 用掉的输入字节数
+    size_t produced; // 写入 out 的字节数
+    bool end;        // 流已经结束, 不会再有输出
+};
+
+// 输出缓冲区写满时 filter 必须保存剩下的数据, 在下一次调用时继续输出
+template <typename F>
+concept stream_filter = requires(F f, span<const byte> in, span<byte> out, filter_flush mode) {
+    { f.transform(in, out, mode) } -> same_as<filter_result>;
+};
+
+// 从 buffered_input 读取原始数据, 变换后作为 IBUfStream 的 InputHandler
+template <buffered_input Source, stream_filter Filter>
+class filter_reader
+{
+    Source& in;
+    Filter filter;
+    bool input_end {false};
+    bool finished {false};
+
+public:
+    explicit filter_reader(Source& in_, Filter filter_ = Filter {}) : in {in_}, filter {std::move(filter_)} {}
+
+    size_t read(span<byte> out)
+    {
+        while (!finished)
+        {
+            span<const byte> w = in.window();
+            if (w.empty()) { input_end = true; }
+
+            filter_result r = filter.transform(w, out, input_end ? filter_flush::finish : filter_flush::none);
+            in.consume(r.consumed);
+            finished = r.end;
+            if (r.produced > 0) { return r.produced; }
+
+            // filter 需要更多连续的输入
+            if (r.consumed == 0 && !finished)
+            {
+                if (input_end) { throw runtime_error("Truncated stream."); }
+                input_end = in.refill() == 0;
+            }
+        }
+        return 0;
+    }
+};
+
+// 变换后写入 sink, 本身也是 output_sink
+// 析构时结束流 (写出压缩格式的结尾), 需要处理异常时先调用 finish()
+template <output_sink Sink, stream_filter Filter>
+class filter_sink
+{
+    Sink& sink;
+    Filter filter;
+    vector<byte> out;
+    bool finished {false};
+
+    void run(span<const byte> in, filter_flush mode)
+    {
+        while (true)
+        {
+            filter_result r = filter.transform(in, out, mode);
+            in = in.subspan(r.consumed);
+            if (r.produced > 0) { sink.write(span<const char> {reinterpret_cast<const char*>(data(out)), r.produced}); }
+            if (r.end)
+            {
+                finished = true;
+                return;
+            }
+
+            // 输出缓冲区没有写满说明 filter 中没有等待输出的数据
+            if (in.empty() && r.produced < size(out) && mode != filter_flush::finish) { return; }
+        }
+    }
+
+public:
+    explicit filter_sink(Sink& sink_, Filter filter_ = Filter {}, size_t buffer_size = size_t {1} << 16)
+        : sink {sink_}, filter {std::move(filter_)}, out(buffer_size)
+    {}
+
+    filter_sink(filter_sink&& other) noexcept
+        : sink {other.sink}, filter {std::move(other.filter)}, out {std::move(other.out)}, finished {exchange(other.finished, true)}
+    {}
+
+    ~filter_sink()
+    {
+        if (!finished) { discard_errors([this] { run({}, filter_flush::finish); }); }
+    }
+
+    void write(span<const char> s) { run(as_bytes(s), filter_flush::none); }
+
+    // 输出已经写入的全部数据, 接收方可以立即解码
+    void flush()
+    {
+        if (!finished) { run({}, filter_flush::sync); }
+        if constexpr (requires { sink.flush(); }) { sink.flush(); }
+    }
+
+    // 结束流, 之后不能再写入
+    void finish()
+    {
+        if (!finished) { run({}, filter_flush::finish); }
+        if constexpr (requires { sink.flush(); }) { sink.flush(); }
+    }
+};
+
+// 在独立的线程中调用 handler.read(), 让解压等耗时的阶段与消费者并行运行
+// 队列中最多有 max_pending 块, 读取线程中的异常在消费者读到这个位置时重新抛出
+// 第一次 read() 时才启动线程, 在那之前可以移动
+template <typename Handler>
+class async_source
+{
+    Handler handler;
+    size_t block_size;
+    size_t max_pending;
+
+    mutex m;
+    condition_variable cv;
+    deque<vector<byte>> queue;
+    vector<vector<byte>> spare;
+    bool done {false};
+    bool stopping {false};
+    exception_ptr error;
+
+    vector<byte> current;
+    size_t pos {};
+
+    jthread worker;
+
+    void run()
+    {
+        while (true)
+        {
+            vector<byte> block;
+            {
+                lock_guard lock {m};
+                if (!spare.empty())
+                {
+                    block = std::move(spare.back());
+                    spare.pop_back();
+                }
+            }
+            block.resize(block_size);
+
+            size_t n {};
+            exception_ptr e;
+            try
+            {
+                n = handler.read(block);
+            }
+            catch (...)
+            {
+                e = current_exception();
+            }
+            block.resize(n);
+
+            unique_lock lock {m};
+            cv.wait(lock, [this] { return stopping || queue.size() < max_pending; });
+            if (stopping) { return; }
+
+            if (e != nullptr || n == 0)
+            {
+                error = e;
+                done = true;
+                cv.notify_all();
+                return;
+            }
+
+            queue.push_back(std::move(block));
+            cv.notify_all();
+        }
+    }
+
+public:
+    explicit async_source(Handler handler_, size_t block_size_ = size_t {1} << 16, size_t max_pending_ = 4)
+        : handler {std::move(handler_)}, block_size {block_size_}, max_pending {max_pending_}
+    {}
+
+    async_source(async_source&& other) noexcept
+        : handler {std::move(other.handler)}, block_size {other.block_size}, max_pending {other.max_pending}
+    {}
+
+    ~async_source()
+    {
+        {
+            lock_guard lock {m};
+            stopping = true;
+        }
+        cv.notify_all();
+    }
+
+    size_t read(span<byte> out)
+    {
+        if (!worker.joinable()) { worker = jthread {[this] { run(); }}; }
+
+        if (pos == size(current))
+        {
+            unique_lock lock {m};
+            cv.wait(lock, [this] { return !queue.empty() || done; });
+            if (queue.empty())
+            {
+                if (error != nullptr) { rethrow_exception(exchange(error, nullptr)); }
+                return 0;
+            }
+
+            if (!current.empty()) { spare.push_back(std::move(current)); }
+            current = std::move(queue.front());
+            queue.pop_front();
+            pos = 0;
+            cv.notify_all();
+        }
+
+        size_t n = min(size(out), size(current) - pos);
+        copy_n(current.begin() + static_cast<ptrdiff_t>(pos), n, out.begin());
+        pos += n;
+        return n;
+    }
+};
+
+#if __has_include(<zlib.h>)
+
+enum class zlib_format
+{
+    gzip,
+    zlib,
+    raw, // 没有头部和校验和的 deflate
+};
+
+namespace zlib_detail
+{
+    inline int window_bits(zlib_format format)
+    {
+        switch (format)
+        {
+        case zlib_format::gzip: return MAX_WBITS + 16;
+        case zlib_format::zlib: return MAX_WBITS;
+        case zlib_format::raw: return -MAX_WBITS;
+        }
+        return MAX_WBITS;
+    }
+
+    inline void set_buffers(z_stream& z, span<const byte> in, span<byte> out)
+    {
+        z.next_in = const_cast<Bytef*>(reinterpret_cast<const Bytef*>(data(in)));
+        z.avail_in = static_cast<uInt>(min<size_t>(size(in), numeric_limits<uInt>::max()));
+        z.next_out = reinterpret_cast<Bytef*>(data(out));
+        z.avail_out = static_cast<uInt>(min<size_t>(size(out), numeric_limits<uInt>::max()));
+    }
+} // namespace zlib_detail
+
+// zlib 在内部状态中保存 z_stream 的地址, z_stream 放在堆上使 filter 可以移动
+class zlib_encoder
+{
+    unique_ptr<z_stream, void (*)(z_stream*)> z {new z_stream {}, [](z_stream* p)
+                                                 {
+                                                     deflateEnd(p);
+                                                     delete p;
+                                                 }};
+
+public:
+    explicit zlib_encoder(zlib_format format = zlib_format::gzip, int level = Z_DEFAULT_COMPRESSION)
+    {
+        if (deflateInit2(z.get(), level, Z_DEFLATED, zlib_detail::window_bits(format), 8, Z_DEFAULT_STRATEGY) != Z_OK)
+        {
+            throw runtime_error("deflateInit2 failed.");
+        }
+    }
+
+    filter_result transform(span<const byte> in, span<byte> out, filter_flush mode)
+    {
+        zlib_detail::set_buffers(*z, in, out);
+        uInt avail_in = z->avail_in;
+        uInt avail_out = z->avail_out;
+
+        int flush = mode == filter_flush::none ? Z_NO_FLUSH : mode == filter_flush::sync ? Z_SYNC_FLUSH : Z_FINISH;
+        int ret = deflate(z.get(), flush);
+        if (ret == Z_STREAM_ERROR) { throw runtime_error("deflate failed."); }
+
+        return {avail_in - z->avail_in, avail_out - z->avail_out, ret == Z_STREAM_END};
+    }
+};
+
+// 解压 gzip 时也接受 zlib 格式; 连续的多个 gzip 成员依次解压
+class zlib_decoder
+{
+    unique_ptr<z_stream, void (*)(z_stream*)> z {new z_stream {}, [](z_stream* p)
+                                                 {
+                                                     inflateEnd(p);
+                                                     delete p;
+                                                 }};
+    bool started {false};    // 当前成员已经有输入
+    bool stream_end {false}; // 当前成员已经结束
+
+public:
+    explicit zlib_decoder(zlib_format format = zlib_format::gzip)
+    {
+        int bits = format == zlib_format::gzip ? MAX_WBITS + 32 : zlib_detail::window_bits(format);
+        if (inflateInit2(z.get(), bits) != Z_OK) { throw runtime_error("inflateInit2 failed."); }
+    }
+
+    // 输入结束之后 inflate 里可能还有没输出的数据, 继续调用到它不再输出为止, 之后还没有结束才是被截断
+    filter_result transform(span<const byte> in, span<byte> out, filter_flush mode)
+    {
+        bool at_end = in.empty() && mode == filter_flush::finish;
+        if (at_end && (!started || stream_end)) { return {0, 0, true}; }
+
+        if (stream_end && !in.empty())
+        {
+            inflateReset(z.get());
+            started = false;
+            stream_end = false;
+        }
+
+        zlib_detail::set_buffers(*z, in, out);
+        uInt avail_in = z->avail_in;
+        uInt avail_out = z->avail_out;
+
+        int ret = inflate(z.get(), Z_NO_FLUSH);
+        if (ret == Z_STREAM_END) { stream_end = true; }
+        else if (ret != Z_OK && ret != Z_BUF_ERROR) { throw runtime_error(z->msg != nullptr ? z->msg : "inflate failed."); }
+
+        size_t produced = avail_out - z->avail_out;
+        if (at_end && produced == 0 && !stream_end && !out.empty()) { throw runtime_error("Truncated compressed stream."); }
+
+        started = started || !in.empty();
+        return {avail_in - z->avail_in, produced, at_end && produced == 0 && !out.empty()};
+    }
+};
+
+#endif
+
+#if __has_include(<zstd.h>)
+
+class zstd_encoder
+{
+    unique_ptr<ZSTD_CCtx, size_t (*)(ZSTD_CCtx*)> ctx {ZSTD_createCCtx(), ZSTD_freeCCtx};
+
+    static void check(size_t ret)
+    {
+        if (ZSTD_isError(ret)) { throw runtime_error(ZSTD_getErrorName(ret)); }
+    }
+
+public:
+    // threads 不为 0 时 zstd 在自己的线程中压缩
+    explicit zstd_encoder(int level = 3, int threads = 0)
+    {
+        if (ctx == nullptr) { throw bad_alloc {}; }
+        check(ZSTD_CCtx_setParameter(ctx.get(), ZSTD_c_compressionLevel, level));
+        if (threads > 0) { check(ZSTD_CCtx_setParameter(ctx.get(), ZSTD_c_nbWorkers, threads)); }
+    }
+
+    filter_result transform(span<const byte> in, span<byte> out, filter_flush mode)
+    {
+        ZSTD_inBuffer input {data(in), size(in), 0};
+        ZSTD_outBuffer output {data(out), size(out), 0};
+
+        ZSTD_EndDirective directive = mode == filter_flush::none ? ZSTD_e_continue : mode == filter_flush::sync ? ZSTD_e_flush : ZSTD_e_end;
+        size_t remaining = ZSTD_compressStream2(ctx.get(), &output, &input, directive);
+        check(remaining);
+
+        return {input.pos, output.pos, mode == filter_flush::finish && remaining == 0 && input.pos == input.size};
+    }
+};
+
+// 连续的多个帧依次解压
+class zstd_decoder
+{
+    unique_ptr<ZSTD_DCtx, size_t (*)(ZSTD_DCtx*)> ctx {ZSTD_createDCtx(), ZSTD_freeDCtx};
+    bool started {false};
+    size_t hint {}; // 为 0 表示帧已经结束
+
+public:
+    zstd_decoder()
+    {
+        if (ctx == nullptr) { throw bad_alloc {}; }
+    }
+
+    // 和 zlib_decoder 一样, 输入结束之后继续输出缓存的数据, 不再输出时帧还没有结束才是被截断
+    filter_result transform(span<const byte> in, span<byte> out, filter_flush mode)
+    {
+        bool at_end = in.empty() && mode == filter_flush::finish;
+        if (at_end && (!started || hint == 0)) { return {0, 0, true}; }
+
+        ZSTD_inBuffer input {data(in), size(in), 0};
+        ZSTD_outBuffer output {data(out), size(out), 0};
+
+        hint = ZSTD_decompressStream(ctx.get(), &output, &input);
+        if (ZSTD_isError(hint)) { throw runtime_error(ZSTD_getErrorName(hint)); }
+        if (at_end && output.pos == 0 && hint != 0 && !out.empty()) { throw runtime_error("Truncated compressed stream."); }
+
+        started = started || !in.empty();
+        return {input.pos, output.pos, at_end && output.pos == 0 && !out.empty()};
+    }
+};
+
+#endif
+
+#if __has_include(<lz4frame.h>)
+
+// LZ4F_compressUpdate 要求输出空间不小于 LZ4F_compressBound(), 压缩结果先放在 pending 中再复制到 out
+class lz4_encoder
+{
+    static constexpr size_t max_chunk = size_t {1} << 16;
+
+    unique_ptr<LZ4F_cctx, LZ4F_errorCode_t (*)(LZ4F_cctx*)> ctx {nullptr, LZ4F_freeCompressionContext};
+    LZ4F_preferences_t preferences {};
+    vector<byte> pending;
+    size_t pending_pos {};
+    bool in_frame {false};
+    bool flushed {true};
+    bool ended {false};
+
+    static size_t check(size_t ret)
+    {
+        if (LZ4F_isError(ret)) { throw runtime_error(LZ4F_getErrorName(ret)); }
+        return ret;
+    }
+
+    template <typename F>
+    void stage(size_t bound, F f)
+    {
+        pending.resize(bound);
+        pending.resize(check(f(data(pending), bound)));
+        pending_pos = 0;
+    }
+
+public:
+    explicit lz4_encoder(int level = 0)
+    {
+        LZ4F_cctx* p {};
+        check(LZ4F_createCompressionContext(&p, LZ4F_VERSION));
+        ctx.reset(p);
+        preferences.compressionLevel = level;
+    }
+
+    filter_result transform(span<const byte> in, span<byte> out, filter_flush mode)
+    {
+        size_t consumed {};
+        size_t produced {};
+        while (true)
+        {
+            size_t n = min(size(pending) - pending_pos, size(out) - produced);
+            copy_n(pending.begin() + static_cast<ptrdiff_t>(pending_pos), n, out.begin() + static_cast<ptrdiff_t>(produced));
+            pending_pos += n;
+            produced += n;
+            if (pending_pos < size(pending)) { return {consumed, produced, false}; }
+
+            if (!in.empty() && !in_frame)
+            {
+                stage(LZ4F_HEADER_SIZE_MAX, [&](byte* p, size_t cap) { return LZ4F_compressBegin(ctx.get(), p, cap, &preferences); });
+                in_frame = true;
+                ended = false;
+            }
+            else if (!in.empty())
+            {
+                size_t chunk = min(size(in), max_chunk);
+                stage(LZ4F_compressBound(chunk, &preferences),
+                      [&](byte* p, size_t cap) { return LZ4F_compressUpdate(ctx.get(), p, cap, data(in), chunk, nullptr); });
+                in = in.subspan(chunk);
+                consumed += chunk;
+                flushed = false;
+            }
+            else if (mode == filter_flush::sync && in_frame && !flushed)
+            {
+                stage(LZ4F_compressBound(0, &preferences), [&](byte* p, size_t cap) { return LZ4F_flush(ctx.get(), p, cap, nullptr); });
+                flushed = true;
+            }
+            else if (mode == filter_flush::finish && !ended)
+            {
+                if (!in_frame)
+                {
+                    stage(LZ4F_HEADER_SIZE_MAX, [&](byte* p, size_t cap) { return LZ4F_compressBegin(ctx.get(), p, cap, &preferences); });
+                    in_frame = true;
+                    continue;
+                }
+                stage(LZ4F_compressBound(0, &preferences), [&](byte* p, size_t cap) { return LZ4F_compressEnd(ctx.get(), p, cap, nullptr); });
+                in_frame = false;
+                flushed = true;
+                ended = true;
+            }
+            else { return {consumed, produced, mode == filter_flush::finish && ended}; }
+        }
+    }
+};
+
+// 连续的多个帧依次解压
+class lz4_decoder
+{
+    unique_ptr<LZ4F_dctx, LZ4F_errorCode_t (*)(LZ4F_dctx*)> ctx {nullptr, LZ4F_freeDecompressionContext};
+    bool started {false};
+    size_t hint {}; // 为 0 表示帧已经结束
+
+public:
+    lz4_decoder()
+    {
+        LZ4F_dctx* p {};
+        size_t ret = LZ4F_createDecompressionContext(&p, LZ4F_VERSION);
+        if (LZ4F_isError(ret)) { throw runtime_error(LZ4F_getErrorName(ret)); }
+        ctx.reset(p);
+    }
+
+    // 和 zlib_decoder 一样, 输入结束之后继续输出缓存的数据, 不再输出时帧还没有结束才是被截断
+    filter_result transform(span<const byte> in, span<byte> out, filter_flush mode)
+    {
+        bool at_end = in.empty() && mode == filter_flush::finish;
+        if (at_end && (!started || hint == 0)) { return {0, 0, true}; }
+
+        size_t in_size = size(in);
+        size_t out_size = size(out);
+        hint = LZ4F_decompress(ctx.get(), data(out), &out_size, data(in), &in_size, nullptr);
+        if (LZ4F_isError(hint)) { throw runtime_error(LZ4F_getErrorName(hint)); }
+        if (at_end && out_size == 0 && hint != 0 && !out.empty()) { throw runtime_error("Truncated compressed stream."); }
+
+        started = started || !in.empty();
+        return {in_size, out_size, at_end && out_size == 0 && !out.empty()};
+    }
+};
+
+#endif
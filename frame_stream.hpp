@@ -0,0 +1,315 @@
+#pragma once
+
+#include "binary_stream.hpp"
+#include "stream.hpp"
+#include <cstring>
+#include <iterator>
+#include <optional>
+#include <ranges>
+
+// 长度前缀的帧: 帧头是帧内容的字节数, 定长 4/8 字节或 varint, 之后是帧的内容
+
+enum class frame_header
+{
+    fixed32,
+    fixed64,
+    varint,
+};
+
+struct frame_format
+{
+    frame_header header {frame_header::varint};
+    endian order {endian::little};     // 定长帧头的字节序
+    size_t max_size {size_t {64} << 20}; // 读取时更长的帧视为数据损坏; 写入 varint 帧头时按它预留空间
+};
+
+namespace frame_detail
+{
+    // 解析窗口开头的帧头, 返回 {帧头的字节数, 帧长}; 帧头不完整时帧头的字节数为 0
+    inline pair<size_t, uint64_t> parse_header(span<const byte> w, const frame_format& format)
+    {
+        if (format.header == frame_header::varint)
+        {
+            uint64_t length {};
+            const byte* next = decode_varint(data(w), data(w) + size(w), length);
+            if (next == nullptr) { return {0, 0}; }
+            return {static_cast<size_t>(next - data(w)), length};
+        }
+
+        if (format.header == frame_header::fixed32)
+        {
+            if (size(w) < 4) { return {0, 0}; }
+            uint32_t length;
+            memcpy(&length, data(w), 4);
+            return {4, format.order == endian::native ? length : byteswap(length)};
+        }
+
+        if (size(w) < 8) { return {0, 0}; }
+        uint64_t length;
+        memcpy(&length, data(w), 8);
+        return {8, format.order == endian::native ? length : byteswap(length)};
+    }
+
+    // 写入时为帧头预留的字节数
+    inline size_t reserved_header(const frame_format& format)
+    {
+        switch (format.header)
+        {
+            case frame_header::fixed32: return 4;
+            case frame_header::fixed64: return 8;
+            default:
+            {
+                array<char, max_varint_size<uint64_t>> bytes;
+                return encode_varint(uint64_t {format.max_size}, data(bytes));
+            }
+        }
+    }
+
+    // 把帧长写成正好 n 字节; varint 不足 n 字节时前面的字节带上续位补齐, 仍是合法的 LEB128
+    inline void encode_header(uint64_t length, char* out, size_t n, const frame_format& format)
+    {
+        if (format.header == frame_header::varint)
+        {
+            for (size_t i = 0; i + 1 < n; ++i)
+            {
+                out[i] = static_cast<char>(length | 0x80);
+                length >>= 7;
+            }
+            out[n - 1] = static_cast<char>(length);
+            return;
+        }
+
+        if (format.header == frame_header::fixed32)
+        {
+            auto value = static_cast<uint32_t>(length);
+            if (format.order != endian::native) { value = byteswap(value); }
+            memcpy(out, &value, 4);
+            return;
+        }
+
+        if (format.order != endian::native) { length = byteswap(length); }
+        memcpy(out, &length, 8);
+    }
+
+    inline void check_length(uint64_t length, const frame_format& format)
+    {
+        if (length > format.max_size || (format.header == frame_header::fixed32 && length > numeric_limits<uint32_t>::max()))
+        {
+            throw runtime_error("Frame too large.");
+        }
+    }
+
+    inline size_t header_size(uint64_t length, const frame_format& format)
+    {
+        if (format.header != frame_header::varint) { return reserved_header(format); }
+
+        array<char, max_varint_size<uint64_t>> bytes;
+        return encode_varint(length, data(bytes));
+    }
+} // namespace frame_detail
+
+// 读取下一帧, 在帧的边界遇到 EOF 时返回 nullopt
+// 返回的 span 直接指向 in 的窗口, 不复制, 只在下一次操作 in 之前有效;
+// 帧比窗口长时 IBUfStream 会扩大缓冲区, mmap_istream 的窗口总是整个文件
+template <buffered_input Source>
+optional<span<const byte>> read_frame(Source& in, const frame_format& format = {})
+{
+    span<const byte> w = in.window();
+    auto [header, length] = frame_detail::parse_header(w, format);
+    while (header == 0)
+    {
+        if (in.refill() == 0)
+        {
+            if (in.window().empty()) { return nullopt; }
+            throw runtime_error("Truncated frame.");
+        }
+        w = in.window();
+        tie(header, length) = frame_detail::parse_header(w, format);
+    }
+
+    if (length > format.max_size) { throw runtime_error("Frame too large."); }
+
+    while (size(w) - header < length)
+    {
+        if (in.refill() == 0) { throw runtime_error("Truncated frame."); }
+        w = in.window();
+    }
+
+    in.consume(header + length);
+    return w.subspan(header, length);
+}
+
+// 依次读取所有的帧; 和 record_view 一样, 每个元素只在迭代器前进之前有效
+template <buffered_input Source>
+class frame_view : public ranges::view_interface<frame_view<Source>>
+{
+    Source* in;
+    frame_format format;
+    optional<span<const byte>> frame;
+    bool started {false};
+
+public:
+    class iterator
+    {
+        frame_view* view {};
+
+    public:
+        using value_type = span<const byte>;
+        using difference_type = ptrdiff_t;
+
+        iterator() = default;
+        explicit iterator(frame_view& view_) : view {&view_} {}
+
+        span<const byte> operator*() const { return *view->frame; }
+
+        iterator& operator++()
+        {
+            view->frame = read_frame(*view->in, view->format);
+            return *this;
+        }
+        void operator++(int) { ++*this; }
+
+        bool operator==(default_sentinel_t) const { return !view->frame; }
+    };
+
+    frame_view(Source& in_, frame_format format_) : in {&in_}, format {format_} {}
+
+    iterator begin()
+    {
+        if (!exchange(started, true)) { frame = read_frame(*in, format); }
+        return iterator {*this};
+    }
+    default_sentinel_t end() const { return default_sentinel; }
+};
+
+template <buffered_input Source>
+frame_view<Source> frames(Source& in, frame_format format = {})
+{
+    return frame_view<Source> {in, format};
+}
+
+// 带缓冲的帧写入: begin_frame() 预留帧头, 内容直接序列化到缓冲区中, end_frame() 再原地填入长度
+// 短帧的 varint 帧头按实际长度写, 内容前移; 长帧用补齐的 varint, 不移动内容
+// 缓冲区满时写出已经完成的帧, 未完成的帧移到缓冲区开头, 一帧比缓冲区长时缓冲区扩大
+template <output_sink T>
+class frame_writer
+{
+    T sink;
+    frame_format format;
+    vector<char, default_init_allocator<char>> buffer;
+    size_t used {};                   // 已经写入缓冲区的字节数, 包括未完成的帧
+    size_t frame = string_view::npos; // 未完成的帧的帧头位置
+    size_t reserved;
+
+    // 保证缓冲区末尾有 n 字节的空间
+    void make_room(size_t n)
+    {
+        if (size(buffer) - used >= n) { return; }
+
+        flush();
+        if (size(buffer) - used < n) { buffer.resize(max(size(buffer) * 2, used + n)); }
+    }
+
+public:
+    // 内容不超过 compact_limit 的帧, varint 帧头按实际长度写
+    static constexpr size_t compact_limit = 4096;
+
+    explicit frame_writer(T sink_, frame_format format_ = {}, size_t size = 64 * 1024)
+        : sink {std::move(sink_)}, format {format_}, buffer(max(size, size_t {64})), reserved {frame_detail::reserved_header(format_)}
+    {
+    }
+
+    frame_writer(const frame_writer&) = delete;
+    frame_writer& operator=(const frame_writer&) = delete;
+
+    // 未完成的帧被丢弃
+    ~frame_writer()
+    {
+        if (frame != string_view::npos) { used = frame; }
+        if (used > 0) { discard_errors([this] { sink.write(span<const char> {data(buffer), used}); }); }
+    }
+
+    T& get() { return sink; }
+
+    void begin_frame()
+    {
+        if (frame != string_view::npos) { throw runtime_error("Frame already open."); }
+
+        make_room(reserved);
+        frame = used;
+        used += reserved;
+    }
+
+    // 当前帧末尾至少 n 字节的可写空间, 序列化之后用 commit() 确认实际写入的字节数
+    span<char> prepare(size_t n)
+    {
+        if (frame == string_view::npos) { throw runtime_error("No open frame."); }
+
+        make_room(n);
+        return {data(buffer) + used, size(buffer) - used};
+    }
+
+    void commit(size_t n) { used += n; }
+
+    // 追加到当前帧
+    void write(span<const char> bytes)
+    {
+        span<char> free = prepare(size(bytes));
+        copy(bytes.begin(), bytes.end(), free.begin());
+        commit(size(bytes));
+    }
+
+    // 填入当前帧的长度
+    void end_frame()
+    {
+        if (frame == string_view::npos) { throw runtime_error("No open frame."); }
+
+        size_t payload = used - frame - reserved;
+        frame_detail::check_length(payload, format);
+
+        size_t n = reserved;
+        if (format.header == frame_header::varint && payload <= compact_limit)
+        {
+            n = frame_detail::header_size(payload, format);
+            memmove(data(buffer) + frame + n, data(buffer) + frame + reserved, payload);
+            used -= reserved - n;
+        }
+        frame_detail::encode_header(payload, data(buffer) + frame, n, format);
+        frame = string_view::npos;
+    }
+
+    // 内容已经在内存中的整帧; 比缓冲区长的内容不经过缓冲区
+    void write_frame(span<const char> payload)
+    {
+        if (frame != string_view::npos) { throw runtime_error("Frame already open."); }
+        frame_detail::check_length(size(payload), format);
+
+        size_t n = frame_detail::header_size(size(payload), format);
+        if (n + size(payload) > size(buffer))
+        {
+            make_room(n);
+            frame_detail::encode_header(size(payload), data(buffer) + used, n, format);
+            used += n;
+            flush();
+            sink.write(payload);
+            return;
+        }
+
+        make_room(n + size(payload));
+        frame_detail::encode_header(size(payload), data(buffer) + used, n, format);
+        memcpy(data(buffer) + used + n, data(payload), size(payload));
+        used += n + size(payload);
+    }
+
+    // 写出已经完成的帧
+    void flush()
+    {
+        size_t done = frame == string_view::npos ? used : frame;
+        if (done == 0) { return; }
+
+        sink.write(span<const char> {data(buffer), done});
+        memmove(data(buffer), data(buffer) + done, used - done);
+        used -= done;
+        if (frame != string_view::npos) { frame = 0; }
+    }
+};
@@ -0,0 +1,181 @@
+#pragma once
+
+#include "binary_stream.hpp"
+#include "simd.hpp"
+#include "stream.hpp"
+#include <string_view>
+#include <thread>
+
+// 文件中每条记录的起始偏移量, 用于按行号定位和在有序的文件中二分查找
+// 索引可以保存为旁路文件: 魔数, 原文件大小, 记录数, 然后是相邻偏移量之差的 varint 序列
+// 原文件大小与保存时不同说明索引已过期, 由调用者决定是否重建
+class line_index
+{
+    static constexpr string_view magic {"LIDX0001"};
+
+    vector<uint64_t> offsets;
+    uint64_t indexed_size {};
+
+    static void scan(const char* p, size_t first, size_t last, char delim, vector<uint64_t>& out)
+    {
+        size_t i = first;
+        for (; i + 64 <= last; i += 64)
+        {
+            uint64_t mask = char_mask(p + i, delim);
+            while (mask != 0)
+            {
+                out.push_back(i + countr_zero(mask) + 1);
+                mask &= mask - 1;
+            }
+        }
+        for (; i < last; ++i)
+        {
+            if (p[i] == delim) { out.push_back(i + 1); }
+        }
+    }
+
+public:
+    // 把文件切成 threads 段并行扫描, 小文件只用一个线程
+    static line_index build(span<const byte> file, char delim = '\n', size_t threads = thread::hardware_concurrency())
+    {
+        constexpr size_t min_chunk = size_t {1} << 20;
+
+        const char* p = reinterpret_cast<const char*>(data(file));
+        threads = clamp<size_t>(file.size() / min_chunk, 1, max<size_t>(threads, 1));
+
+        vector<vector<uint64_t>> parts(threads);
+        {
+            vector<jthread> workers;
+            size_t chunk = file.size() / threads;
+            for (size_t t = 0; t < threads; ++t)
+            {
+                size_t first = t * chunk;
+                size_t last = t + 1 == threads ? file.size() : first + chunk;
+                workers.emplace_back([=, &parts] { scan(p, first, last, delim, parts[t]); });
+            }
+        }
+
+        line_index index;
+        index.indexed_size = file.size();
+
+        size_t total = 1;
+        for (const auto& part : parts) { total += part.size(); }
+        index.offsets.reserve(total);
+
+        if (!file.empty()) { index.offsets.push_back(0); }
+        for (const auto& part : parts) { index.offsets.insert(index.offsets.end(), part.begin(), part.end()); }
+
+        // 以分隔符结尾的文件最后没有新记录
+        if (!index.offsets.empty() && index.offsets.back() == file.size()) { index.offsets.pop_back(); }
+
+        return index;
+    }
+
+    void save(string_view path) const
+    {
+        stdio_file_ostream out {path};
+
+        out.write(span<const char> {magic});
+        write_binary<uint64_t>(out, indexed_size);
+        write_varint<uint64_t>(out, offsets.size());
+
+        array<uint64_t, 4096> deltas;
+        uint64_t previous {};
+        for (size_t i = 0; i < offsets.size(); i += deltas.size())
+        {
+            size_t n = min(deltas.size(), offsets.size() - i);
+            for (size_t j = 0; j < n; ++j)
+            {
+                deltas[j] = offsets[i + j] - previous;
+                previous = offsets[i + j];
+            }
+            write_varints<uint64_t>(out, span {data(deltas), n});
+        }
+
+        out.flush();
+    }
+
+    static line_index load(string_view path)
+    {
+        vector<char> bytes;
+        stdio_file_istream {path}.read_all(bytes);
+
+        ISpanStream in {bytes};
+        if (in.window().size() < magic.size() || !ranges::equal(as_bytes(span {magic}), in.window().first(magic.size())))
+        {
+            throw runtime_error("Not a line index file.");
+        }
+        in.consume(magic.size());
+
+        line_index index;
+        index.indexed_size = read_binary<uint64_t>(in);
+
+        index.offsets.resize(read_varint<uint64_t>(in));
+        if (read_varints(in, index.offsets) != index.offsets.size()) { throw_stream_error(stream_error::end_of_stream); }
+
+        uint64_t previous {};
+        for (uint64_t& offset : index.offsets)
+        {
+            offset += previous;
+            previous = offset;
+        }
+
+        return index;
+    }
+
+    // 建立索引时文件的大小
+    [[nodiscard]]
+    uint64_t file_size() const
+    {
+        return indexed_size;
+    }
+
+    [[nodiscard]]
+    size_t size() const
+    {
+        return offsets.size();
+    }
+
+    [[nodiscard]]
+    uint64_t offset(size_t n) const
+    {
+        return offsets.at(n);
+    }
+
+    // 第 n 条记录, 不含分隔符
+    [[nodiscard]]
+    string_view line(span<const byte> file, size_t n, char delim = '\n') const
+    {
+        uint64_t first = offset(n);
+        uint64_t last = n + 1 < size() ? offsets[n + 1] - 1 : min<uint64_t>(indexed_size, file.size());
+        if (last > first && n + 1 == size() && to_integer<char>(file[last - 1]) == delim) { --last; }
+
+        return {reinterpret_cast<const char*>(data(file)) + first, last - first};
+    }
+
+    // 定位到第 n 条记录的开头, 适用于 mmap_istream 等可以 seekg 的流
+    template <typename Stream>
+    void seek(Stream& in, size_t n) const
+    {
+        in.seekg(offset(n));
+    }
+
+    // 记录按 key_of(line) 升序排列时, 返回第一条 key 不小于 key 的记录的行号
+    template <typename Key, typename KeyOf>
+    size_t lower_bound(span<const byte> file, const Key& key, KeyOf key_of, char delim = '\n') const
+    {
+        size_t first {};
+        size_t count = size();
+        while (count > 0)
+        {
+            size_t half = count / 2;
+            if (key_of(line(file, first + half, delim)) < key)
+            {
+                first += half + 1;
+                count -= half + 1;
+            }
+            else { count = half; }
+        }
+        return first;
+    }
+};
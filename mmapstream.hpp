@@ -1,4 +1,9 @@
+#pragma once
+
+#include "fd_stream.hpp"
+#include "stream.hpp"
 #include <algorithm>
+#include <span>
 #include <sys/mman.h>
 #include <sys/stat.h>
 
@@ -15,37 +20,151 @@ namespace streams
 //Resize = sync, unmap, "truncate", remap
 
 //TODO: Handling for large files.
-//TODO: Make seekable.
-class mmap_istream : public istream
+//huge_page::transparent asks for 2 MB pages with MADV_HUGEPAGE, which cuts TLB misses when scanning large files.
+//Regular files cannot be mapped with MAP_HUGETLB, so huge_page::hugetlb falls back to transparent pages.
+//read_mode::follow makes refill() wait on inotify for the file to grow and then extend the mapping;
+//a truncated file is mapped again from the start and a rotated one is reopened by path,
+//both only after the old window has been consumed.
+//It is a buffered_input (window/refill/consume) and does not depend on a stream base class.
+class mmap_istream
 {
 public:
-    explicit mmap_istream(const std::string& path)
+    explicit mmap_istream(const std::string& path, ::huge_page pages = ::huge_page::none, ::read_mode mode = ::read_mode::normal)
+        : _wanted(pages)
     {
-        auto fd = open(path.c_str(), O_RDONLY);
+        auto fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
         if (-1 == fd) { throw std::system_error(errno, std::system_category()); }
         _fd._fd = fd;
 
-        struct stat info;
-        auto result = fstat(fd, &info);
-        if (-1 == result) { throw std::system_error(errno, std::system_category()); }
-        auto length = info.st_size;
+        _map(_file_size());
 
-        auto p = mmap(nullptr, length, PROT_READ, MAP_FILE | MAP_PRIVATE, fd, 0);
-        if (MAP_FAILED == p) { throw std::system_error(errno, std::system_category()); }
+        if (mode == ::read_mode::follow) { _follower = std::make_unique<::file_follower>(path, fd); }
+    }
+
+    //The kind of pages actually requested for the mapping.
+    ::huge_page page_kind() const { return _pages; }
 
-        _mmap.set(reinterpret_cast<gsl::byte*>(p), length);
+    //The whole mapping is the buffer: window() is everything not yet consumed
+    //and refill() only has something to add in follow mode.
+    std::span<const std::byte> window() const
+    {
+        return {reinterpret_cast<const std::byte*>(_mmap._p) + _pos, _mmap._s - static_cast<size_t>(_pos)};
     }
+    //The old content is left only once the window has been used up; until then a rotation
+    //or a truncation makes refill() return 0, so the unconsumed bytes stay in the window.
+    size_t refill()
+    {
+        if (!_follower) { return 0; }
 
-private:
-    gsl::span<gsl::byte> _read(gsl::span<gsl::byte> bytes) override
+        while (!_follower->stopped())
+        {
+            bool unread = _pos < static_cast<ptrdiff_t>(_mmap._s);
+            auto length = _file_size();
+            //What was appended to the old file before the rotation is read first.
+            if (!unread && length <= _mmap._s && _follower->replaced(_fd._fd))
+            {
+                auto fd = open(_follower->file_path().c_str(), O_RDONLY | O_CLOEXEC);
+                if (-1 != fd)
+                {
+                    _map(0);
+                    close(_fd._fd);
+                    _fd._fd = fd;
+                    _follower->watch(fd);
+                    _pos = 0;
+                    _truncated = false;
+                    _map(_file_size());
+                    if (_mmap._s > 0) { return _mmap._s; }
+                    continue;
+                }
+            }
+
+            if (_truncated || length < _mmap._s)
+            {
+                if (unread)
+                {
+                    if (!_truncated) { _drop_past(length); }
+                    return 0;
+                }
+
+                _map(0);
+                _pos = 0;
+                _truncated = false;
+                _map(length);
+                if (length > 0) { return length; }
+            }
+            else if (length > _mmap._s)
+            {
+                auto old = _mmap._s;
+                _map(length);
+                return length - old;
+            }
+            else if (unread && _follower->replaced(_fd._fd)) { return 0; }
+
+            if (!_follower->wait()) { break; }
+        }
+        return 0;
+    }
+    void consume(size_t n) { _pos += static_cast<ptrdiff_t>(n); }
+
+    //Wakes up a refill() waiting in follow mode, from any thread; it then returns 0.
+    void stop()
+    {
+        if (_follower) { _follower->stop(); }
+    }
+
+    //The whole file, regardless of the read position.
+    std::span<const std::byte> mapping() const { return {reinterpret_cast<const std::byte*>(_mmap._p), _mmap._s}; }
+
+    //Copies up to bytes.size() bytes from the read position.
+    std::span<std::byte> read(std::span<std::byte> bytes)
     {
-        ptrdiff_t bytes_left = _mmap._s - _pos;
-        auto length = std::min(bytes_left, bytes.size());
+        auto length = std::min(_mmap._s - static_cast<size_t>(_pos), bytes.size());
         std::copy_n(_mmap._p + _pos, length, bytes.data());
-        _pos += length;
+        _pos += static_cast<ptrdiff_t>(length);
         return bytes.first(length);
     }
 
+    size_t tellg() const { return static_cast<size_t>(_pos); }
+    void seekg(size_t pos) { _pos = static_cast<ptrdiff_t>(std::min(pos, _mmap._s)); }
+
+private:
+    size_t _file_size() const
+    {
+        struct stat info;
+        if (-1 == fstat(_fd._fd, &info)) { throw std::system_error(errno, std::system_category()); }
+        return static_cast<size_t>(info.st_size);
+    }
+
+    //Maps the first length bytes of the file, growing or shrinking the existing mapping in place when possible.
+    void _map(size_t length)
+    {
+        void* p = nullptr;
+        if (length > 0 && _mmap._p) { p = mremap(_mmap._p, _mmap._s, length, MREMAP_MAYMOVE); }
+        else if (length > 0) { p = mmap(nullptr, length, PROT_READ, MAP_FILE | MAP_PRIVATE, _fd._fd, 0); }
+        else if (_mmap._p) { munmap(_mmap._p, _mmap._s); }
+        if (MAP_FAILED == p) { throw std::system_error(errno, std::system_category()); }
+
+        _mmap._p = reinterpret_cast<std::byte*>(p);
+        _mmap._s = length;
+        _pos = std::min(_pos, static_cast<ptrdiff_t>(length));
+
+        if (_wanted != ::huge_page::none && length > 0) { _pages = ::advise_huge_pages(p, length); }
+    }
+
+    //After a truncation the pages past the new end of the file would raise SIGBUS;
+    //they are replaced with zero pages so that the rest of the window can still be consumed.
+    void _drop_past(size_t length)
+    {
+        auto page = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+        auto start = (length + page - 1) / page * page;
+        if (start < _mmap._s)
+        {
+            void* p = mmap(_mmap._p + start, _mmap._s - start, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0);
+            if (MAP_FAILED == p) { throw std::system_error(errno, std::system_category()); }
+        }
+        _truncated = true;
+    }
+
     struct Fd
     {
         int _fd;
@@ -58,9 +177,9 @@ private:
 
     struct Mmap
     {
-        gsl::byte* _p = nullptr;
+        std::byte* _p = nullptr;
         size_t _s = 0;
-        void set(gsl::byte* p, size_t s)
+        void set(std::byte* p, size_t s)
         {
             _p = p;
             _s = s;
@@ -74,5 +193,9 @@ private:
     Fd _fd;
     Mmap _mmap;
     ptrdiff_t _pos = 0;
+    ::huge_page _wanted = ::huge_page::none;
+    ::huge_page _pages = ::huge_page::none;
+    std::unique_ptr<::file_follower> _follower;
+    bool _truncated = false; //The mapping still holds content cut off from the file.
 };
 } // namespace streams
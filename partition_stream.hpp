@@ -0,0 +1,139 @@
+#pragma once
+
+#include "stream.hpp"
+#include <functional>
+#include <list>
+
+struct partition_options
+{
+    size_t block_size {4096};                 // 缓冲区块的大小, 所有分区共用一个 block_pool
+    size_t partition_bytes {256 * 1024};      // 一个分区缓冲到这么多时单独写出
+    size_t memory_budget {size_t {64} << 20}; // 所有分区缓冲的总量, 超过时从最大的分区开始写出, 直到降到一半
+    size_t max_open_files {256};              // 同时打开的文件数, 超过时关闭最久没有写过的
+};
+
+// 按键的哈希把记录分到 N 个文件中, 用于 shuffle 等需要成千上万个输出文件的场合
+// 每个分区的缓冲区是 segmented_buffer, 从共享的 block_pool 中按块取用, 空的分区不占内存;
+// 写出时一个分区的所有块用一次 writev 交给 fd_ostream
+// 文件第一次打开时截断, 之后被 LRU 关闭再打开时追加; 不是线程安全的
+class partitioned_writer
+{
+    struct partition
+    {
+        segmented_buffer buffer;
+        optional<fd_ostream> file;
+        list<size_t>::iterator lru;
+        bool created {false};
+    };
+
+    function<string(size_t)> path_for;
+    partition_options options;
+    block_pool pool;
+    vector<partition> partitions;
+    list<size_t> open_order; // 最近写过的在前面
+    size_t buffered_bytes {};
+
+    fd_ostream& file(size_t index)
+    {
+        partition& p = partitions[index];
+        if (p.file)
+        {
+            open_order.splice(open_order.begin(), open_order, p.lru);
+            return *p.file;
+        }
+
+        if (open_order.size() >= options.max_open_files)
+        {
+            size_t victim = open_order.back();
+            open_order.pop_back();
+            partitions[victim].file.reset();
+        }
+
+        int flags = O_WRONLY | O_CREAT | O_CLOEXEC | (p.created ? O_APPEND : O_TRUNC);
+        p.file.emplace(path_for(index), sync_policy {durability::none}, flags);
+        p.created = true;
+        open_order.push_front(index);
+        p.lru = open_order.begin();
+        return *p.file;
+    }
+
+    void write_out(size_t index)
+    {
+        partition& p = partitions[index];
+        if (p.buffer.size() == 0) { return; }
+
+        p.buffer.write_to(file(index));
+        buffered_bytes -= p.buffer.size();
+        p.buffer.clear();
+    }
+
+    // 从最大的分区开始写出, 大的分区一次 writev 写出的数据多
+    void shrink()
+    {
+        vector<size_t> order(partitions.size());
+        for (size_t i = 0; i < order.size(); ++i) { order[i] = i; }
+        ranges::sort(order, greater {}, [this](size_t i) { return partitions[i].buffer.size(); });
+
+        for (size_t index : order)
+        {
+            if (buffered_bytes <= options.memory_budget / 2) { break; }
+            write_out(index);
+        }
+    }
+
+public:
+    partitioned_writer(size_t count, function<string(size_t)> path_for_, partition_options options_ = {})
+        : path_for {std::move(path_for_)}, options {options_}, pool {options_.block_size, options_.memory_budget / options_.block_size}
+    {
+        if (count == 0 || options.max_open_files == 0) { throw runtime_error("Invalid partition options."); }
+
+        partitions.reserve(count);
+        for (size_t i = 0; i < count; ++i) { partitions.push_back({segmented_buffer {pool}, nullopt, {}, false}); }
+    }
+
+    partitioned_writer(const partitioned_writer&) = delete;
+    partitioned_writer& operator=(const partitioned_writer&) = delete;
+
+    ~partitioned_writer() { discard_errors([this] { flush(); }); }
+
+    [[nodiscard]]
+    size_t size() const
+    {
+        return partitions.size();
+    }
+
+    [[nodiscard]]
+    size_t partition_of(string_view key) const
+    {
+        return hash<string_view> {}(key) % partitions.size();
+    }
+
+    void write(string_view key, span<const char> record) { write_to(partition_of(key), record); }
+
+    void write_to(size_t index, span<const char> record)
+    {
+        partition& p = partitions[index];
+        p.buffer.write(record);
+        buffered_bytes += record.size();
+
+        if (p.buffer.size() >= options.partition_bytes) { write_out(index); }
+        else if (buffered_bytes > options.memory_budget) { shrink(); }
+    }
+
+    void flush()
+    {
+        for (size_t i = 0; i < partitions.size(); ++i) { write_out(i); }
+    }
+
+    [[nodiscard]]
+    size_t buffered() const
+    {
+        return buffered_bytes;
+    }
+
+    [[nodiscard]]
+    size_t open_files() const
+    {
+        return open_order.size();
+    }
+};
@@ -0,0 +1,186 @@
+#pragma once
+
+#include "stream.hpp"
+#include <climits>
+#include <sys/uio.h>
+#include <unordered_map>
+
+// 按偏移量读写的文件, 基于 pread/pwrite, 不使用共享的文件位置, 多个线程可以同时调用
+// cache_blocks 不为 0 时每个线程缓存最近读过的 cache_blocks 个块;
+// write_at() 使所有线程对这个文件的缓存失效, 与 write_at() 同时进行的 read_at() 可能读到旧数据
+class positional_stream
+{
+    struct cached_block
+    {
+        uint64_t index;
+        uint64_t last_used;
+        vector<byte> data;
+    };
+
+    struct block_cache
+    {
+        uint64_t generation;
+        uint64_t tick;
+        vector<cached_block> blocks;
+    };
+
+    // 复制出的对象共享文件和缓存, 任何一个的 write_at() 都使缓存失效; 最后一个析构时关闭文件
+    struct shared_file
+    {
+        int fd;
+        uint64_t id;
+        atomic<uint64_t> generation {};
+
+        ~shared_file() { close(fd); }
+    };
+
+    static inline atomic<uint64_t> next_id {1};
+
+    int fd {-1};
+    shared_ptr<shared_file> file;
+    size_t block_size;
+    size_t cache_blocks;
+
+    static size_t pread_full(int fd, byte* p, size_t n, uint64_t offset)
+    {
+        size_t done {};
+        while (done < n)
+        {
+            auto ret = pread(fd, p + done, n - done, static_cast<off_t>(offset + done));
+            if (ret == -1)
+            {
+                if (errno == EINTR) { continue; }
+                throw system_error {errno, system_category()};
+            }
+            if (ret == 0) { break; }
+            done += static_cast<size_t>(ret);
+        }
+        return done;
+    }
+
+    // 当前线程中这个文件的缓存
+    block_cache& thread_cache() const
+    {
+        thread_local unordered_map<uint64_t, block_cache> caches;
+        if (caches.size() > 64 && !caches.contains(file->id)) { caches.clear(); } // 已关闭的文件的缓存不会被清理, 限制数量
+
+        block_cache& cache = caches[file->id];
+        uint64_t current = file->generation.load();
+        if (cache.generation != current)
+        {
+            cache.generation = current;
+            cache.blocks.clear();
+        }
+        return cache;
+    }
+
+    const cached_block& load_block(block_cache& cache, uint64_t index) const
+    {
+        ++cache.tick;
+        for (cached_block& block : cache.blocks)
+        {
+            if (block.index == index)
+            {
+                block.last_used = cache.tick;
+                return block;
+            }
+        }
+
+        cached_block* slot {};
+        if (cache.blocks.size() < cache_blocks) { slot = &cache.blocks.emplace_back(); }
+        else { slot = &*ranges::min_element(cache.blocks, {}, &cached_block::last_used); }
+
+        slot->index = index;
+        slot->last_used = cache.tick;
+        slot->data.resize(block_size);
+        slot->data.resize(pread_full(fd, slot->data.data(), block_size, index * block_size));
+        return *slot;
+    }
+
+public:
+    explicit positional_stream(string_view path, int flags = O_RDONLY, size_t cache_blocks_ = 0, size_t block_size_ = 4096)
+        : block_size {block_size_}, cache_blocks {cache_blocks_}
+    {
+        string p {path};
+        fd = open(p.c_str(), flags, 0644);
+        if (fd == -1) { throw system_error {errno, system_category()}; }
+        file = make_shared<shared_file>(fd, next_id++);
+    }
+
+    int get() const { return fd; }
+
+    [[nodiscard]]
+    uint64_t size() const
+    {
+        struct stat info;
+        if (fstat(fd, &info) == -1) { throw system_error {errno, system_category()}; }
+        return static_cast<uint64_t>(info.st_size);
+    }
+
+    // 返回读到的字节数, 少于 size(s) 说明到了文件末尾
+    size_t read_at(uint64_t offset, span<byte> s) const
+    {
+        // 大块读取不经过缓存
+        if (cache_blocks == 0 || s.size() > block_size * cache_blocks / 2) { return pread_full(fd, s.data(), s.size(), offset); }
+
+        block_cache& cache = thread_cache();
+        size_t done {};
+        while (done < s.size())
+        {
+            uint64_t position = offset + done;
+            const cached_block& block = load_block(cache, position / block_size);
+
+            size_t skip = position % block_size;
+            if (skip >= block.data.size()) { break; }
+
+            size_t n = min(block.data.size() - skip, s.size() - done);
+            copy_n(block.data.begin() + static_cast<ptrdiff_t>(skip), n, s.begin() + static_cast<ptrdiff_t>(done));
+            done += n;
+
+            if (block.data.size() < block_size) { break; }
+        }
+        return done;
+    }
+
+    // 一次系统调用读到多个缓冲区中, 不经过缓存
+    size_t read_at(uint64_t offset, span<const span<byte>> parts) const
+    {
+        vector<iovec> iov;
+        iov.reserve(parts.size());
+        for (span<byte> part : parts) { iov.push_back({part.data(), part.size()}); }
+
+        size_t done {};
+        span<iovec> rest {iov};
+        while (!rest.empty())
+        {
+            auto ret = preadv(fd, rest.data(), static_cast<int>(min<size_t>(rest.size(), IOV_MAX)), static_cast<off_t>(offset + done));
+            if (ret == -1)
+            {
+                if (errno == EINTR) { continue; }
+                throw system_error {errno, system_category()};
+            }
+            if (ret == 0) { break; }
+
+            done += static_cast<size_t>(ret);
+            rest = advance_iov(rest, static_cast<size_t>(ret));
+        }
+        return done;
+    }
+
+    void write_at(uint64_t offset, span<const byte> s)
+    {
+        while (!s.empty())
+        {
+            auto ret = pwrite(fd, s.data(), s.size(), static_cast<off_t>(offset));
+            if (ret == -1)
+            {
+                if (errno == EINTR) { continue; }
+                throw system_error {errno, system_category()};
+            }
+            s = s.subspan(static_cast<size_t>(ret));
+            offset += static_cast<uint64_t>(ret);
+        }
+
+        if (cache_blocks > 0) { ++file->generation; }
+    }
+};
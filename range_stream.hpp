@@ -0,0 +1,221 @@
+#pragma once
+
+#include "stream.hpp"
+#include <cstring>
+#include <iterator>
+#include <ranges>
+
+// 把 buffered_input (IBUfStream, ISpanStream, mmap_istream, any_istream ...) 当作 input_range 使用,
+// ranges 算法直接运行在缓冲区上, 不用每个字节调用一次 get()
+// 视图引用输入流, 只能遍历一次; 当前元素在迭代器前进时才被消费, 提前结束时剩下的数据仍然可以从流中读取
+// 文件描述符用 IBUfStream<fd_istream> 包装
+
+// 每个元素是一次 window() 得到的整块数据, 只在迭代器前进之前有效
+template <buffered_input Source>
+class chunk_view : public ranges::view_interface<chunk_view<Source>>
+{
+    Source* in;
+
+public:
+    class iterator
+    {
+        Source* in {};
+        span<const byte> chunk;
+
+    public:
+        using value_type = span<const byte>;
+        using difference_type = ptrdiff_t;
+
+        iterator() = default;
+        explicit iterator(Source& in_) : in {&in_}, chunk {in_.window()} {}
+
+        span<const byte> operator*() const { return chunk; }
+
+        iterator& operator++()
+        {
+            in->consume(size(chunk));
+            chunk = in->window();
+            return *this;
+        }
+        void operator++(int) { ++*this; }
+
+        bool operator==(default_sentinel_t) const { return chunk.empty(); }
+    };
+
+    explicit chunk_view(Source& in_) : in {&in_} {}
+
+    iterator begin() { return iterator {*in}; }
+    default_sentinel_t end() const { return default_sentinel; }
+};
+
+// 逐字节的视图, 迭代器在当前块内只移动指针, 块读完时才访问输入流
+template <buffered_input Source>
+class byte_view : public ranges::view_interface<byte_view<Source>>
+{
+    Source* in;
+    span<const byte> chunk;
+    size_t pos {};
+
+    void advance()
+    {
+        if (++pos < size(chunk)) { return; }
+
+        in->consume(pos);
+        pos = 0;
+        chunk = in->window();
+    }
+
+public:
+    class iterator
+    {
+        byte_view* view {};
+
+    public:
+        using value_type = byte;
+        using difference_type = ptrdiff_t;
+
+        iterator() = default;
+        explicit iterator(byte_view& view_) : view {&view_} {}
+
+        byte operator*() const { return view->chunk[view->pos]; }
+
+        iterator& operator++()
+        {
+            view->advance();
+            return *this;
+        }
+        void operator++(int) { ++*this; }
+
+        bool operator==(default_sentinel_t) const { return view->pos == size(view->chunk); }
+    };
+
+    explicit byte_view(Source& in_) : in {&in_} {}
+
+    byte_view(byte_view&& other) noexcept : in {other.in}, chunk {exchange(other.chunk, {})}, pos {exchange(other.pos, 0)} {}
+    byte_view& operator=(byte_view&& other) noexcept
+    {
+        if (this != &other)
+        {
+            release();
+            in = other.in;
+            chunk = exchange(other.chunk, {});
+            pos = exchange(other.pos, 0);
+        }
+        return *this;
+    }
+
+    ~byte_view() { release(); }
+
+    // 已经遍历过的字节交还给输入流
+    void release()
+    {
+        if (pos > 0) { in->consume(pos); }
+        chunk = {};
+        pos = 0;
+    }
+
+    iterator begin()
+    {
+        if (pos == size(chunk))
+        {
+            release();
+            chunk = in->window();
+        }
+        return iterator {*this};
+    }
+    default_sentinel_t end() const { return default_sentinel; }
+};
+
+// 按 delim 分割的记录, 不含分隔符; 跨越块边界的记录由 refill() 拼接在同一个窗口中
+// 每个元素指向输入流的缓冲区, 只在迭代器前进之前有效
+template <buffered_input Source>
+class line_view : public ranges::view_interface<line_view<Source>>
+{
+    Source* in;
+    char delim;
+    string_view line;
+    size_t line_size {}; // 当前记录包括分隔符的长度
+    bool done {false};
+
+    void next()
+    {
+        in->consume(exchange(line_size, 0));
+
+        size_t scan {};
+        span<const byte> w = in->window();
+        while (true)
+        {
+            const char* base = reinterpret_cast<const char*>(data(w));
+            if (scan < size(w))
+            {
+                if (const void* p = memchr(base + scan, delim, size(w) - scan); p != nullptr)
+                {
+                    line = {base, static_cast<size_t>(static_cast<const char*>(p) - base)};
+                    line_size = size(line) + 1;
+                    return;
+                }
+                scan = size(w);
+            }
+
+            bool more = in->refill() != 0;
+            w = in->window();
+            if (!more) { break; }
+        }
+
+        // 最后一条记录没有分隔符
+        line = {reinterpret_cast<const char*>(data(w)), size(w)};
+        line_size = size(w);
+        done = w.empty();
+    }
+
+public:
+    class iterator
+    {
+        line_view* view {};
+
+    public:
+        using value_type = string_view;
+        using difference_type = ptrdiff_t;
+
+        iterator() = default;
+        explicit iterator(line_view& view_) : view {&view_} {}
+
+        string_view operator*() const { return view->line; }
+
+        iterator& operator++()
+        {
+            view->next();
+            return *this;
+        }
+        void operator++(int) { ++*this; }
+
+        bool operator==(default_sentinel_t) const { return view->done; }
+    };
+
+    explicit line_view(Source& in_, char delim_ = '\n') : in {&in_}, delim {delim_} {}
+
+    iterator begin()
+    {
+        if (line_size == 0 && !done) { next(); }
+        return iterator {*this};
+    }
+    default_sentinel_t end() const { return default_sentinel; }
+};
+
+template <buffered_input Source>
+chunk_view<Source> chunks(Source& in)
+{
+    return chunk_view<Source> {in};
+}
+
+template <buffered_input Source>
+byte_view<Source> bytes(Source& in)
+{
+    return byte_view<Source> {in};
+}
+
+template <buffered_input Source>
+line_view<Source> lines(Source& in, char delim = '\n')
+{
+    return line_view<Source> {in, delim};
+}
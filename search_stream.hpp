@@ -0,0 +1,255 @@
+#pragma once
+
+#include "binary_stream.hpp"
+#include "stream.hpp"
+#include <array>
+#include <bit>
+#include <cstring>
+#include <iterator>
+#include <ranges>
+
+#if defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+// 在 buffered_input 中查找多字节的分隔符, 如 multipart 的 "\r\n\r\n" 或记录之间的 "---\n"
+// 跨越 refill() 的匹配也能找到: 每次 refill() 之后从窗口末尾的 size() - 1 个字节之前开始继续查找
+
+// 预处理过的模式, 多次查找同一个分隔符时只构造一次
+// 短模式先比较首尾两个字节, 16 个位置一起比较, 候选位置再用 memcmp 验证; 长模式用 Horspool 算法
+class pattern_searcher
+{
+    string pattern;
+    array<size_t, 256> shift {};
+    bool horspool;
+
+    size_t find_short(const char* text, size_t n) const
+    {
+        size_t m = pattern.size();
+        size_t i {};
+
+#if defined(__SSE2__)
+        const __m128i first = _mm_set1_epi8(pattern.front());
+        const __m128i last = _mm_set1_epi8(pattern.back());
+        for (; i + 16 + m - 1 <= n; i += 16)
+        {
+            __m128i a = _mm_cmpeq_epi8(first, _mm_loadu_si128(reinterpret_cast<const __m128i*>(text + i)));
+            __m128i b = _mm_cmpeq_epi8(last, _mm_loadu_si128(reinterpret_cast<const __m128i*>(text + i + m - 1)));
+            for (auto mask = static_cast<unsigned>(_mm_movemask_epi8(_mm_and_si128(a, b))); mask != 0; mask &= mask - 1)
+            {
+                size_t k = i + static_cast<size_t>(countr_zero(mask));
+                if (memcmp(text + k + 1, data(pattern) + 1, m - 2) == 0) { return k; }
+            }
+        }
+#endif
+
+        while (i + m <= n)
+        {
+            const void* p = memchr(text + i, pattern.front(), n - m + 1 - i);
+            if (p == nullptr) { break; }
+
+            size_t k = static_cast<size_t>(static_cast<const char*>(p) - text);
+            if (text[k + m - 1] == pattern.back() && memcmp(text + k, data(pattern), m - 1) == 0) { return k; }
+            i = k + 1;
+        }
+        return string_view::npos;
+    }
+
+    size_t find_horspool(const char* text, size_t n) const
+    {
+        size_t m = pattern.size();
+        for (size_t i = 0; i + m <= n; i += shift[static_cast<unsigned char>(text[i + m - 1])])
+        {
+            if (text[i + m - 1] == pattern.back() && memcmp(text + i, data(pattern), m - 1) == 0) { return i; }
+        }
+        return string_view::npos;
+    }
+
+public:
+    static constexpr size_t horspool_threshold = 32;
+
+    explicit pattern_searcher(string_view pattern_) : pattern {pattern_}, horspool {pattern_.size() >= horspool_threshold}
+    {
+        if (pattern.empty()) { throw runtime_error("Empty search pattern."); }
+        if (!horspool) { return; }
+
+        shift.fill(pattern.size());
+        for (size_t i = 0; i + 1 < pattern.size(); ++i) { shift[static_cast<unsigned char>(pattern[i])] = pattern.size() - 1 - i; }
+    }
+
+    [[nodiscard]]
+    size_t size() const
+    {
+        return pattern.size();
+    }
+
+    // 第一次出现的位置, 没有时返回 npos
+    [[nodiscard]]
+    size_t find(string_view text) const
+    {
+        if (text.size() < pattern.size()) { return string_view::npos; }
+        if (pattern.size() == 1)
+        {
+            const void* p = memchr(data(text), pattern.front(), text.size());
+            return p == nullptr ? string_view::npos : static_cast<size_t>(static_cast<const char*>(p) - data(text));
+        }
+        return horspool ? find_horspool(data(text), text.size()) : find_short(data(text), text.size());
+    }
+};
+
+struct until_result
+{
+    string_view data; // 分隔符之前的数据, 不含分隔符
+    bool found;       // 为 false 时到达了流的末尾, data 是剩下的全部数据
+};
+
+namespace search_detail
+{
+    inline string_view as_text(span<const byte> w)
+    {
+        return {reinterpret_cast<const char*>(data(w)), size(w)};
+    }
+
+    // 窗口中只保留可能是匹配开头的最后 size() - 1 个字节, 之前的交给 emit 后消费, 缓冲区不会增长
+    template <buffered_input Source, typename Emit>
+    bool drain_until(Source& in, const pattern_searcher& pattern, Emit emit)
+    {
+        size_t m = pattern.size();
+        while (true)
+        {
+            string_view text = as_text(in.window());
+            if (size_t p = pattern.find(text); p != string_view::npos)
+            {
+                emit(text.substr(0, p));
+                in.consume(p + m);
+                return true;
+            }
+
+            size_t n = size(text) - min(size(text), m - 1);
+            emit(text.substr(0, n));
+            in.consume(n);
+
+            if (in.refill() == 0)
+            {
+                text = as_text(in.window());
+                emit(text);
+                in.consume(size(text));
+                return false;
+            }
+        }
+    }
+} // namespace search_detail
+
+// 读到 pattern 为止, 消费数据和分隔符
+// 返回的 data 指向输入流的缓冲区, 只在下一次操作输入流之前有效; 记录比缓冲区长时 IBUfStream 会扩大缓冲区
+template <buffered_input Source>
+until_result read_until(Source& in, const pattern_searcher& pattern)
+{
+    size_t m = pattern.size();
+    size_t scan {};
+    while (true)
+    {
+        string_view text = search_detail::as_text(in.window());
+        if (size_t p = pattern.find(text.substr(scan)); p != string_view::npos)
+        {
+            in.consume(scan + p + m);
+            return {text.substr(0, scan + p), true};
+        }
+
+        scan = size(text) - min(size(text), m - 1);
+        if (in.refill() == 0) { break; }
+    }
+
+    string_view text = search_detail::as_text(in.window());
+    in.consume(size(text));
+    return {text, false};
+}
+
+template <buffered_input Source>
+until_result read_until(Source& in, string_view pattern)
+{
+    return read_until(in, pattern_searcher {pattern});
+}
+
+// 分隔符之前的数据写入 out, 用于可能比内存大的记录; 返回是否找到了分隔符
+template <buffered_input Source, output_sink Sink>
+bool read_until(Source& in, const pattern_searcher& pattern, Sink& out)
+{
+    return search_detail::drain_until(in, pattern, [&](string_view s) { if (!s.empty()) { out.write(span<const char> {s}); } });
+}
+
+template <buffered_input Source, output_sink Sink>
+bool read_until(Source& in, string_view pattern, Sink& out)
+{
+    return read_until(in, pattern_searcher {pattern}, out);
+}
+
+// 跳过 pattern 和它之前的数据, 返回是否找到了分隔符; 没有找到时消费所有的数据
+template <buffered_input Source>
+bool skip_until(Source& in, const pattern_searcher& pattern)
+{
+    return search_detail::drain_until(in, pattern, [](string_view) {});
+}
+
+template <buffered_input Source>
+bool skip_until(Source& in, string_view pattern)
+{
+    return skip_until(in, pattern_searcher {pattern});
+}
+
+// 按多字节分隔符分割的记录, 不含分隔符; 和 line_view 一样, 每个元素只在迭代器前进之前有效
+template <buffered_input Source>
+class record_view : public ranges::view_interface<record_view<Source>>
+{
+    Source* in;
+    pattern_searcher pattern;
+    string_view record;
+    bool started {false};
+    bool done {false};
+
+    void next()
+    {
+        auto [data, found] = read_until(*in, pattern);
+        record = data;
+        done = !found && data.empty();
+    }
+
+public:
+    class iterator
+    {
+        record_view* view {};
+
+    public:
+        using value_type = string_view;
+        using difference_type = ptrdiff_t;
+
+        iterator() = default;
+        explicit iterator(record_view& view_) : view {&view_} {}
+
+        string_view operator*() const { return view->record; }
+
+        iterator& operator++()
+        {
+            view->next();
+            return *this;
+        }
+        void operator++(int) { ++*this; }
+
+        bool operator==(default_sentinel_t) const { return view->done; }
+    };
+
+    record_view(Source& in_, string_view pattern_) : in {&in_}, pattern {pattern_} {}
+
+    iterator begin()
+    {
+        if (!exchange(started, true)) { next(); }
+        return iterator {*this};
+    }
+    default_sentinel_t end() const { return default_sentinel; }
+};
+
+template <buffered_input Source>
+record_view<Source> records(Source& in, string_view pattern)
+{
+    return record_view<Source> {in, pattern};
+}
@@ -0,0 +1,45 @@
+#pragma once
+
+#include <cstdint>
+
+#if defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+// 64 字节中等于 c 的字节的位掩码
+inline uint64_t char_mask(const char* p, char c)
+{
+#if defined(__AVX2__)
+    __m256i needle = _mm256_set1_epi8(c);
+    auto lo = static_cast<uint32_t>(_mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(p)), needle)));
+    auto hi = static_cast<uint32_t>(_mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(p + 32)), needle)));
+    return lo | (uint64_t {hi} << 32);
+#elif defined(__SSE2__)
+    __m128i needle = _mm_set1_epi8(c);
+    uint64_t mask {};
+    for (int i = 0; i < 4; ++i)
+    {
+        auto m = static_cast<uint16_t>(_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i*>(p + 16 * i)), needle)));
+        mask |= uint64_t {m} << (16 * i);
+    }
+    return mask;
+#else
+    uint64_t mask {};
+    for (int i = 0; i < 64; ++i)
+    {
+        if (p[i] == c) { mask |= uint64_t {1} << i; }
+    }
+    return mask;
+#endif
+}
+
+// 第 i 位等于 x 的第 0..i 位的异或: 引号掩码经过它就得到 "在引号内" 的掩码
+inline uint64_t prefix_xor(uint64_t x)
+{
+#if defined(__PCLMUL__)
+    return static_cast<uint64_t>(_mm_cvtsi128_si64(_mm_clmulepi64_si128(_mm_set_epi64x(0, static_cast<int64_t>(x)), _mm_set1_epi8(-1), 0)));
+#else
+    for (int shift = 1; shift < 64; shift *= 2) { x ^= x << shift; }
+    return x;
+#endif
+}
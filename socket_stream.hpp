@@ -0,0 +1,542 @@
+#pragma once
+
+#include "stream.hpp"
+#include <arpa/inet.h>
+#include <cstring>
+#include <linux/errqueue.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+// 套接字的输入输出, 和 fd_istream / fd_ostream 一样用 shared_ptr 管理描述符
+// 流套接字: socket_stream 既是 IBUfStream 的 InputHandler 也是 buffered_ostream 的 T, 批量来自缓冲区本身
+// 数据报套接字: datagram_source / datagram_sink 用 recvmmsg / sendmmsg 一次系统调用收发多条消息
+
+namespace socket_detail
+{
+    struct address
+    {
+        sockaddr_storage storage {};
+        socklen_t length {};
+
+        [[nodiscard]]
+        const sockaddr* get() const
+        {
+            return reinterpret_cast<const sockaddr*>(&storage);
+        }
+    };
+
+    // 以 '\0' 开头的路径是 Linux 的抽象命名空间
+    inline address unix_address(string_view path)
+    {
+        address a;
+        auto* un = reinterpret_cast<sockaddr_un*>(&a.storage);
+        if (size(path) >= sizeof(un->sun_path)) { throw runtime_error("Unix socket path too long."); }
+
+        un->sun_family = AF_UNIX;
+        memcpy(un->sun_path, data(path), size(path));
+        a.length = static_cast<socklen_t>(offsetof(sockaddr_un, sun_path) + size(path) + (path.starts_with('\0') ? 0 : 1));
+        return a;
+    }
+
+    inline address inet_address(string_view host, uint16_t port)
+    {
+        address a;
+        auto* in = reinterpret_cast<sockaddr_in*>(&a.storage);
+        string h {host};
+        if (inet_pton(AF_INET, h.c_str(), &in->sin_addr) != 1) { throw runtime_error("Invalid IPv4 address."); }
+
+        in->sin_family = AF_INET;
+        in->sin_port = htons(port);
+        a.length = sizeof(sockaddr_in);
+        return a;
+    }
+
+    inline int open_socket(int domain, int type)
+    {
+        int fd = socket(domain, type | SOCK_CLOEXEC, 0);
+        if (fd == -1) { throw system_error {errno, system_category()}; }
+        return fd;
+    }
+} // namespace socket_detail
+
+class socket_stream
+{
+    int fd {-1};
+    shared_ptr<void> close_guard;
+
+#if defined(MSG_ZEROCOPY) && defined(SO_ZEROCOPY)
+    // 已发送的零拷贝请求数和已完成的通知数; 副本共享同一个描述符, 也共享计数
+    struct zerocopy_state
+    {
+        size_t threshold;
+        uint32_t sent {};
+        uint32_t completed {};
+        bool copied {false}; // 内核实际做了复制 (如回环设备), 之后不再使用零拷贝
+    };
+    shared_ptr<zerocopy_state> zerocopy;
+
+    // 读取错误队列中的完成通知, 直到所有的零拷贝发送都已完成, 之后缓冲区才能被覆盖
+    void wait_zerocopy()
+    {
+        while (zerocopy->completed != zerocopy->sent)
+        {
+            array<char, 256> control;
+            msghdr msg {};
+            msg.msg_control = data(control);
+            msg.msg_controllen = size(control);
+
+            if (recvmsg(fd, &msg, MSG_ERRQUEUE) == -1)
+            {
+                if (errno == EINTR) { continue; }
+                if (errno != EAGAIN) { throw system_error {errno, system_category()}; }
+
+                pollfd p {fd, 0, 0}; // POLLERR 总是会被报告
+                if (poll(&p, 1, -1) == -1 && errno != EINTR) { throw system_error {errno, system_category()}; }
+                continue;
+            }
+
+            for (cmsghdr* c = CMSG_FIRSTHDR(&msg); c != nullptr; c = CMSG_NXTHDR(&msg, c))
+            {
+                bool recverr = (c->cmsg_level == SOL_IP && c->cmsg_type == IP_RECVERR) || (c->cmsg_level == SOL_IPV6 && c->cmsg_type == IPV6_RECVERR);
+                if (!recverr) { continue; }
+
+                sock_extended_err err;
+                memcpy(&err, CMSG_DATA(c), sizeof(err));
+                if (err.ee_origin != SO_EE_ORIGIN_ZEROCOPY) { continue; }
+
+                zerocopy->completed += err.ee_data - err.ee_info + 1; // 通知合并为区间 [ee_info, ee_data]
+                if ((err.ee_code & SO_EE_CODE_ZEROCOPY_COPIED) != 0) { zerocopy->copied = true; }
+            }
+        }
+    }
+#endif
+
+public:
+    // 接管已经打开的描述符
+    explicit socket_stream(int fd_) : fd {fd_}
+    {
+        if (fd == -1) { throw system_error {errno, system_category()}; }
+        close_guard = shared_ptr<void> {nullptr, [fd = fd](void*) { close(fd); }};
+    }
+
+    static socket_stream connect_unix(string_view path, int type = SOCK_STREAM)
+    {
+        socket_stream s {socket_detail::open_socket(AF_UNIX, type)};
+        s.connect(socket_detail::unix_address(path));
+        return s;
+    }
+
+    static socket_stream connect_inet(string_view host, uint16_t port, int type = SOCK_STREAM)
+    {
+        socket_stream s {socket_detail::open_socket(AF_INET, type)};
+        s.connect(socket_detail::inet_address(host, port));
+        return s;
+    }
+
+    // 绑定到地址的数据报套接字, 用作 datagram_source
+    static socket_stream bind_unix(string_view path, int type = SOCK_DGRAM)
+    {
+        socket_stream s {socket_detail::open_socket(AF_UNIX, type)};
+        s.bind(socket_detail::unix_address(path));
+        return s;
+    }
+
+    static socket_stream bind_inet(string_view host, uint16_t port, int type = SOCK_DGRAM)
+    {
+        socket_stream s {socket_detail::open_socket(AF_INET, type)};
+        s.bind(socket_detail::inet_address(host, port));
+        return s;
+    }
+
+    static pair<socket_stream, socket_stream> socket_pair(int type = SOCK_STREAM)
+    {
+        array<int, 2> fds;
+        if (socketpair(AF_UNIX, type | SOCK_CLOEXEC, 0, data(fds)) == -1) { throw system_error {errno, system_category()}; }
+        return {socket_stream {fds[0]}, socket_stream {fds[1]}};
+    }
+
+    int get() { return fd; }
+
+    void connect(const socket_detail::address& a)
+    {
+        while (::connect(fd, a.get(), a.length) == -1)
+        {
+            if (errno != EINTR) { throw system_error {errno, system_category()}; }
+        }
+    }
+
+    void bind(const socket_detail::address& a)
+    {
+        if (::bind(fd, a.get(), a.length) == -1) { throw system_error {errno, system_category()}; }
+    }
+
+    // 关闭写方向, 对端读到文件结束
+    void shutdown_write()
+    {
+        if (::shutdown(fd, SHUT_WR) == -1) { throw system_error {errno, system_category()}; }
+    }
+
+    // 不小于 threshold 的写入使用 MSG_ZEROCOPY, 返回 false 表示套接字不支持 (如 Unix 套接字)
+    // 每次写入在返回前等待完成通知, 因为 buffered_ostream 会马上复用缓冲区
+    bool enable_zerocopy(size_t threshold = 64 * 1024)
+    {
+#if defined(MSG_ZEROCOPY) && defined(SO_ZEROCOPY)
+        int one = 1;
+        if (setsockopt(fd, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(one)) == -1)
+        {
+            if (errno == ENOPROTOOPT || errno == EOPNOTSUPP) { return false; }
+            throw system_error {errno, system_category()};
+        }
+        zerocopy = make_shared<zerocopy_state>(threshold);
+        return true;
+#else
+        (void)threshold;
+        return false;
+#endif
+    }
+
+    // 零拷贝发送是否被内核退化为复制
+    [[nodiscard]]
+    bool zerocopy_copied() const
+    {
+#if defined(MSG_ZEROCOPY) && defined(SO_ZEROCOPY)
+        return zerocopy != nullptr && zerocopy->copied;
+#else
+        return false;
+#endif
+    }
+
+    // 读取已经可以得到的数据, 返回 0 表示对端关闭; 可以作为 IBUfStream 的 InputHandler
+    size_t read(span<byte> bytes)
+    {
+        while (true)
+        {
+            auto ret = recv(fd, data(bytes), size(bytes), 0);
+            if (ret == -1)
+            {
+                if (errno == EINTR) { continue; }
+                throw system_error {errno, system_category()};
+            }
+            return static_cast<size_t>(ret);
+        }
+    }
+
+    void write(span<const char> bytes)
+    {
+        int flags = MSG_NOSIGNAL;
+#if defined(MSG_ZEROCOPY) && defined(SO_ZEROCOPY)
+        bool use_zerocopy = zerocopy != nullptr && !zerocopy->copied && size(bytes) >= zerocopy->threshold;
+        if (use_zerocopy) { flags |= MSG_ZEROCOPY; }
+#endif
+
+        while (size(bytes) > 0)
+        {
+            auto ret = send(fd, data(bytes), size(bytes), flags);
+            if (ret == -1)
+            {
+                if (errno == EINTR) { continue; }
+#if defined(MSG_ZEROCOPY) && defined(SO_ZEROCOPY)
+                // 锁定的页数超过 RLIMIT_MEMLOCK 时退回普通发送
+                if (errno == ENOBUFS && use_zerocopy)
+                {
+                    flags &= ~MSG_ZEROCOPY;
+                    continue;
+                }
+#endif
+                throw system_error {errno, system_category()};
+            }
+#if defined(MSG_ZEROCOPY) && defined(SO_ZEROCOPY)
+            if ((flags & MSG_ZEROCOPY) != 0) { ++zerocopy->sent; }
+#endif
+            bytes = bytes.subspan(static_cast<size_t>(ret));
+        }
+
+#if defined(MSG_ZEROCOPY) && defined(SO_ZEROCOPY)
+        if (use_zerocopy) { wait_zerocopy(); }
+#endif
+    }
+};
+
+// 监听的流套接字, accept() 得到已连接的 socket_stream
+class socket_listener
+{
+    socket_stream socket;
+
+    explicit socket_listener(socket_stream socket_, int backlog) : socket {std::move(socket_)}
+    {
+        if (listen(socket.get(), backlog) == -1) { throw system_error {errno, system_category()}; }
+    }
+
+public:
+    static socket_listener listen_unix(string_view path, int backlog = SOMAXCONN)
+    {
+        return socket_listener {socket_stream::bind_unix(path, SOCK_STREAM), backlog};
+    }
+
+    static socket_listener listen_inet(string_view host, uint16_t port, int backlog = SOMAXCONN)
+    {
+        socket_stream s {socket_detail::open_socket(AF_INET, SOCK_STREAM)};
+        int one = 1;
+        setsockopt(s.get(), SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+        s.bind(socket_detail::inet_address(host, port));
+        return socket_listener {std::move(s), backlog};
+    }
+
+    int get() { return socket.get(); }
+
+    // 实际绑定的端口, 用于绑定到端口 0 的情况
+    [[nodiscard]]
+    uint16_t port()
+    {
+        sockaddr_in a {};
+        socklen_t length = sizeof(a);
+        if (getsockname(socket.get(), reinterpret_cast<sockaddr*>(&a), &length) == -1) { throw system_error {errno, system_category()}; }
+        return ntohs(a.sin_port);
+    }
+
+    socket_stream accept()
+    {
+        while (true)
+        {
+            int fd = accept4(socket.get(), nullptr, nullptr, SOCK_CLOEXEC);
+            if (fd != -1) { return socket_stream {fd}; }
+            if (errno != EINTR) { throw system_error {errno, system_category()}; }
+        }
+    }
+};
+
+// 数据报的输入, 一次 recvmmsg 收取最多 batch 条消息
+// 作为 IBUfStream 的 InputHandler 时消息首尾相连, 消息需要自带分隔符 (如每条指标以 '\n' 结尾)
+// 超过 max_message 的消息被截断时抛出异常; SOCK_SEQPACKET 的对端关闭时返回 0
+class datagram_source
+{
+    socket_stream socket;
+    size_t batch;
+    size_t max_message;
+    bool seqpacket;
+
+    vector<mmsghdr> headers;
+    vector<iovec> slots;
+    vector<byte> staging;
+    vector<span<const byte>> messages;
+    size_t next {}; // messages 中尚未交给 read() 的第一条
+    size_t offset {};
+
+    // 把 buffer 分成 count 个 max_message 大小的槽, 等待至少一条消息后收取所有已到达的消息
+    size_t receive_into(byte* buffer, size_t count)
+    {
+        for (size_t i = 0; i < count; ++i)
+        {
+            slots[i] = {buffer + i * max_message, max_message};
+            headers[i] = {};
+            headers[i].msg_hdr.msg_iov = &slots[i];
+            headers[i].msg_hdr.msg_iovlen = 1;
+        }
+
+        while (true)
+        {
+            int n = recvmmsg(socket.get(), data(headers), static_cast<unsigned>(count), MSG_WAITFORONE, nullptr);
+            if (n == -1)
+            {
+                if (errno == EINTR) { continue; }
+                throw system_error {errno, system_category()};
+            }
+
+            for (int i = 0; i < n; ++i)
+            {
+                if ((headers[static_cast<size_t>(i)].msg_hdr.msg_flags & MSG_TRUNC) != 0) { throw runtime_error("Datagram truncated."); }
+            }
+            return static_cast<size_t>(n);
+        }
+    }
+
+    // 对端关闭的 SOCK_SEQPACKET 不断返回长度为 0 的消息
+    [[nodiscard]]
+    bool closed(size_t count) const
+    {
+        return seqpacket && count > 0 && headers[0].msg_len == 0;
+    }
+
+public:
+    explicit datagram_source(socket_stream socket_, size_t batch_ = 64, size_t max_message_ = 64 * 1024)
+        : socket {std::move(socket_)}, batch {batch_}, max_message {max_message_}, headers(batch_), slots(batch_)
+    {
+        int type {};
+        socklen_t length = sizeof(type);
+        if (getsockopt(socket.get(), SOL_SOCKET, SO_TYPE, &type, &length) == -1) { throw system_error {errno, system_category()}; }
+        seqpacket = type == SOCK_SEQPACKET;
+    }
+
+    socket_stream& get() { return socket; }
+
+    // 收取一批消息, 返回的 span 只在下一次调用之前有效
+    span<const span<const byte>> receive()
+    {
+        if (staging.empty()) { staging.resize(batch * max_message); }
+
+        size_t n = receive_into(data(staging), batch);
+        messages.clear();
+        next = 0;
+        offset = 0;
+        if (closed(n)) { return {}; }
+
+        for (size_t i = 0; i < n; ++i) { messages.emplace_back(data(staging) + i * max_message, headers[i].msg_len); }
+        return messages;
+    }
+
+    size_t read(span<byte> s)
+    {
+        // 上一次放不下的消息
+        if (next < size(messages))
+        {
+            size_t total {};
+            for (; next < size(messages) && total < size(s); ++next, offset = 0)
+            {
+                auto m = messages[next].subspan(offset);
+                size_t n = min(size(m), size(s) - total);
+                copy_n(m.begin(), n, s.begin() + static_cast<ptrdiff_t>(total));
+                total += n;
+                if (n < size(m))
+                {
+                    offset += n;
+                    break;
+                }
+            }
+            return total;
+        }
+
+        while (true)
+        {
+            // 目标足够大时直接收进去, 再把各条消息向前移动到一起
+            size_t count = min(batch, size(s) / max_message);
+            if (count == 0)
+            {
+                if (receive().empty()) { return 0; }
+                if (size_t n = read(s); n > 0) { return n; }
+                continue;
+            }
+
+            size_t n = receive_into(data(s), count);
+            if (closed(n)) { return 0; }
+
+            size_t total {};
+            for (size_t i = 0; i < n; ++i)
+            {
+                if (i > 0) { memmove(data(s) + total, data(s) + i * max_message, headers[i].msg_len); }
+                total += headers[i].msg_len;
+            }
+            if (total > 0) { return total; } // 全部是空消息时继续等待, 返回 0 会被当作文件结束
+        }
+    }
+};
+
+// 数据报的输出, 作为 buffered_ostream 的 T: 写入的数据按 delim 切分, 每条记录 (包括分隔符) 是一条消息,
+// 一次 sendmmsg 发送最多 batch 条; 最后一条不完整的记录留到下一次 write() 或 flush()
+class datagram_sink
+{
+    socket_stream socket;
+    char delim;
+    size_t batch;
+    size_t max_message;
+
+    vector<mmsghdr> headers;
+    vector<iovec> slots;
+    string partial;
+
+    void send_batch(size_t count)
+    {
+        size_t sent {};
+        while (sent < count)
+        {
+            int n = sendmmsg(socket.get(), data(headers) + sent, static_cast<unsigned>(count - sent), MSG_NOSIGNAL);
+            if (n == -1)
+            {
+                if (errno == EINTR) { continue; }
+                throw system_error {errno, system_category()};
+            }
+            sent += static_cast<size_t>(n);
+        }
+    }
+
+    void add(span<const char> message, size_t& count)
+    {
+        if (size(message) > max_message) { throw runtime_error("Datagram too large."); }
+
+        slots[count] = {const_cast<char*>(data(message)), size(message)};
+        headers[count] = {};
+        headers[count].msg_hdr.msg_iov = &slots[count];
+        headers[count].msg_hdr.msg_iovlen = 1;
+        if (++count == batch)
+        {
+            send_batch(count);
+            count = 0;
+        }
+    }
+
+public:
+    explicit datagram_sink(socket_stream socket_, char delim_ = '\n', size_t batch_ = 64, size_t max_message_ = 64 * 1024)
+        : socket {std::move(socket_)}, delim {delim_}, batch {batch_}, max_message {max_message_}, headers(batch_), slots(batch_)
+    {}
+
+    datagram_sink(datagram_sink&&) noexcept = default;
+
+    // buffered_ostream 析构时先交出缓冲区, 再析构 sink, 最后一条记录在这里发送
+    ~datagram_sink() { discard_errors([this] { flush(); }); }
+
+    socket_stream& get() { return socket; }
+
+    // 直接发送一批消息
+    void send(span<const span<const char>> messages)
+    {
+        size_t count {};
+        for (auto m : messages) { add(m, count); }
+        if (count > 0) { send_batch(count); }
+    }
+
+    void write(span<const char> bytes)
+    {
+        size_t count {};
+
+        // 和上一次剩下的部分拼成完整的记录
+        if (!partial.empty())
+        {
+            auto it = ranges::find(bytes, delim);
+            if (it == end(bytes))
+            {
+                partial.append(begin(bytes), end(bytes));
+                return;
+            }
+
+            auto n = static_cast<size_t>(it - begin(bytes)) + 1;
+            partial.append(begin(bytes), begin(bytes) + static_cast<ptrdiff_t>(n));
+            bytes = bytes.subspan(n);
+            add(partial, count);
+        }
+
+        while (true)
+        {
+            const void* p = memchr(data(bytes), delim, size(bytes));
+            if (p == nullptr) { break; }
+
+            auto n = static_cast<size_t>(static_cast<const char*>(p) - data(bytes)) + 1;
+            add(bytes.first(n), count);
+            bytes = bytes.subspan(n);
+        }
+        if (count > 0) { send_batch(count); }
+
+        partial.assign(begin(bytes), end(bytes));
+    }
+
+    // 没有分隔符的最后一条记录也作为一条消息发送
+    void flush()
+    {
+        if (partial.empty()) { return; }
+
+        size_t count {};
+        add(partial, count);
+        send_batch(count);
+        partial.clear();
+    }
+};
@@ -0,0 +1,421 @@
+#pragma once
+
+#include "binary_stream.hpp"
+#include "fd_stream.hpp"
+#include "stream.hpp"
+#include <cstring>
+#include <thread>
+
+// 外部排序: 输入按 memory 分批读入内存, 多个线程各排一段后合并成一个 run 写到临时文件,
+// 最后用败者树把所有 run 合并到输出; run 太多时先分组合并, 每次最多同时打开 fan_in 个
+// 排序是稳定的, 键相同的记录保持输入中的顺序
+
+enum class record_format
+{
+    lines, // 以 delimiter 结尾的记录, 最后一条可以没有分隔符, 输出时补上
+    fixed, // 长度为 record_size 的二进制记录
+};
+
+struct sort_options
+{
+    record_format format {record_format::lines};
+    char delimiter {'\n'};
+    size_t record_size {};                           // fixed 模式下每条记录的字节数
+    size_t memory {size_t {256} << 20};              // 一批数据的大小, 另外每条记录还需要 16 字节的索引
+    size_t threads {thread::hardware_concurrency()}; // 并行排序的线程数, 0 按 1 处理
+    size_t min_slice {64 * 1024};                    // 每个线程至少排序的记录数, 记录少时用更少的线程
+    size_t fan_in {64};                              // 一次合并的 run 数, 每个 run 有 sort_read_ahead 字节的读缓冲
+    string temp_dir {"/tmp"};
+};
+
+// 合并时每个 run 的预读量, 大的缓冲区让多个 run 交替读取时仍然是大块的顺序读
+inline constexpr size_t sort_read_ahead = 1 << 20;
+
+// 默认用整条记录作为键, 按字节比较
+struct whole_record
+{
+    string_view operator()(string_view record) const { return record; }
+};
+
+// 以 separator 分隔的第 index 个字段 (从 0 开始) 作为键, 字段不够时键为空
+struct field_key
+{
+    char separator {'\t'};
+    size_t index {};
+
+    string_view operator()(string_view record) const
+    {
+        for (size_t i = 0; i < index; ++i)
+        {
+            size_t p = record.find(separator);
+            if (p == string_view::npos) { return {}; }
+            record.remove_prefix(p + 1);
+        }
+        return record.substr(0, record.find(separator));
+    }
+};
+
+// 败者树: 内部节点保存比较中失败的一方, tree[0] 是胜者; 一个输入前进之后只需沿着它到根的路径比较 log k 次
+// less(a, b) 比较输入 a 和 b 的当前元素, 已经结束的输入应当比任何输入都大
+template <typename Less>
+class loser_tree
+{
+    vector<size_t> tree;
+    Less less;
+
+public:
+    loser_tree(size_t k, Less less_) : tree(k), less {std::move(less_)}
+    {
+        if (k == 0) { throw runtime_error("Empty loser tree."); }
+
+        vector<size_t> winners(2 * k);
+        for (size_t i = 0; i < k; ++i) { winners[k + i] = i; }
+        for (size_t n = k - 1; n >= 1; --n)
+        {
+            size_t a = winners[2 * n];
+            size_t b = winners[2 * n + 1];
+            bool b_wins = less(b, a);
+            winners[n] = b_wins ? b : a;
+            tree[n] = b_wins ? a : b;
+        }
+        tree[0] = k == 1 ? 0 : winners[1];
+    }
+
+    [[nodiscard]]
+    size_t winner() const
+    {
+        return tree[0];
+    }
+
+    // 输入 i 的当前元素改变之后调用
+    void replay(size_t i)
+    {
+        size_t w = i;
+        for (size_t n = (i + tree.size()) / 2; n >= 1; n /= 2)
+        {
+            if (less(tree[n], w)) { swap(tree[n], w); }
+        }
+        tree[0] = w;
+    }
+};
+
+// 临时文件, 析构时删除
+class temp_run
+{
+    string path;
+
+public:
+    explicit temp_run(const string& dir) : path {dir + "/sort.XXXXXX"}
+    {
+        int fd = mkstemp(data(path));
+        if (fd == -1) { throw system_error {errno, system_category()}; }
+        close(fd);
+    }
+
+    temp_run(temp_run&& other) noexcept : path {exchange(other.path, {})} {}
+    temp_run& operator=(temp_run&&) = delete;
+
+    ~temp_run()
+    {
+        if (!path.empty()) { unlink(path.c_str()); }
+    }
+
+    [[nodiscard]]
+    const string& get() const
+    {
+        return path;
+    }
+};
+
+namespace sort_detail
+{
+    template <output_sink Sink>
+    void write_record(Sink& out, string_view record, const sort_options& options)
+    {
+        out.write(span<const char> {record});
+        if (options.format == record_format::lines) { out.write(span<const char> {&options.delimiter, 1}); }
+    }
+
+    // next(i, record) 取出输入 i 的下一条记录, 没有时返回 false; 上一条记录在这之后可以失效
+    template <typename Key, typename Next, output_sink Sink>
+    void merge_records(size_t k, Next next, const Key& key, const sort_options& options, Sink& out)
+    {
+        vector<string_view> heads(k);
+        vector<char> live(k);
+        for (size_t i = 0; i < k; ++i) { live[i] = next(i, heads[i]); }
+
+        // 键相同时序号小的输入在前, 保证稳定
+        loser_tree tree {k, [&](size_t a, size_t b) {
+                             if (!live[a]) { return false; }
+                             if (!live[b]) { return true; }
+                             auto ka = key(heads[a]);
+                             auto kb = key(heads[b]);
+                             if (ka < kb) { return true; }
+                             if (kb < ka) { return false; }
+                             return a < b;
+                         }};
+
+        while (true)
+        {
+            size_t w = tree.winner();
+            if (!live[w]) { break; }
+
+            write_record(out, heads[w], options);
+            live[w] = next(w, heads[w]);
+            tree.replay(w);
+        }
+    }
+
+    // 顺序读取一个 run, 记录指向读缓冲区
+    class run_reader
+    {
+        IBUfStream<fd_istream, sort_read_ahead> in;
+        const sort_options* options;
+        size_t pending {}; // 上一条记录占用的字节数, 下一次 next() 时消费
+
+        static fd_istream open_run(const string& path)
+        {
+            fd_istream file {path};
+            posix_fadvise(file.get(), 0, 0, POSIX_FADV_SEQUENTIAL);
+            return file;
+        }
+
+        static string_view as_text(span<const byte> w) { return {reinterpret_cast<const char*>(data(w)), size(w)}; }
+
+    public:
+        run_reader(const string& path, const sort_options& options_) : in {open_run(path)}, options {&options_} {}
+
+        bool next(string_view& record)
+        {
+            in.consume(exchange(pending, 0));
+
+            if (options->format == record_format::fixed)
+            {
+                string_view text = as_text(in.window());
+                while (size(text) < options->record_size)
+                {
+                    if (in.refill() == 0) { return false; }
+                    text = as_text(in.window());
+                }
+                record = text.substr(0, options->record_size);
+                pending = size(record);
+                return true;
+            }
+
+            size_t scan {};
+            while (true)
+            {
+                string_view text = as_text(in.window());
+                if (size_t p = text.find(options->delimiter, scan); p != string_view::npos)
+                {
+                    record = text.substr(0, p);
+                    pending = p + 1;
+                    return true;
+                }
+
+                scan = size(text);
+                if (in.refill() == 0) { break; }
+            }
+
+            record = as_text(in.window());
+            pending = size(record);
+            return !record.empty();
+        }
+    };
+
+    // 一批记录: 数据复制到 arena 中, records 指向其中完整的记录, 最后不完整的记录留给下一批
+    class run_builder
+    {
+        const sort_options* options;
+        vector<char, default_init_allocator<char>> arena;
+        vector<string_view> records;
+        vector<size_t> bounds; // 每个线程排好的一段是 records[bounds[i], bounds[i + 1])
+        size_t filled {};
+        size_t tail {}; // 不完整的记录的开头
+        bool eof {false};
+
+        void split()
+        {
+            string_view text {data(arena), filled};
+            size_t pos {};
+
+            if (options->format == record_format::fixed)
+            {
+                for (size_t n = options->record_size; pos + n <= filled; pos += n) { records.push_back(text.substr(pos, n)); }
+                if (eof && pos < filled) { throw runtime_error("Partial record at end of input."); }
+            }
+            else
+            {
+                while (true)
+                {
+                    size_t p = text.find(options->delimiter, pos);
+                    if (p == string_view::npos) { break; }
+                    records.push_back(text.substr(pos, p - pos));
+                    pos = p + 1;
+                }
+                if (eof && pos < filled)
+                {
+                    records.push_back(text.substr(pos));
+                    pos = filled;
+                }
+            }
+
+            if (records.empty() && pos < filled) { throw runtime_error("Record larger than sort memory."); }
+            tail = pos;
+        }
+
+    public:
+        explicit run_builder(const sort_options& options_) : options {&options_}
+        {
+            if (options->memory == 0 || options->fan_in < 2) { throw runtime_error("Invalid sort options."); }
+            if (options->format == record_format::fixed && options->record_size == 0) { throw runtime_error("Invalid sort options."); }
+            arena.resize(options->memory);
+        }
+
+        // 读入下一批, 返回 false 表示输入已经读完
+        template <buffered_input Source>
+        bool read(Source& in)
+        {
+            memmove(data(arena), data(arena) + tail, filled - tail);
+            filled -= tail;
+            tail = 0;
+            records.clear();
+
+            while (filled < size(arena) && !eof)
+            {
+                span<const byte> w = in.window();
+                if (w.empty())
+                {
+                    if (in.refill() == 0) { eof = true; }
+                    continue;
+                }
+
+                size_t n = min(size(w), size(arena) - filled);
+                memcpy(data(arena) + filled, data(w), n);
+                in.consume(n);
+                filled += n;
+            }
+
+            split();
+            return !records.empty();
+        }
+
+        // 这一批之后没有数据了
+        [[nodiscard]]
+        bool last() const
+        {
+            return eof && tail == filled;
+        }
+
+        template <typename Key>
+        void sort(const Key& key)
+        {
+            auto less = [&](string_view a, string_view b) { return key(a) < key(b); };
+
+            size_t slices = clamp<size_t>(size(records) / max<size_t>(options->min_slice, 1), 1, max<size_t>(options->threads, 1));
+
+            bounds.resize(slices + 1);
+            for (size_t i = 0; i <= slices; ++i) { bounds[i] = size(records) * i / slices; }
+
+            if (slices == 1)
+            {
+                ranges::stable_sort(records, less);
+                return;
+            }
+
+            vector<jthread> workers;
+            for (size_t i = 0; i < slices; ++i)
+            {
+                workers.emplace_back([&, i] { stable_sort(records.begin() + bounds[i], records.begin() + bounds[i + 1], less); });
+            }
+        }
+
+        // 合并各个线程排好的段, 写入 out
+        template <typename Key, output_sink Sink>
+        void write(const Key& key, Sink& out)
+        {
+            vector<size_t> next_index(bounds.begin(), bounds.end() - 1);
+            auto next = [&](size_t i, string_view& record) {
+                if (next_index[i] == bounds[i + 1]) { return false; }
+                record = records[next_index[i]++];
+                return true;
+            };
+            merge_records(size(bounds) - 1, next, key, *options, out);
+        }
+    };
+
+    template <typename Key, output_sink Sink>
+    void merge_runs(span<const temp_run> runs, const Key& key, const sort_options& options, Sink& out)
+    {
+        vector<run_reader> readers;
+        readers.reserve(size(runs));
+        for (const temp_run& run : runs) { readers.emplace_back(run.get(), options); }
+
+        merge_records(size(readers), [&](size_t i, string_view& record) { return readers[i].next(record); }, key, options, out);
+    }
+
+    inline buffered_ostream<fd_ostream> run_writer(const temp_run& run)
+    {
+        return buffered_ostream<fd_ostream> {fd_ostream {run.get(), sync_policy {durability::none}}, sort_read_ahead};
+    }
+} // namespace sort_detail
+
+// 排序 in 中的全部记录写入 out; key(record) 返回用 < 比较的键, record 不含分隔符
+// in 可以是 mmap_istream, 或者用 async_source 在后台预读的 IBUfStream; 输入只有一批时不使用临时文件
+template <buffered_input Source, output_sink Sink, typename Key = whole_record>
+void external_sort(Source& in, Sink& out, const sort_options& options = {}, Key key = {})
+{
+    sort_detail::run_builder builder {options};
+    vector<temp_run> runs;
+
+    while (builder.read(in))
+    {
+        builder.sort(key);
+        if (runs.empty() && builder.last())
+        {
+            builder.write(key, out);
+            return;
+        }
+
+        temp_run run {options.temp_dir};
+        {
+            auto file = sort_detail::run_writer(run);
+            builder.write(key, file);
+            file.flush();
+        }
+        runs.push_back(std::move(run));
+    }
+
+    // 每一轮把相邻的 fan_in 个 run 合并成一个, 保持 run 之间的顺序
+    while (size(runs) > options.fan_in)
+    {
+        vector<temp_run> merged;
+        for (size_t i = 0; i < size(runs); i += options.fan_in)
+        {
+            span<const temp_run> group = span<const temp_run> {runs}.subspan(i, min(options.fan_in, size(runs) - i));
+            temp_run run {options.temp_dir};
+            {
+                auto file = sort_detail::run_writer(run);
+                sort_detail::merge_runs(group, key, options, file);
+                file.flush();
+            }
+            merged.push_back(std::move(run));
+        }
+        runs = std::move(merged);
+    }
+
+    if (!runs.empty()) { sort_detail::merge_runs(span<const temp_run> {runs}, key, options, out); }
+}
+
+// 排序文件, output 被截断后写入
+template <typename Key = whole_record>
+void sort_file(string_view input, string_view output, const sort_options& options = {}, Key key = {})
+{
+    fd_istream file {input};
+    posix_fadvise(file.get(), 0, 0, POSIX_FADV_SEQUENTIAL);
+
+    IBUfStream<fd_istream, sort_read_ahead> in {file};
+    buffered_ostream<fd_ostream> out {fd_ostream {output, sync_policy {durability::none}}, sort_read_ahead};
+    external_sort(in, out, options, std::move(key));
+    out.flush();
+}
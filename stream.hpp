@@ -1,13 +1,35 @@
-#include "streams/ostream.hpp"
+#pragma once
+
 #include <algorithm>
+#include <array>
+#include <atomic>
 #include <charconv>
+#include <chrono>
+#include <climits>
+#include <concepts>
+#include <condition_variable>
 #include <cstdio>
+#include <cstring>
+#include <expected>
+#include <fcntl.h>
+#include <future>
 #include <iterator>
 #include <memory>
+#include <mutex>
+#include <new>
 #include <optional>
 #include <span>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
 #include <system_error>
+#include <thread>
 #include <type_traits>
+#include <unistd.h>
+#include <utility>
 #include <vector>
 using namespace std;
 
@@ -17,11 +39,246 @@ struct InputStreamError
 struct OutputStreamError
 {};
 
+// 析构函数中写出剩下的数据时使用: 析构函数不能抛出异常, 这时的错误被丢弃
+// 需要知道是否写入成功时, 先显式调用 flush() (filter_sink 是 finish())
+template <typename F>
+void discard_errors(F&& f) noexcept
+{
+    try
+    {
+        f();
+    }
+    catch (...)
+    {
+    }
+}
+
+// try_ 系列函数的错误, 失败时不抛出异常, 用于跳过格式错误的记录
+// 对应的抛出异常的版本抛出 system_error {make_error_code(e)}; io_error 抛出 errno 对应的 system_error
+enum class stream_error
+{
+    end_of_stream = 1, // 没有更多的数据
+    invalid_input,     // 格式不正确
+    out_of_range,      // 数值超出类型的范围
+    no_space,          // 目标缓冲区不够大
+    io_error,          // 系统调用失败, errno 是具体的错误
+};
+
+class stream_error_category : public error_category
+{
+public:
+    [[nodiscard]]
+    const char* name() const noexcept override
+    {
+        return "stream";
+    }
+
+    [[nodiscard]]
+    string message(int e) const override
+    {
+        switch (static_cast<stream_error>(e))
+        {
+            case stream_error::end_of_stream: return "Unexpected end of stream.";
+            case stream_error::invalid_input: return "Invalid input.";
+            case stream_error::out_of_range: return "Value out of range.";
+            case stream_error::no_space: return "Not enough space in buffer.";
+            case stream_error::io_error: return "I/O error.";
+        }
+        return "Unknown stream error.";
+    }
+};
+
+inline const error_category& stream_category()
+{
+    static stream_error_category category;
+    return category;
+}
+
+inline error_code make_error_code(stream_error e)
+{
+    return {static_cast<int>(e), stream_category()};
+}
+
+template <>
+struct std::is_error_code_enum<stream_error> : true_type
+{};
+
+[[noreturn]]
+inline void throw_stream_error(stream_error e)
+{
+    if (e == stream_error::io_error) { throw system_error {errno, system_category()}; }
+    throw system_error {make_error_code(e)};
+}
+
+template <typename U>
+U value_or_throw(expected<U, stream_error> r)
+{
+    if (!r) { throw_stream_error(r.error()); }
+    if constexpr (!is_void_v<U>) { return std::move(*r); }
+}
+
+class token_arena;
+
+// in >> arena.into(token): 词复制到 arena 中, token 指向它
+struct arena_token
+{
+    token_arena& arena;
+    string_view& token;
+};
+
+// 调用者持有的词的存储区: 词连续地复制到大块内存中, 不为每个词分配内存
+// 得到的 string_view 在 reset() 之前有效; reset() 不释放内存, 下一批词复用同样的块
+// intern 为 true 时相同的词只保存一次, 返回同一个 string_view
+class token_arena
+{
+    struct chunk
+    {
+        unique_ptr<char[]> data;
+        size_t size;
+    };
+
+    vector<chunk> chunks;
+    size_t chunk_size;
+    size_t current {};     // 正在使用的块
+    size_t used {};        // 当前块已经使用的字节数
+    size_t token_start {}; // 构造中的词在当前块中的起点
+    bool intern;
+
+    // 驻留表: 开放寻址, 槽中保存哈希值, 多数不相等的词不用访问 arena 就能排除
+    struct slot
+    {
+        size_t hash;
+        string_view token;
+    };
+    vector<slot> slots;
+    size_t interned {};
+
+    // 返回已经存在的相同的词, 否则插入 token 并返回它
+    string_view lookup(string_view token)
+    {
+        if (2 * (interned + 1) > size(slots))
+        {
+            vector<slot> old = exchange(slots, vector<slot>(max<size_t>(64, 2 * size(slots))));
+            for (const slot& e : old)
+            {
+                if (!e.token.empty()) { place(e); }
+            }
+        }
+
+        size_t hash = std::hash<string_view> {}(token);
+        size_t mask = size(slots) - 1;
+        for (size_t i = hash & mask;; i = (i + 1) & mask)
+        {
+            slot& e = slots[i];
+            if (e.token.empty())
+            {
+                e = {hash, token};
+                ++interned;
+                return token;
+            }
+            if (e.hash == hash && e.token == token) { return e.token; }
+        }
+    }
+
+    void place(const slot& e)
+    {
+        size_t mask = size(slots) - 1;
+        size_t i = e.hash & mask;
+        while (!slots[i].token.empty()) { i = (i + 1) & mask; }
+        slots[i] = e;
+    }
+
+    // 当前块放不下 n 个字节时换到下一块, 构造中的词一起搬过去
+    void reserve(size_t n)
+    {
+        if (!chunks.empty() && used + n <= chunks[current].size) { return; }
+
+        size_t partial = used - token_start;
+        size_t need = max(chunk_size, partial + n);
+        size_t next = chunks.empty() ? 0 : current + 1;
+        if (next == chunks.size() || chunks[next].size < need)
+        {
+            chunks.insert(chunks.begin() + static_cast<ptrdiff_t>(next), {make_unique_for_overwrite<char[]>(need), need});
+        }
+
+        if (partial > 0) { memcpy(chunks[next].data.get(), chunks[current].data.get() + token_start, partial); }
+        current = next;
+        token_start = 0;
+        used = partial;
+    }
+
+public:
+    explicit token_arena(size_t chunk_size_ = 64 * 1024, bool intern_ = false) : chunk_size {chunk_size_}, intern {intern_} {}
+
+    token_arena(const token_arena&) = delete;
+    token_arena& operator=(const token_arena&) = delete;
+
+    arena_token into(string_view& token) { return {*this, token}; }
+
+    // 在构造中的词后面追加
+    void push_back(char c)
+    {
+        reserve(1);
+        chunks[current].data[used++] = c;
+    }
+
+    void append(string_view s)
+    {
+        if (s.empty()) { return; }
+
+        reserve(size(s));
+        memcpy(chunks[current].data.get() + used, data(s), size(s));
+        used += size(s);
+    }
+
+    // 结束构造中的词
+    string_view finish()
+    {
+        if (used == token_start) { return {}; }
+
+        string_view token {chunks[current].data.get() + token_start, used - token_start};
+        if (intern)
+        {
+            string_view existing = lookup(token);
+            if (data(existing) != data(token))
+            {
+                used = token_start; // 已经有了, 收回刚写入的空间
+                token = existing;
+            }
+        }
+        token_start = used;
+        return token;
+    }
+
+    // 放弃构造中的词
+    void discard() { used = token_start; }
+
+    string_view store(string_view s)
+    {
+        append(s);
+        return finish();
+    }
+
+    void reset()
+    {
+        current = 0;
+        used = 0;
+        token_start = 0;
+        ranges::fill(slots, slot {});
+        interned = 0;
+    }
+
+    // 不同的词的个数, 只在 intern 为 true 时有意义
+    [[nodiscard]]
+    size_t unique_count() const
+    {
+        return interned;
+    }
+};
+
 template <typename T>
 class InputStream
 {
-    static_assert(is_base_of_v<InputStream, T>);
-
 private:
     bool end_of_file {false};
     size_t gcount {};
@@ -30,9 +287,9 @@ private:
 
     void skip_whitespaces()
     {
-        while (char c = get())
+        for (int c = get(); c != EOF; c = get())
         {
-            if (not_space(c))
+            if (not_space(static_cast<char>(c)))
             {
                 unget();
                 return;
@@ -41,6 +298,9 @@ private:
     }
 
 public:
+    // T 在基类实例化时还不完整, 只能在构造时检查
+    InputStream() { static_assert(is_base_of_v<InputStream, T>); }
+
     [[nodiscard]]
     size_t get_count() const
     {
@@ -88,24 +348,40 @@ public:
     }
     void unget() { return static_cast<T*>(this)->unget(); }
 
-    InputStream& getline(const span<char> line, char delim = '\n')
+    // 读到的字符之后补 '\0'; 一开始就到了文件末尾时返回 end_of_stream,
+    // 行比 line 长时返回 no_space, 已经读到的部分在 line 中, 这一行剩下的部分没有被读走
+    expected<size_t, stream_error> try_getline(const span<char> line, char delim = '\n')
     {
-        if (line.empty()) { throw; }
+        if (line.empty()) { return unexpected {stream_error::no_space}; }
 
-        for (gcount = 0; gcount + 1 < line.size(); ++gcount)
+        size_t n {};
+        bool complete {false};
+        int ch {};
+        for (; n + 1 < line.size(); ++n)
         {
-            int ch = get();
-            if (ch == delim) { break; }
-            if (ch == EOF)
+            ch = get();
+            if (ch == delim || ch == EOF)
             {
-                end_of_file = true;
+                complete = true;
                 break;
             }
-            line[gcount++] = static_cast<char>(ch);
+            line[n] = static_cast<char>(ch);
         }
 
-        line[gcount] = '\0';
+        line[n] = '\0';
+        gcount = n;
+
+        if (ch == EOF && n == 0) { return unexpected {stream_error::end_of_stream}; }
+        if (!complete) { return unexpected {stream_error::no_space}; }
+        return n;
+    }
+
+    // 行比 line 长时截断
+    InputStream& getline(const span<char> line, char delim = '\n')
+    {
+        if (line.empty()) { throw_stream_error(stream_error::no_space); }
 
+        (void)try_getline(line, delim);
         return *this;
     }
 
@@ -133,8 +409,8 @@ public:
 
     InputStream& ignore(size_t ignore_size = 1, int delim = -1)
     {
-        gcount = 0;
-        while (gcount < ignore_size)
+        size_t n {};
+        while (n < ignore_size)
         {
             int ch = get();
             if (ch == EOF)
@@ -142,61 +418,83 @@ public:
                 end_of_file = true;
                 break;
             }
-            ++gcount;
+            ++n;
             if (ch == delim) { break; }
         }
+        gcount = n;
 
         return *this;
     }
 
-    InputStream& operator>>(bool& b)
+    expected<char, stream_error> try_get()
     {
-        skip_whitespaces();
-
         int ch = get();
+        if (ch == EOF) { return unexpected {stream_error::end_of_stream}; }
+        return static_cast<char>(ch);
+    }
 
-        if (ch == EOF) { throw; }
+    // 返回读到的字节数, 到了文件末尾时可能少于 size(s)
+    expected<size_t, stream_error> try_read(span<char> s)
+    {
+        read(s);
+        if (gcount == 0 && !s.empty()) { return unexpected {stream_error::end_of_stream}; }
+        return gcount;
+    }
 
-        if (ch == '0')
-        {
-            b = false;
-            return *this;
-        }
-        if (ch == '1')
-        {
-            b = true;
-            return *this;
-        }
+    // 解析下一个以空白分隔的 bool (0, 1, true, false) 或 char; 失败时已经读过的字符不会退回
+    template <typename U>
+        requires same_as<U, bool> || same_as<U, char>
+    expected<U, stream_error> try_parse()
+    {
+        skip_whitespaces();
 
-        if (ch == 't' || ch == 'T')
-        {
-            if (get() == 'r' && get() == 'u' && get() == 'e')
-            {
-                b = true;
-                return *this;
-            }
-        }
+        int ch = get();
+        if (ch == EOF) { return unexpected {stream_error::end_of_stream}; }
 
-        if (ch == 'f' || ch == 'F')
+        if constexpr (same_as<U, char>) { return static_cast<char>(ch); }
+        else
         {
-            if (get() == 'a' && get() == 'l' && get() == 's' && get() == 'e')
-            {
-                b = false;
-                return *this;
-            }
+            if (ch == '0') { return false; }
+            if (ch == '1') { return true; }
+            if ((ch == 't' || ch == 'T') && get() == 'r' && get() == 'u' && get() == 'e') { return true; }
+            if ((ch == 'f' || ch == 'F') && get() == 'a' && get() == 'l' && get() == 's' && get() == 'e') { return false; }
+            return unexpected {stream_error::invalid_input};
         }
+    }
 
-        throw;
+    InputStream& operator>>(bool& b)
+    {
+        b = value_or_throw(try_parse<bool>());
+        return *this;
     }
 
     InputStream& operator>>(char& c)
+    {
+        c = value_or_throw(try_parse<char>());
+        return *this;
+    }
+
+    // 下一个以空白分隔的词复制到 arena 中, 不分配内存
+    expected<string_view, stream_error> try_parse(token_arena& arena)
     {
         skip_whitespaces();
 
-        int ch = get();
-        if (ch == EOF) { throw; }
-        c = static_cast<char>(ch);
+        int ch = static_cast<T*>(this)->get();
+        while (ch != EOF && not_space(static_cast<char>(ch)))
+        {
+            arena.push_back(static_cast<char>(ch));
+            ch = static_cast<T*>(this)->get();
+        }
+
+        string_view token = arena.finish();
+        if (token.empty()) { return unexpected {stream_error::end_of_stream}; }
+        return token;
+    }
 
+    // 和 operator>>(string&) 一样, 到了文件末尾时得到空的词
+    InputStream& operator>>(arena_token t)
+    {
+        t.token = try_parse(t.arena).value_or(string_view {});
         return *this;
     }
 
@@ -236,8 +534,6 @@ public:
 template <typename T>
 class OutputStream
 {
-    static_assert(is_base_of_v<OutputStream, T>);
-
 private:
     auto put() { return static_cast<T*>(this)->put(); }
     void write(span<const char> s) { return static_cast<T*>(this)->write(s); }
@@ -247,8 +543,19 @@ private:
     optional<int> precision;
 
 public:
-    OutputStream& set_int_base(int b) { base = b; }
-    OutputStream& set_float_precision(int p) { precision = p; }
+    // T 在基类实例化时还不完整, 只能在构造时检查
+    OutputStream() { static_assert(is_base_of_v<OutputStream, T>); }
+
+    OutputStream& set_int_base(int b)
+    {
+        base = b;
+        return *this;
+    }
+    OutputStream& set_float_precision(int p)
+    {
+        precision = p;
+        return *this;
+    }
 
     OutputStream& fixed_float() // f
     {
@@ -280,6 +587,13 @@ public:
         return *this;
     }
 
+    OutputStream& operator<<(char c)
+    {
+        write({&c, 1});
+
+        return *this;
+    }
+
 
     template <typename U>
         requires(integral<U>)
@@ -290,7 +604,7 @@ public:
         auto res = to_chars(begin(buffer), end(buffer), num, base);
         if (res.ec != errc()) { throw std::system_error(std::make_error_code(res.ec)); }
 
-        write({buffer, res.ptr - buffer});
+        write({data(buffer), res.ptr});
 
         return *this;
     }
@@ -308,20 +622,80 @@ public:
 
         if (res.ec != errc()) { throw std::system_error(std::make_error_code(res.ec)); }
 
-        write({buffer, res.ptr - data(buffer)});
+        write({data(buffer), res.ptr});
 
         return *this;
     }
 
     OutputStream& operator<<(bool b)
     {
-        if (b) { write("true"); }
-        else { write("false"); }
+        if (b) { write(string_view {"true"}); }
+        else { write(string_view {"false"}); }
 
         return *this;
     }
 };
 
+// 可直接访问内部缓冲区的输入源:
+// window() 返回尚未消费的字节, consume(n) 前进 n 字节,
+// refill() 保留未消费的字节并在其后追加读取, 返回新读到的字节数, 0 表示 EOF
+template <typename T>
+concept buffered_input = requires(T& in, size_t n) {
+    { in.window() } -> convertible_to<span<const byte>>;
+    { in.refill() } -> convertible_to<size_t>;
+    in.consume(n);
+};
+
+// 直接在缓冲区上查找下一个以空白分隔的词, 复制到 arena 中
+template <buffered_input Source>
+expected<string_view, stream_error> read_token(Source& in, token_arena& arena)
+{
+    auto is_space = [](byte b) { return to_integer<unsigned char>(b) <= ' '; };
+
+    while (true)
+    {
+        span<const byte> w = in.window();
+        if (w.empty())
+        {
+            if (in.refill() == 0) { return unexpected {stream_error::end_of_stream}; }
+            continue;
+        }
+
+        size_t i = static_cast<size_t>(ranges::find_if_not(w, is_space) - w.begin());
+        in.consume(i);
+        if (i < size(w)) { break; }
+    }
+
+    while (true)
+    {
+        span<const byte> w = in.window();
+        if (w.empty())
+        {
+            if (in.refill() == 0) { break; }
+            continue;
+        }
+
+        size_t i = static_cast<size_t>(ranges::find_if(w, is_space) - w.begin());
+        arena.append({reinterpret_cast<const char*>(data(w)), i});
+        in.consume(i);
+        if (i < size(w)) { break; }
+    }
+    return arena.finish();
+}
+
+// 保证窗口中至少有 n 个字节, 否则抛出异常
+template <buffered_input Source>
+span<const byte> require_window(Source& in, size_t n)
+{
+    span<const byte> w = in.window();
+    while (size(w) < n)
+    {
+        if (in.refill() == 0) { throw_stream_error(stream_error::end_of_stream); }
+        w = in.window();
+    }
+    return w;
+}
+
 class ISpanStream
 {
 private:
@@ -353,6 +727,14 @@ public:
         return n;
     }
 
+    [[nodiscard]]
+    span<const byte> window() const
+    {
+        return as_bytes(buf);
+    }
+    size_t refill() { return 0; }
+    void consume(size_t n) { buf = buf.subspan(n); }
+
     ISpanStream& setbase(int b)
     {
         base = b;
@@ -379,6 +761,32 @@ public:
         return *this;
     }
 
+    // 解析下一个数; 格式不正确时停在这个词的开头, 超出范围时跳过这个数
+    template <typename T>
+        requires(integral<T> && !same_as<T, bool>) || floating_point<T>
+    expected<T, stream_error> try_parse()
+    {
+        skip_whitespaces();
+        if (buf.empty()) { return unexpected {stream_error::end_of_stream}; }
+
+        T value {};
+        from_chars_result res;
+        if constexpr (integral<T>) { res = from_chars(data(buf), data(buf) + size(buf), value, base); }
+        else { res = from_chars(data(buf), data(buf) + size(buf), value, fmt); }
+
+        if (res.ec == errc::invalid_argument) { return unexpected {stream_error::invalid_input}; }
+        buf = buf.subspan(static_cast<size_t>(res.ptr - data(buf)));
+        if (res.ec == errc::result_out_of_range) { return unexpected {stream_error::out_of_range}; }
+        return value;
+    }
+
+    // 跳过这一行剩下的部分, 包括 delim, 用于丢弃格式错误的记录
+    void skip_line(char delim = '\n')
+    {
+        const void* p = memchr(data(buf), delim, size(buf));
+        buf = p == nullptr ? span<const char> {} : buf.subspan(static_cast<size_t>(static_cast<const char*>(p) - data(buf)) + 1);
+    }
+
     template <typename T>
         requires integral<T>
     ISpanStream& operator<<(T& int_val)
@@ -404,98 +812,481 @@ public:
     }
 };
 
-template <typename InputHandler, size_t buffer_size = 8192>
-class IBUfStream
+// 大页的种类: 请求时是希望得到的, 查询时是实际得到的
+enum class huge_page
 {
-private:
-    InputHandler handler;
-    vector<byte> buffer;
-    span<byte> buffer_span;
-    vector<byte> putback_buffer;
-    bool eof {false};
+    none,        // 普通的 4 KB 页
+    transparent, // 透明大页 (MADV_HUGEPAGE), 由内核在缺页或 khugepaged 扫描时使用 2 MB 的页
+    hugetlb,     // 预留的大页 (MAP_HUGETLB), 需要 /proc/sys/vm/nr_hugepages 不为 0
+};
 
-public:
-    explicit IBUfStream(InputHandler handler_) : handler(handler_), buffer(buffer_size) {}
+namespace huge_page_detail
+{
+    constexpr size_t page_size = size_t {2} << 20; // x86-64 和 4 KB 基础页的 aarch64
 
-    size_t read(span<byte> s)
+    constexpr size_t round_up(size_t n)
     {
-        if (eof) { return 0; }
-
-        size_t bytes_delivered {};
+        return (n + page_size - 1) / page_size * page_size;
+    }
 
-        while (s.size() > 0)
+    // 透明大页被设置为 never 时 madvise 仍然成功, 但是没有效果
+    inline bool transparent_enabled()
+    {
+        static const bool enabled = []
         {
-            if (!putback_buffer.empty())
-            {
-                size_t n = min(s.size(), putback_buffer.size());
-                copy_n(putback_buffer.rbegin(), n, s.begin());
-                putback_buffer.resize(putback_buffer.size() - n);
-                s = s.subspan(n);
-                bytes_delivered += n;
-                if (s.empty()) { return bytes_delivered; }
-            }
-
-            if (buffer_span.empty())
-            {
-                buffer_span = buffer;
-                size_t n = handler.read(buffer_span);
-                if (n == 0)
-                {
-                    eof = true;
-                    return bytes_delivered;
-                }
-            }
-
-            size_t n = min(s.size(), buffer_span.size());
-            copy_n(buffer_span.begin(), n, s.begin());
-
-            buffer_span = buffer_span.subspan(n);
-            bytes_delivered += n;
-        }
-
-        return bytes_delivered;
+            unique_ptr<FILE, int (*)(FILE*)> fp {fopen("/sys/kernel/mm/transparent_hugepage/enabled", "r"), fclose};
+            if (fp == nullptr) { return false; }
+
+            array<char, 128> line {};
+            if (fgets(data(line), static_cast<int>(size(line)), fp.get()) == nullptr) { return false; }
+            return string_view {data(line)}.find("[never]") == string_view::npos;
+        }();
+        return enabled;
     }
+} // namespace huge_page_detail
 
-    void putback(byte c) { putback_buffer.push_back(c); }
-    void putback(span<const byte> s) { copy(s.rbegin(), s.rend(), back_inserter(putback_buffer)); }
-};
+// 对已有的映射 (如 mmap_istream 的文件映射) 请求透明大页, 返回实际得到的种类
+inline huge_page advise_huge_pages(void* p, size_t n)
+{
+    if (!huge_page_detail::transparent_enabled()) { return huge_page::none; }
+    if (madvise(p, n, MADV_HUGEPAGE) == -1) { return huge_page::none; }
+    return huge_page::transparent;
+}
 
-class stdio_istream
+struct huge_region
 {
-    FILE* fp;
-    bool eof {false};
+    void* data;
+    size_t size; // 向上取整到大页的大小, unmap_huge() 时使用
+    huge_page kind;
+};
 
-public:
-    explicit stdio_istream(FILE* fp_) : fp {fp_} {}
+// 按大页对齐的匿名映射; 请求 hugetlb 时先尝试 MAP_HUGETLB, 没有预留的大页时退回透明大页, 再退回普通的页
+inline huge_region map_huge(size_t n, huge_page wanted = huge_page::transparent)
+{
+    size_t length = huge_page_detail::round_up(n);
 
-    [[nodiscard]]
-    FILE* get() const
+    if (wanted == huge_page::hugetlb)
     {
-        return fp;
+        void* p = mmap(nullptr, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (p != MAP_FAILED) { return {p, length, huge_page::hugetlb}; }
     }
 
-    size_t read(span<byte> s)
-    {
-        if (eof) { throw; }
+    // 多映射一个大页, 再裁掉首尾, 使起始地址按 2 MB 对齐, 否则不能使用透明大页
+    size_t padded = length + huge_page_detail::page_size;
+    void* p = mmap(nullptr, padded, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED) { throw bad_alloc {}; }
 
-        size_t bytes_read = fread(s.data(), 1, s.size(), fp);
+    auto base = reinterpret_cast<uintptr_t>(p);
+    uintptr_t aligned = (base + huge_page_detail::page_size - 1) / huge_page_detail::page_size * huge_page_detail::page_size;
+    if (aligned > base) { munmap(p, aligned - base); }
+    if (size_t tail = base + padded - (aligned + length); tail > 0) { munmap(reinterpret_cast<void*>(aligned + length), tail); }
 
-        if (bytes_read != s.size() && ferror(fp) != 0) { throw runtime_error("Error reading from file."); }
+    void* q = reinterpret_cast<void*>(aligned);
+    huge_page kind = wanted == huge_page::none ? huge_page::none : advise_huge_pages(q, length);
+    return {q, length, kind};
+}
 
-        return bytes_read;
+inline void unmap_huge(void* p, size_t length)
+{
+    munmap(p, length);
+}
+
+// 大块分配使用 map_huge(), 用于 IBUfStream 和 buffered_ostream 的缓冲区; 小于一个大页的分配使用 operator new
+// kind() 是最近一次分配实际得到的种类, 副本之间共享
+template <typename T>
+class huge_page_allocator
+{
+    template <typename U>
+    friend class huge_page_allocator;
+
+    huge_page wanted;
+    shared_ptr<atomic<huge_page>> obtained {make_shared<atomic<huge_page>>(huge_page::none)};
+
+public:
+    using value_type = T;
+
+    explicit huge_page_allocator(huge_page wanted_ = huge_page::transparent) : wanted {wanted_} {}
+
+    template <typename U>
+    huge_page_allocator(const huge_page_allocator<U>& other) : wanted {other.wanted}, obtained {other.obtained}
+    {}
+
+    T* allocate(size_t n)
+    {
+        size_t bytes = n * sizeof(T);
+        if (bytes < huge_page_detail::page_size)
+        {
+            obtained->store(huge_page::none);
+            return allocator<T> {}.allocate(n);
+        }
+
+        huge_region r = map_huge(bytes, wanted);
+        obtained->store(r.kind);
+        return static_cast<T*>(r.data);
+    }
+
+    void deallocate(T* p, size_t n)
+    {
+        size_t bytes = n * sizeof(T);
+        if (bytes < huge_page_detail::page_size) { allocator<T> {}.deallocate(p, n); }
+        else { unmap_huge(p, huge_page_detail::round_up(bytes)); }
+    }
+
+    [[nodiscard]]
+    huge_page kind() const
+    {
+        return obtained->load();
+    }
+
+    // 释放方式只取决于大小, 任何两个实例分配的内存都可以互相释放
+    friend bool operator==(const huge_page_allocator&, const huge_page_allocator&) { return true; }
+};
+
+// Allocator 为 huge_page_allocator<byte> 时缓冲区使用大页
+template <typename InputHandler, size_t buffer_size = 8192, typename Allocator = allocator<byte>>
+class IBUfStream
+{
+private:
+    InputHandler handler;
+    vector<byte, Allocator> buffer;
+    span<byte> buffer_span;
+    vector<byte> putback_buffer;
+    bool eof {false};
+
+    // 把 putback 的字节移到缓冲区的未消费部分之前, 使 window() 能看到它们
+    void merge_putback()
+    {
+        if (putback_buffer.empty()) { return; }
+
+        vector<byte> merged(putback_buffer.rbegin(), putback_buffer.rend());
+        merged.insert(merged.end(), buffer_span.begin(), buffer_span.end());
+        if (size(merged) > size(buffer)) { buffer.resize(size(merged)); }
+
+        copy(merged.begin(), merged.end(), buffer.begin());
+        buffer_span = span<byte>(buffer).first(size(merged));
+        putback_buffer.clear();
+    }
+
+public:
+    explicit IBUfStream(InputHandler handler_, Allocator alloc = Allocator {}) : handler(std::move(handler_)), buffer(buffer_size, alloc) {}
+
+    // 缓冲区实际使用的页
+    [[nodiscard]]
+    huge_page page_kind() const
+    {
+        if constexpr (requires { buffer.get_allocator().kind(); }) { return buffer.get_allocator().kind(); }
+        else { return huge_page::none; }
+    }
+
+    span<const byte> window()
+    {
+        merge_putback();
+        if (buffer_span.empty()) { refill(); }
+        return buffer_span;
+    }
+
+    void consume(size_t n) { buffer_span = buffer_span.subspan(n); }
+
+    // 未消费的字节移到缓冲区开头, 缓冲区已满时扩容一倍
+    size_t refill()
+    {
+        merge_putback();
+        if (eof) { return 0; }
+
+        size_t kept = size(buffer_span);
+        if (kept == size(buffer)) { buffer.resize(size(buffer) * 2); }
+        else if (kept > 0) { copy(buffer_span.begin(), buffer_span.end(), buffer.begin()); }
+
+        size_t n = handler.read(span<byte>(buffer).subspan(kept));
+        if (n == 0) { eof = true; }
+
+        buffer_span = span<byte>(buffer).first(kept + n);
+        return n;
+    }
+
+    size_t read(span<byte> s)
+    {
+        size_t bytes_delivered {};
+
+        while (s.size() > 0)
+        {
+            if (!putback_buffer.empty())
+            {
+                size_t n = min(s.size(), putback_buffer.size());
+                copy_n(putback_buffer.rbegin(), n, s.begin());
+                putback_buffer.resize(putback_buffer.size() - n);
+                s = s.subspan(n);
+                bytes_delivered += n;
+                if (s.empty()) { return bytes_delivered; }
+            }
+
+            if (buffer_span.empty())
+            {
+                if (eof) { return bytes_delivered; }
+
+                size_t n = handler.read(buffer);
+                if (n == 0)
+                {
+                    eof = true;
+                    return bytes_delivered;
+                }
+                buffer_span = span<byte>(buffer).first(n);
+            }
+
+            size_t n = min(s.size(), buffer_span.size());
+            copy_n(buffer_span.begin(), n, s.begin());
+
+            buffer_span = buffer_span.subspan(n);
+            s = s.subspan(n);
+            bytes_delivered += n;
+        }
+
+        return bytes_delivered;
+    }
+
+    void putback(byte c) { putback_buffer.push_back(c); }
+    void putback(span<const byte> s) { copy(s.rbegin(), s.rend(), back_inserter(putback_buffer)); }
+};
+
+class stdio_istream
+{
+    FILE* fp;
+    bool eof {false};
+
+public:
+    explicit stdio_istream(FILE* fp_) : fp {fp_} {}
+
+    [[nodiscard]]
+    FILE* get() const
+    {
+        return fp;
+    }
+
+    size_t read(span<byte> s)
+    {
+        if (eof) { throw; }
+
+        size_t bytes_read = fread(s.data(), 1, s.size(), fp);
+
+        if (bytes_read != s.size() && ferror(fp) != 0) { throw runtime_error("Error reading from file."); }
+
+        return bytes_read;
     }
 };
 
 inline stdio_istream stdin_stream {stdin};
 
+// resize() 时不做值初始化的分配器, 用于马上会被覆盖的缓冲区
+template <typename T>
+struct default_init_allocator : allocator<T>
+{
+    template <typename U>
+    struct rebind
+    {
+        using other = default_init_allocator<U>;
+    };
+
+    using allocator<T>::allocator;
+
+    template <typename U>
+    void construct(U* p) noexcept(is_nothrow_default_constructible_v<U>)
+    {
+        ::new (static_cast<void*>(p)) U;
+    }
+
+    template <typename U, typename... Args>
+    void construct(U* p, Args&&... args)
+    {
+        ::new (static_cast<void*>(p)) U(std::forward<Args>(args)...);
+    }
+};
+
+enum class cache_mode
+{
+    normal,    // 交给内核
+    streaming, // 一次性的顺序扫描: 预读前方, 丢弃已经读过或写过的页, 页缓存的占用有上限, 不挤掉其它进程的热数据
+};
+
+struct cache_policy
+{
+    cache_mode mode {cache_mode::normal};
+    size_t window {size_t {8} << 20}; // streaming 模式下预读, 写回和丢弃的粒度
+};
+
+// streaming 模式下按读写的位置调用 posix_fadvise
+// 读: 打开时 SEQUENTIAL (内核加大预读), 位置前方两个 window 请求 WILLNEED, 后方每满一个 window 就 DONTNEED
+// 写: 脏页写回之前不能丢弃, 每写满一个 window 用 sync_file_range 启动它的写回, 等上一个 window 写完后再 DONTNEED
+// 拷贝共享的 fd_istream, fd_ostream 共用一个, 所以加锁
+class page_cache_advisor
+{
+    int fd;
+    size_t window;
+    uint64_t position;
+    uint64_t dropped;  // 之前的页已经丢弃
+    uint64_t ahead;    // 之前的页已经请求预读
+    uint64_t flushing; // 之前的页已经启动写回
+    mutex m;
+
+    void advise(uint64_t first, uint64_t last, int advice)
+    {
+        // 只是建议, 失败时不影响读写
+        if (last > first) { posix_fadvise(fd, static_cast<off_t>(first), static_cast<off_t>(last - first), advice); }
+    }
+
+public:
+    page_cache_advisor(int fd_, size_t window_, uint64_t position_ = 0) : fd {fd_}, window {max<size_t>(window_, 64 * 1024)}
+    {
+        reset(position_);
+        posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    }
+
+    page_cache_advisor(const page_cache_advisor&) = delete;
+    page_cache_advisor& operator=(const page_cache_advisor&) = delete;
+
+    // 不再需要读过的部分; 没有写回的脏页 DONTNEED 时会被跳过
+    ~page_cache_advisor() { advise(dropped, position, POSIX_FADV_DONTNEED); }
+
+    // seek 之后调用
+    void reset(uint64_t position_)
+    {
+        lock_guard lock {m};
+        position = ahead = flushing = position_;
+        dropped = position_ - position_ % 4096;
+    }
+
+    // 读走了 n 字节
+    void consumed(size_t n)
+    {
+        lock_guard lock {m};
+        position += n;
+
+        if (position + window > ahead)
+        {
+            uint64_t target = position + 2 * window;
+            advise(max(ahead, position), target, POSIX_FADV_WILLNEED);
+            ahead = target;
+        }
+
+        // 只丢弃完整的页, 当前位置所在的页之后还会被读到
+        if (position >= dropped + window)
+        {
+            uint64_t last = position - position % 4096;
+            advise(dropped, last, POSIX_FADV_DONTNEED);
+            dropped = last;
+        }
+    }
+
+    // 写入了 n 字节; sync_file_range 失败时返回 false, errno 是它的错误
+    bool wrote(size_t n)
+    {
+        lock_guard lock {m};
+        position += n;
+        if (position < flushing + window) { return true; }
+
+#if defined(__linux__)
+        if (sync_file_range(fd, static_cast<off_t>(flushing), static_cast<off_t>(position - flushing), SYNC_FILE_RANGE_WRITE) == -1) { return false; }
+        if (flushing > dropped)
+        {
+            constexpr unsigned wait = SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER;
+            if (sync_file_range(fd, static_cast<off_t>(dropped), static_cast<off_t>(flushing - dropped), wait) == -1) { return false; }
+            advise(dropped, flushing, POSIX_FADV_DONTNEED);
+            dropped = flushing;
+        }
+#else
+        if (fdatasync(fd) == -1) { return false; }
+        advise(dropped, position, POSIX_FADV_DONTNEED);
+        dropped = position;
+#endif
+        flushing = position;
+        return true;
+    }
+};
+
 class stdio_file_istream
 {
     unique_ptr<FILE, int (*)(FILE*)> fp;
+    shared_ptr<page_cache_advisor> cache;
+
+    template <typename T>
+    static void grow(T& container, size_t n)
+    {
+        auto keep = [](auto*, size_t k) { return k; };
+        if constexpr (requires { container.resize_and_overwrite(n, keep); }) { container.resize_and_overwrite(n, keep); }
+        else
+        {
+            container.reserve(n); // resize() 超过容量时会按倍数扩容
+            container.resize(n);
+        }
+    }
+
+    // 只有到达 EOF 时才会少读
+    static size_t pread_full(int fd, char* p, size_t n, off_t offset)
+    {
+        size_t done {};
+        while (done < n)
+        {
+            auto ret = pread(fd, p + done, n - done, offset + static_cast<off_t>(done));
+            if (ret == -1)
+            {
+                if (errno == EINTR) { continue; }
+                throw system_error {errno, system_category()};
+            }
+            if (ret == 0) { break; }
+            done += static_cast<size_t>(ret);
+        }
+        return done;
+    }
+
+    // 返回从 offset 开始连续读到的字节数; 某一段没有读满说明文件变小了, 之后各段的数据都丢弃
+    static size_t pread_parallel(int fd, char* p, size_t n, off_t offset)
+    {
+        constexpr size_t min_slice = size_t {64} << 20;
+        constexpr size_t max_threads = 8;
+
+        size_t threads = clamp<size_t>(n / min_slice, 1, clamp<size_t>(thread::hardware_concurrency(), 1, max_threads));
+        if (threads == 1) { return pread_full(fd, p, n, offset); }
+
+        size_t slice = n / threads;
+        vector<size_t> got(threads);
+        vector<exception_ptr> errors(threads);
+        {
+            vector<jthread> workers;
+            for (size_t t = 0; t < threads; ++t)
+            {
+                workers.emplace_back(
+                    [&, t]
+                    {
+                        size_t first = t * slice;
+                        size_t length = t + 1 == threads ? n - first : slice;
+                        try
+                        {
+                            got[t] = pread_full(fd, p + first, length, offset + static_cast<off_t>(first));
+                        }
+                        catch (...)
+                        {
+                            errors[t] = current_exception();
+                        }
+                    });
+            }
+        }
+
+        size_t total {};
+        for (size_t t = 0; t < threads; ++t)
+        {
+            if (errors[t] != nullptr) { rethrow_exception(errors[t]); }
+
+            total += got[t];
+            size_t length = t + 1 == threads ? n - t * slice : slice;
+            if (got[t] < length) { break; }
+        }
+        return total;
+    }
 
 public:
-    explicit stdio_file_istream(string_view path) : fp {fopen(path.data(), "r"), fclose}
+    explicit stdio_file_istream(string_view path, cache_policy policy = {}) : fp {fopen(path.data(), "r"), fclose}
     {
         if (fp == nullptr) { throw system_error {errno, system_category()}; }
+        if (policy.mode == cache_mode::streaming) { cache = make_shared<page_cache_advisor>(fileno(fp.get()), policy.window); }
     }
 
     [[nodiscard]]
@@ -509,6 +1300,7 @@ public:
         size_t bytes_read = fread(s.data(), 1, s.size(), fp.get());
 
         if (bytes_read != s.size() && ferror(fp.get()) != 0) { throw runtime_error("Error reading from file."); }
+        if (cache != nullptr) { cache->consumed(bytes_read); }
 
         return bytes_read;
     }
@@ -516,53 +1308,68 @@ public:
     [[nodiscard]]
     size_t size() const
     {
-        // 保存当前位置
-        long current_pos = ftell(fp.get());
-        if (current_pos == -1) { throw system_error {errno, system_category()}; }
-
-        // 移动到文件末尾
-        if (fseek(fp.get(), 0, SEEK_END) == -1) { throw system_error {errno, system_category()}; }
-
-        // 获取文件大小
-        long file_size = ftell(fp.get());
-        if (file_size == -1) { throw system_error {errno, system_category()}; }
-
-        // 恢复原始位置
-        if (fseek(fp.get(), current_pos, SEEK_SET) == -1) { throw system_error {errno, system_category()}; }
-
-        return static_cast<size_t>(file_size);
+        struct stat info;
+        if (fstat(fileno(fp.get()), &info) == -1) { throw system_error {errno, system_category()}; }
+        return static_cast<size_t>(info.st_size);
     }
 
-    // read_all() 函数实现
+    // 从当前位置读到文件末尾
+    // 绕过 FILE 的缓冲区, 直接 pread 到容器中; 大文件分成几段由多个线程同时读
+    // string 和使用 default_init_allocator 的 vector 扩容时不会先填充 0
+    // 读的过程中文件变小或变大时, 容器的大小是实际读到的数据
     template <typename T>
     void read_all(T& container)
     {
-        // 获取文件大小
+        using value_type = typename T::value_type;
+        int fd = fileno(fp.get());
+
+        long pos = ftell(fp.get()); // 已经考虑了 FILE 缓冲区中还没有被读走的数据
+        if (pos == -1) { throw system_error {errno, system_category()}; }
+
         size_t file_size = size();
+        size_t expected = file_size > static_cast<size_t>(pos) ? file_size - static_cast<size_t>(pos) : 0;
 
-        // 调整容器大小
-        using value_type = typename T::value_type;
-        container.resize(file_size / sizeof(value_type));
+        grow(container, (expected + sizeof(value_type) - 1) / sizeof(value_type));
+        size_t total = pread_parallel(fd, reinterpret_cast<char*>(container.data()), expected, pos);
 
-        if (!container.empty())
+        // 文件可能变大了: 先读一小块到栈上, 确实还有数据时才扩容, 每次只扩大一个固定的步长
+        if (total == expected)
         {
-            // 读取所有数据
-            size_t bytes_read = fread(container.data(), 1, file_size, fp.get());
-
-            // 检查是否读取成功
-            if (bytes_read != file_size)
+            constexpr size_t growth_step = size_t {1} << 20;
+            array<char, 4096> probe;
+            while (true)
             {
-                if (ferror(fp.get()) != 0) { throw runtime_error("Error reading from file."); }
-                // 如果读取的字节数不足，调整容器大小
-                container.resize(bytes_read / sizeof(value_type));
+                size_t n = pread_full(fd, data(probe), probe.size(), pos + static_cast<off_t>(total));
+                if (n == 0) { break; }
+
+                size_t wanted = total + n + (n < probe.size() ? 0 : growth_step);
+                grow(container, (wanted + sizeof(value_type) - 1) / sizeof(value_type));
+                auto* p = reinterpret_cast<char*>(container.data());
+                memcpy(p + total, data(probe), n);
+                total += n;
+                if (n < probe.size()) { break; }
+
+                size_t capacity = container.size() * sizeof(value_type);
+                total += pread_full(fd, p + total, capacity - total, pos + static_cast<off_t>(total));
+                if (total < capacity) { break; }
             }
         }
+
+        container.resize(total / sizeof(value_type));
+
+        if (fseek(fp.get(), pos + static_cast<long>(total), SEEK_SET) == -1) { throw system_error {errno, system_category()}; }
+        if (cache != nullptr)
+        {
+            cache->reset(static_cast<uint64_t>(pos));
+            cache->consumed(total);
+        }
     }
 
     int seekg(long offset, int whence)
     {
         int ret = fseek(fp.get(), offset, whence);
         if (ret == -1) { throw system_error {errno, system_category()}; }
+        if (cache != nullptr) { cache->reset(static_cast<uint64_t>(ftell(fp.get()))); }
         return ret;
     }
 
@@ -579,7 +1386,7 @@ class stdio_ostream
     FILE* fp;
 
 public:
-    explicit stdio_istream(FILE* fp_) : fp {fp_} {}
+    explicit stdio_ostream(FILE* fp_) : fp {fp_} {}
     FILE* get() { return fp; }
 
     template <typename T>
@@ -599,7 +1406,7 @@ class stdio_file_ostream
     unique_ptr<FILE, int (*)(FILE*)> fp;
 
 public:
-    explicit stdio_istream(string_view path) : fp {fopen(data(path), "w"), fclose}
+    explicit stdio_file_ostream(string_view path) : fp {fopen(data(path), "w"), fclose}
     {
         if (fp == nullptr) { throw std::system_error(errno, std::system_category()); }
     }
@@ -608,22 +1415,184 @@ public:
     template <typename T>
     void write(span<const T> s)
     {
-        if (fwrite(data(s), sizeof(T), size(s), fp) != size(s)) { throw system_error {errno, system_category()}; }
+        if (fwrite(data(s), sizeof(T), size(s), fp.get()) != size(s)) { throw system_error {errno, system_category()}; }
     }
 
-    void flush() { fflush(fp); }
+    void flush() { fflush(fp.get()); }
+};
+
+// 固定大小的块的空闲列表, 多个 segmented_buffer 共享, 线程安全
+class block_pool
+{
+    size_t block_size_;
+    size_t max_free;
+    mutex m;
+    vector<unique_ptr<char[]>> free_blocks;
+
+public:
+    explicit block_pool(size_t block_size = 64 * 1024, size_t max_free_ = 256) : block_size_ {block_size}, max_free {max_free_} {}
+
+    static block_pool& shared()
+    {
+        static block_pool pool;
+        return pool;
+    }
+
+    [[nodiscard]]
+    size_t block_size() const
+    {
+        return block_size_;
+    }
+
+    unique_ptr<char[]> acquire()
+    {
+        {
+            lock_guard lock {m};
+            if (!free_blocks.empty())
+            {
+                auto block = std::move(free_blocks.back());
+                free_blocks.pop_back();
+                return block;
+            }
+        }
+        return make_unique_for_overwrite<char[]>(block_size_);
+    }
+
+    // 空闲的块超过 max_free 时直接释放
+    void release(unique_ptr<char[]> block)
+    {
+        lock_guard lock {m};
+        if (size(free_blocks) < max_free) { free_blocks.push_back(std::move(block)); }
+    }
+};
+
+// 由固定大小的块组成的输出缓冲区, 增长时不移动已有的数据, 峰值内存只比内容多不到一个块
+// 内容以多个 span 的形式交给 fd_ostream 的 writev, 或者不复制地接到另一个 segmented_buffer 后面
+class segmented_buffer
+{
+    struct block
+    {
+        unique_ptr<char[]> data;
+        size_t size;
+    };
+
+    block_pool* pool;
+    vector<block> blocks;
+    size_t total {};
+
+public:
+    explicit segmented_buffer(block_pool& pool_ = block_pool::shared()) : pool {&pool_} {}
+
+    segmented_buffer(segmented_buffer&& other) noexcept : pool {other.pool}, blocks {std::move(other.blocks)}, total {exchange(other.total, 0)} {}
+    segmented_buffer& operator=(segmented_buffer&& other) noexcept
+    {
+        if (this != &other)
+        {
+            clear();
+            pool = other.pool;
+            blocks = std::move(other.blocks);
+            total = exchange(other.total, 0);
+        }
+        return *this;
+    }
+
+    ~segmented_buffer() { clear(); }
+
+    [[nodiscard]]
+    size_t size() const
+    {
+        return total;
+    }
+
+    // 最后一块的剩余空间, 已满时先追加一块; 写入后用 commit() 确认
+    span<char> prepare()
+    {
+        if (blocks.empty() || blocks.back().size == pool->block_size()) { blocks.push_back({pool->acquire(), 0}); }
+
+        block& last = blocks.back();
+        return {last.data.get() + last.size, pool->block_size() - last.size};
+    }
+
+    void commit(size_t n)
+    {
+        blocks.back().size += n;
+        total += n;
+    }
+
+    void write(span<const char> s)
+    {
+        while (!s.empty())
+        {
+            span<char> free = prepare();
+            size_t n = min(free.size(), s.size());
+            copy_n(s.begin(), n, free.begin());
+            commit(n);
+            s = s.subspan(n);
+        }
+    }
+
+    // 取走 other 的所有块, 不复制数据; 两个缓冲区必须使用同一个 block_pool
+    void append(segmented_buffer&& other)
+    {
+        if (other.pool != pool) { throw runtime_error("Blocks from a different block_pool."); }
+
+        move(other.blocks.begin(), other.blocks.end(), back_inserter(blocks));
+        total += exchange(other.total, 0);
+        other.blocks.clear();
+    }
+
+    [[nodiscard]]
+    vector<span<const char>> segments() const
+    {
+        vector<span<const char>> parts;
+        parts.reserve(blocks.size());
+        for (const block& b : blocks)
+        {
+            if (b.size > 0) { parts.emplace_back(b.data.get(), b.size); }
+        }
+        return parts;
+    }
+
+    // 有 write(span<const span<const char>>) 的输出 (如 fd_ostream) 一次写出所有的块
+    template <typename T>
+    void write_to(T& out) const
+    {
+        vector<span<const char>> parts = segments();
+        if constexpr (requires { out.write(span<const span<const char>> {parts}); }) { out.write(span<const span<const char>> {parts}); }
+        else
+        {
+            for (span<const char> part : parts) { out.write(part); }
+        }
+    }
+
+    // 块还给 block_pool
+    void clear()
+    {
+        for (block& b : blocks) { pool->release(std::move(b.data)); }
+        blocks.clear();
+        total = 0;
+    }
 };
 
+// T 是连续的容器 (string, vector<char>) 或 segmented_buffer
 template <typename T>
 class buf_ostream
 {
     T buffer;
 
 public:
-    span<const char> view() { return buffer; }
+    span<const char> view()
+        requires ranges::contiguous_range<T>
+    {
+        return buffer;
+    }
     T& get() { return buffer; }
 
-    void write(span<const char> s) { copy(begin(s), end(s), back_inserter(buffer)); }
+    void write(span<const char> s)
+    {
+        if constexpr (requires { buffer.write(s); }) { buffer.write(s); }
+        else { copy(begin(s), end(s), back_inserter(buffer)); }
+    }
 };
 
 class span_ostream
@@ -634,27 +1603,187 @@ public:
     explicit span_ostream(span<char> s) : free {s} {}
     span<char> unused() { return free; }
 
-    void write(span<const char> str)
+    expected<void, stream_error> try_write(span<const char> str)
     {
-        if (size(free) < size(str)) { throw; }
+        if (size(free) < size(str)) { return unexpected {stream_error::no_space}; }
 
         copy(begin(str), end(str), begin(free));
         free = free.subspan(size(str));
+        return {};
+    }
+
+    void write(span<const char> str)
+    {
+        if (auto r = try_write(str); !r) { throw_stream_error(r.error()); }
     }
 };
 
-template <typename T>
-class buffered_ostream : public ostream
+struct flush_policy
 {
-    vector<char> buffer;
-    shared_ptr<void> flush_guard {nullptr, [](void* p) { flush(); }};
+    size_t threshold {};                 // 缓冲的字节数达到 threshold 时刷新, 0 表示缓冲区满时才刷新
+    bool line_buffered {false};          // 写入的数据包含 '\n' 时刷新
+    chrono::microseconds max_latency {}; // 最早写入的字节最多在缓冲区中等待这么久, 0 表示不限制
+};
 
+// 为所有设置了 max_latency 的流服务的一个后台线程
+// 流的缓冲区由空变为非空时登记一个截止时间, 到期时由这个线程调用 on_deadline() 刷新
+class flush_timer
+{
 public:
-    explicit buffered_ostream(size_t size = 8192) : { buffer.reserve(size); }
+    using clock = chrono::steady_clock;
+
+    class client
+    {
+    public:
+        virtual void on_deadline() = 0;
+
+    protected:
+        ~client() = default;
+    };
+
+private:
+    struct entry
+    {
+        clock::time_point deadline;
+        client* target;
+
+        bool operator>(const entry& other) const { return deadline > other.deadline; }
+    };
+
+    mutex m;
+    condition_variable cv;
+    vector<entry> heap; // 最小堆
+    client* running {nullptr};
+    bool stopping {false};
+
+    jthread worker;
+
+    void run()
+    {
+        unique_lock lock {m};
+        while (!stopping)
+        {
+            if (heap.empty())
+            {
+                cv.wait(lock);
+                continue;
+            }
+
+            if (clock::now() < heap.front().deadline)
+            {
+                cv.wait_until(lock, heap.front().deadline);
+                continue;
+            }
+
+            ranges::pop_heap(heap, greater {});
+            running = heap.back().target;
+            heap.pop_back();
+
+            lock.unlock();
+            running->on_deadline();
+            lock.lock();
+
+            running = nullptr;
+            cv.notify_all();
+        }
+    }
+
+public:
+    flush_timer() : worker {[this] { run(); }} {}
+
+    ~flush_timer()
+    {
+        {
+            lock_guard lock {m};
+            stopping = true;
+        }
+        cv.notify_all();
+    }
+
+    static flush_timer& shared()
+    {
+        static flush_timer timer;
+        return timer;
+    }
+
+    void schedule(client* target, clock::time_point deadline)
+    {
+        lock_guard lock {m};
+        heap.push_back({deadline, target});
+        ranges::push_heap(heap, greater {});
+        if (heap.front().target == target) { cv.notify_all(); }
+    }
+
+    // 返回之后不会再调用 target->on_deadline()
+    void cancel(client* target)
+    {
+        unique_lock lock {m};
+        if (erase_if(heap, [=](const entry& e) { return e.target == target; }) > 0) { ranges::make_heap(heap, greater {}); }
+        cv.wait(lock, [=, this] { return running != target; });
+    }
+};
+
+// 缓冲输出到 T, T 是任何提供 write(span<const char>) 的输出
+// 何时把缓冲区交给 T 由 flush_policy 决定; 设置了 max_latency 时写入加锁, 因为后台线程也会刷新
+// Allocator 为 huge_page_allocator<char> 时缓冲区使用大页
+template <typename T, typename Allocator = allocator<char>>
+class buffered_ostream : flush_timer::client
+{
+    T sink;
+    flush_policy policy;
+    vector<char, Allocator> buffer;
+    mutex m;
+    flush_timer::clock::time_point deadline;
+
+    void flush_buffer()
+    {
+        if (buffer.empty()) { return; }
+        sink.write(span<const char> {buffer});
+        buffer.clear();
+    }
+
+    void on_deadline() override
+    {
+        lock_guard lock {m};
+        if (flush_timer::clock::now() >= deadline) { flush_buffer(); }
+    }
+
+    [[nodiscard]]
+    unique_lock<mutex> lock()
+    {
+        return policy.max_latency.count() > 0 ? unique_lock {m} : unique_lock<mutex> {};
+    }
+
+public:
+    explicit buffered_ostream(T sink_, size_t size = 8192, flush_policy policy_ = {}, Allocator alloc = Allocator {})
+        : sink {std::move(sink_)}, policy {policy_}, buffer(alloc)
+    {
+        buffer.reserve(size);
+    }
+
+    buffered_ostream(const buffered_ostream&) = delete;
+    buffered_ostream& operator=(const buffered_ostream&) = delete;
+
+    ~buffered_ostream()
+    {
+        if (policy.max_latency.count() > 0) { flush_timer::shared().cancel(this); }
+        discard_errors([this] { flush_buffer(); });
+    }
+
+    T& get() { return sink; }
+
+    // 缓冲区实际使用的页
+    [[nodiscard]]
+    huge_page page_kind() const
+    {
+        if constexpr (requires { buffer.get_allocator().kind(); }) { return buffer.get_allocator().kind(); }
+        else { return huge_page::none; }
+    }
 
     void write(span<const char> bytes)
     {
-        if (size(bytes) > buffer.capacity()) { static_cast<T*>(this)->write(bytes); }
+        auto guard = lock();
+        bool was_empty = buffer.empty(); // 缓冲区由空变为非空时登记截止时间
 
         size_t available = buffer.capacity() - size(buffer);
         if (size(bytes) > available)
@@ -662,46 +1791,339 @@ public:
             auto first = bytes.first(available);
             copy(begin(first), end(first), back_inserter(buffer));
 
-            static_cast<T*>(this)->write(buffer);
+            flush_buffer();
+            was_empty = true;
 
             bytes = bytes.subspan(available);
+            if (size(bytes) >= buffer.capacity())
+            {
+                sink.write(bytes);
+                return;
+            }
         }
 
         copy(begin(bytes), end(bytes), back_inserter(buffer));
+
+        if (policy.threshold > 0 && size(buffer) >= policy.threshold) { flush_buffer(); }
+        else if (policy.line_buffered && ranges::find(bytes, '\n') != end(bytes)) { flush_buffer(); }
+        else if (policy.max_latency.count() > 0 && was_empty && !buffer.empty())
+        {
+            deadline = flush_timer::clock::now() + policy.max_latency;
+            flush_timer::shared().schedule(this, deadline);
+        }
+    }
+
+    void flush()
+    {
+        auto guard = lock();
+        flush_buffer();
+    }
+};
+
+
+enum class durability
+{
+    none,         // 不主动同步, 由内核决定何时写回
+    on_flush,     // 每次 flush() 调用 fsync
+    periodic,     // 后台线程每写入 bytes 字节或每隔 interval 调用一次 fdatasync
+    write_behind, // 每写入 bytes 字节用 sync_file_range 启动这一段的写回, 并等待上一段写完, 不保证元数据落盘
+    group_commit, // commit() 返回的 future 在下一次后台 fdatasync 完成时就绪, 同时等待的写入者共享一次同步
+};
+
+struct sync_policy
+{
+    durability mode {durability::on_flush};
+    size_t bytes {size_t {8} << 20};
+    chrono::milliseconds interval {};
+};
+
+// fd_ostream 在 periodic, write_behind, group_commit 模式下的共享状态
+class fd_syncer
+{
+    int fd;
+    sync_policy policy;
+    shared_ptr<void> close_guard; // 保证后台线程结束之前 fd 不会被关闭
+
+    atomic<uint64_t> written {};
+    atomic<uint64_t> synced {};
+    uint64_t range_start {};
+    uint64_t file_offset {};
+    uint64_t previous_start {}; // 上一段已经启动写回的范围, 下一段启动时等待它写完
+    uint64_t previous_length {};
+
+    mutex m;
+    condition_variable cv;
+    shared_ptr<promise<void>> batch;
+    shared_future<void> batch_done;
+    int error {}; // 后台 fdatasync 失败时的 errno
+    atomic<bool> failed {false};
+    bool stopping {false};
+
+    jthread worker;
+
+    bool dirty() const { return written.load() != synced.load(); }
+
+    void run()
+    {
+        unique_lock lock {m};
+        while (true)
+        {
+            auto ready = [this] { return stopping || batch != nullptr || (!failed && policy.bytes > 0 && written.load() - synced.load() >= policy.bytes); };
+            if (policy.interval.count() > 0) { cv.wait_for(lock, policy.interval, ready); }
+            else { cv.wait(lock, ready); }
+
+            if (!dirty() && batch == nullptr)
+            {
+                if (stopping) { return; }
+                continue;
+            }
+
+            // 之后到达的 commit() 等待下一次同步
+            auto current = exchange(batch, nullptr);
+            uint64_t target = written.load();
+
+            lock.unlock();
+            int err = fdatasync(fd) == -1 ? errno : 0;
+            lock.lock();
+
+            if (err == 0) { synced = target; }
+            else if (current == nullptr)
+            {
+                error = err;
+                failed = true;
+            }
+
+            if (current != nullptr)
+            {
+                if (err == 0) { current->set_value(); }
+                else { current->set_exception(make_exception_ptr(system_error {err, system_category()})); }
+            }
+
+            if (stopping && batch == nullptr) { return; }
+        }
+    }
+
+public:
+    fd_syncer(int fd_, sync_policy policy_, shared_ptr<void> close_guard_) : fd {fd_}, policy {policy_}, close_guard {std::move(close_guard_)}
+    {
+        // write_behind 没有 bytes 时每次写入都要同步; periodic 两者都没有时从不同步
+        if (policy.mode == durability::write_behind && policy.bytes == 0) { throw runtime_error("Invalid sync policy."); }
+        if (policy.mode == durability::periodic && policy.bytes == 0 && policy.interval.count() == 0) { throw runtime_error("Invalid sync policy."); }
+
+        if (policy.mode == durability::write_behind)
+        {
+            off_t offset = lseek(fd, 0, (fcntl(fd, F_GETFL) & O_APPEND) != 0 ? SEEK_END : SEEK_CUR);
+            if (offset == -1) { throw system_error {errno, system_category()}; }
+            range_start = file_offset = static_cast<uint64_t>(offset);
+        }
+
+        if (policy.mode == durability::periodic || policy.mode == durability::group_commit)
+        {
+            worker = jthread {[this] { run(); }};
+        }
+    }
+
+    ~fd_syncer()
+    {
+        {
+            lock_guard lock {m};
+            stopping = true;
+        }
+        cv.notify_all();
+    }
+
+    // 写入了 n 字节; 失败时返回 false, errno 是 sync_file_range 或之前的后台 fdatasync 的错误
+    bool wrote(size_t n)
+    {
+        uint64_t total = written.fetch_add(n) + n;
+
+        if (policy.mode == durability::periodic || policy.mode == durability::group_commit)
+        {
+            if (failed)
+            {
+                lock_guard lock {m};
+                failed = false;
+                errno = exchange(error, 0);
+                return false;
+            }
+
+            // 加锁后再通知, 避免后台线程检查条件之后, 开始等待之前错过通知
+            if (policy.bytes > 0 && total - synced.load() >= policy.bytes)
+            {
+                {
+                    lock_guard lock {m};
+                }
+                cv.notify_one();
+            }
+        }
+
+#if defined(__linux__)
+        if (policy.mode == durability::write_behind)
+        {
+            lock_guard lock {m};
+            file_offset += n;
+            if (file_offset - range_start < policy.bytes) { return true; }
+
+            // 启动这一段的写回; 等待上一段写完, 使脏页的数量有上限
+            uint64_t length = file_offset - range_start;
+            if (sync_file_range(fd, static_cast<off_t>(range_start), static_cast<off_t>(length), SYNC_FILE_RANGE_WRITE) == -1) { return false; }
+            if (previous_length > 0)
+            {
+                constexpr unsigned wait = SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER;
+                if (sync_file_range(fd, static_cast<off_t>(previous_start), static_cast<off_t>(previous_length), wait) == -1) { return false; }
+            }
+            previous_start = range_start;
+            previous_length = length;
+            range_start = file_offset;
+        }
+#endif
+        return true;
     }
 
-    void flush() { static_cast<T*>(this)->write({data(buffer), size(buffer)}); }
+    // 在此之前写入的数据都同步之后, 返回的 future 就绪
+    shared_future<void> commit()
+    {
+        shared_future<void> done;
+        {
+            lock_guard lock {m};
+            if (batch == nullptr)
+            {
+                batch = make_shared<promise<void>>();
+                batch_done = batch->get_future().share();
+            }
+            done = batch_done;
+        }
+        cv.notify_one();
+
+        return done;
+    }
 };
 
+// readv/writev 类调用完成 n 字节之后, 跳过已经处理的部分, 返回剩下的 iovec
+inline span<iovec> advance_iov(span<iovec> rest, size_t n)
+{
+    while (n > 0)
+    {
+        size_t step = min(n, rest.front().iov_len);
+        rest.front().iov_base = static_cast<char*>(rest.front().iov_base) + step;
+        rest.front().iov_len -= step;
+        n -= step;
+        if (rest.front().iov_len == 0) { rest = rest.subspan(1); }
+    }
+    while (!rest.empty() && rest.front().iov_len == 0) { rest = rest.subspan(1); }
+    return rest;
+}
 
 // close 不会强制将未写入的数据刷新到磁盘
 // 调用 close 只会将这些数据放入内核的缓冲区
+// 何时刷新到磁盘由 sync_policy 决定, 默认每次 flush() 调用 fsync
+// 拷贝共享同一个 fd, 多个线程可以各自持有一份拷贝写入并 commit()
 class fd_ostream
 {
     int fd {-1};
-    shared_ptr<void> close_guard {nullptr, [](void* p) { close(fd) }};
+    sync_policy policy;
+    shared_ptr<void> close_guard;
+    shared_ptr<fd_syncer> syncer;
+    shared_ptr<page_cache_advisor> cache;
+
+    bool wrote(size_t n)
+    {
+        if (syncer != nullptr && !syncer->wrote(n)) { return false; }
+        return cache == nullptr || cache->wrote(n);
+    }
 
 public:
-    fd_ostream(string_view path)
+    explicit fd_ostream(string_view path, sync_policy policy_ = {}, int flags = O_WRONLY | O_CREAT | O_TRUNC, cache_policy cache_ = {})
+        : fd {open(data(path), flags, 0644)}, policy {policy_}
     {
-        fd = open(data(path));
         if (fd == -1) { throw system_error {errno, system_category()}; }
+        close_guard = shared_ptr<void> {nullptr, [fd = fd](void*) { close(fd); }};
+
+        if (policy.mode != durability::none && policy.mode != durability::on_flush)
+        {
+            syncer = make_shared<fd_syncer>(fd, policy, close_guard);
+        }
+
+        if (cache_.mode == cache_mode::streaming)
+        {
+            off_t offset = lseek(fd, 0, (flags & O_APPEND) != 0 ? SEEK_END : SEEK_CUR);
+            if (offset == -1) { throw system_error {errno, system_category()}; }
+            cache = make_shared<page_cache_advisor>(fd, cache_.window, static_cast<uint64_t>(offset));
+        }
     }
 
     int get() { return fd; }
 
-    void write(span<const char> bytes)
+    void write(span<const char> bytes) { value_or_throw(try_write(bytes)); }
+
+    // 失败时返回 io_error, errno 是系统调用的错误; 之前的部分可能已经写入
+    expected<void, stream_error> try_write(span<const char> bytes)
     {
+        size_t n = size(bytes);
         while (size(bytes) > 0)
         {
             auto bytes_written = ::write(fd, data(bytes), size(bytes));
-            if (bytes_written == -1) { throw system_error {errno, system_category()}; }
-            bytes = bytes.subspan(bytes_written);
+            if (bytes_written == -1)
+            {
+                if (errno == EINTR) { continue; }
+                return unexpected {stream_error::io_error};
+            }
+            bytes = bytes.subspan(static_cast<size_t>(bytes_written));
         }
+
+        if (!wrote(n)) { return unexpected {stream_error::io_error}; }
+        return {};
+    }
+
+    // 一次系统调用写出多段数据, 如 segmented_buffer::segments()
+    void write(span<const span<const char>> parts)
+    {
+        vector<iovec> iov;
+        iov.reserve(size(parts));
+        size_t n {};
+        for (span<const char> part : parts)
+        {
+            iov.push_back({const_cast<char*>(data(part)), size(part)});
+            n += size(part);
+        }
+
+        span<iovec> rest {iov};
+        while (!rest.empty())
+        {
+            auto ret = writev(fd, data(rest), static_cast<int>(min<size_t>(size(rest), IOV_MAX)));
+            if (ret == -1)
+            {
+                if (errno == EINTR) { continue; }
+                throw system_error {errno, system_category()};
+            }
+
+            rest = advance_iov(rest, static_cast<size_t>(ret));
+        }
+
+        if (!wrote(n)) { throw system_error {errno, system_category()}; }
+    }
+
+    // group_commit 模式下不阻塞, 由调用者决定何时等待; 其它模式同步完成后返回已就绪的 future
+    shared_future<void> commit()
+    {
+        if (policy.mode == durability::periodic || policy.mode == durability::group_commit) { return syncer->commit(); }
+
+        if (fdatasync(fd) == -1) { throw system_error {errno, system_category()}; }
+
+        promise<void> done;
+        done.set_value();
+        return done.get_future().share();
     }
 
     void flush()
     {
-        if (fsync(fd) == -1) { throw std::system_error {errno, std::system_category()}; }
+        switch (policy.mode)
+        {
+            case durability::none: break;
+            case durability::on_flush:
+                if (fsync(fd) == -1) { throw std::system_error {errno, std::system_category()}; }
+                break;
+            default: commit().get();
+        }
     }
 };
@@ -0,0 +1,221 @@
+#pragma once
+
+#include "binary_stream.hpp"
+#include "stream.hpp"
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <mutex>
+#include <thread>
+#include <tuple>
+#include <utility>
+
+// 写满后不再修改的缓冲区, 可以同时交给多个输出
+using shared_block = shared_ptr<const vector<char>>;
+
+// 在独立的线程中写入 sink, 慢的输出不会阻塞其它输出
+// 队列中最多有 max_pending 个缓冲区, 超过时 submit() 等待, 以免内存无限增长
+// 写入线程中的异常在下一次 submit() 或 flush() 时重新抛出
+template <output_sink Sink>
+class async_sink
+{
+    Sink& sink;
+    size_t max_pending;
+
+    mutex m;
+    condition_variable cv;
+    deque<shared_block> queue;
+    bool writing {false};
+    bool stopping {false};
+    exception_ptr error;
+
+    jthread worker;
+
+    void run()
+    {
+        unique_lock lock {m};
+        while (true)
+        {
+            cv.wait(lock, [this] { return stopping || !queue.empty(); });
+            if (queue.empty()) { return; }
+
+            shared_block block = std::move(queue.front());
+            queue.pop_front();
+            writing = true;
+            cv.notify_all();
+
+            bool failed = error != nullptr;
+            exception_ptr e;
+
+            lock.unlock();
+            try
+            {
+                if (!failed) { sink.write(span<const char> {*block}); }
+            }
+            catch (...)
+            {
+                e = current_exception();
+            }
+            block.reset();
+            lock.lock();
+
+            if (e != nullptr) { error = e; }
+            writing = false;
+            cv.notify_all();
+        }
+    }
+
+    void rethrow()
+    {
+        if (error != nullptr) { rethrow_exception(exchange(error, nullptr)); }
+    }
+
+public:
+    explicit async_sink(Sink& sink_, size_t max_pending_ = 64) : sink {sink_}, max_pending {max_pending_}, worker {[this] { run(); }} {}
+
+    async_sink(const async_sink&) = delete;
+    async_sink& operator=(const async_sink&) = delete;
+
+    ~async_sink()
+    {
+        {
+            lock_guard lock {m};
+            stopping = true;
+        }
+        cv.notify_all();
+    }
+
+    void submit(shared_block block)
+    {
+        unique_lock lock {m};
+        cv.wait(lock, [this] { return queue.size() < max_pending; });
+        rethrow();
+
+        queue.push_back(std::move(block));
+        cv.notify_all();
+    }
+
+    void write(span<const char> s) { submit(make_shared<const vector<char>>(s.begin(), s.end())); }
+
+    // 等待队列写完, 再刷新 sink
+    void flush()
+    {
+        unique_lock lock {m};
+        cv.wait(lock, [this] { return queue.empty() && !writing; });
+        rethrow();
+
+        if constexpr (requires { sink.flush(); }) { sink.flush(); }
+    }
+};
+
+// 把同一份数据写到多个输出: 每个值只格式化一次, 写入共享缓冲区, 缓冲区满时依次交给每个 sink
+// async_sink 直接持有缓冲区而不拷贝; 最后一个持有者释放缓冲区时, shared_ptr 的删除器把它放回空闲列表,
+// 之后才会被重用; 最多有 max_buffers 个缓冲区, 都在 async_sink 中时 write() 等待
+template <output_sink... Sinks>
+class tee_ostream : public OutputStream<tee_ostream<Sinks...>>
+{
+    using block = shared_ptr<vector<char>>;
+
+    // 删除器可能在 tee_ostream 析构之后才运行, 所以空闲列表由 shared_ptr 持有
+    struct buffer_pool
+    {
+        mutex m;
+        condition_variable cv;
+        vector<unique_ptr<vector<char>>> free;
+        size_t allocated {};
+    };
+
+    tuple<Sinks&...> sinks;
+    size_t capacity;
+    size_t max_buffers;
+    shared_ptr<buffer_pool> pool;
+    block buffer;
+
+    template <typename Sink>
+    void send(Sink& sink)
+    {
+        if constexpr (requires { sink.submit(shared_block {}); }) { sink.submit(buffer); }
+        else { sink.write(span<const char> {*buffer}); }
+    }
+
+    block acquire()
+    {
+        unique_ptr<vector<char>> b;
+        {
+            unique_lock lock {pool->m};
+            pool->cv.wait(lock, [this] { return !pool->free.empty() || pool->allocated < max_buffers; });
+            if (!pool->free.empty())
+            {
+                b = std::move(pool->free.back());
+                pool->free.pop_back();
+            }
+            else { ++pool->allocated; }
+        }
+
+        if (b == nullptr)
+        {
+            b = make_unique<vector<char>>();
+            b->reserve(capacity);
+        }
+        b->clear();
+
+        return block {b.release(), [pool = pool](vector<char>* p)
+                      {
+                          {
+                              lock_guard lock {pool->m};
+                              pool->free.emplace_back(p);
+                          }
+                          pool->cv.notify_one();
+                      }};
+    }
+
+    void next_buffer()
+    {
+        buffer.reset();
+        buffer = acquire();
+    }
+
+    void dispatch()
+    {
+        if (buffer->empty()) { return; }
+
+        apply([this](auto&... s) { (send(s), ...); }, sinks);
+        next_buffer();
+    }
+
+public:
+    explicit tee_ostream(Sinks&... sinks_) : tee_ostream(8192, sinks_...) {}
+
+    tee_ostream(size_t buffer_size, Sinks&... sinks_) : tee_ostream(buffer_size, 8, sinks_...) {}
+
+    tee_ostream(size_t buffer_size, size_t max_buffers_, Sinks&... sinks_)
+        : sinks {sinks_...}, capacity {buffer_size}, max_buffers {max<size_t>(max_buffers_, 1)}, pool {make_shared<buffer_pool>()}, buffer {acquire()}
+    {
+    }
+
+    tee_ostream(const tee_ostream&) = delete;
+    tee_ostream& operator=(const tee_ostream&) = delete;
+
+    ~tee_ostream() { discard_errors([this] { dispatch(); }); }
+
+    void write(span<const char> s)
+    {
+        buffer->insert(buffer->end(), s.begin(), s.end());
+        if (buffer->size() >= capacity) { dispatch(); }
+    }
+
+    void flush()
+    {
+        dispatch();
+        apply(
+            [](auto&... s)
+            {
+                auto flush_one = [](auto& sink)
+                {
+                    if constexpr (requires { sink.flush(); }) { sink.flush(); }
+                };
+                (flush_one(s), ...);
+            },
+            sinks);
+    }
+};
@@ -0,0 +1,59 @@
+#include "checksum_stream.hpp"
+#include <cassert>
+#include <iostream>
+#include <random>
+
+// g++ -std=c++23 -O2 -msse4.2 -mpclmul test_checksum.cpp 比较 crc32 指令和查表两种实现;
+// 不带 -msse4.2 编译时两边都是查表, 只检查已知的结果和分块计算
+
+uint32_t crc32c_table(span<const byte> s)
+{
+    return ~crc32c_detail::update_table(~uint32_t {}, reinterpret_cast<const unsigned char*>(data(s)), size(s));
+}
+
+uint32_t crc32c_of(span<const byte> s)
+{
+    crc32c h;
+    h.update(s);
+    return h.value();
+}
+
+int main()
+{
+    // CRC-32C 的标准检验值和 RFC 3720 附录 B.4 的测试向量
+    string_view digits {"123456789"};
+    assert(crc32c_of(as_bytes(span {digits})) == 0xe3069283);
+    array<byte, 32> zeros {};
+    assert(crc32c_of(zeros) == 0x8a9136aa);
+
+    mt19937_64 rng {42};
+    vector<byte> buffer(3 * 4096 * 2 + 1003);
+    for (byte& b : buffer) { b = static_cast<byte>(rng()); }
+
+    // 覆盖三段交错的 4096 和 256 字节两种宽度, 剩下的 8 字节块和单个字节, 以及不对齐的起点
+    for (size_t n : {0, 1, 7, 8, 9, 255, 768, 769, 3 * 256 + 17, 12288, 12289, 12288 + 768 + 13, 3 * 4096 * 2 + 999})
+    {
+        for (size_t offset : {0, 1, 3})
+        {
+            span<const byte> s = span<const byte>(buffer).subspan(offset, n);
+            assert(crc32c_of(s) == crc32c_table(s));
+        }
+    }
+
+    // 分块计算和一次计算的结果相同
+    for (int round = 0; round < 100; ++round)
+    {
+        span<const byte> s {buffer};
+        crc32c h;
+        while (!s.empty())
+        {
+            size_t n = min<size_t>(size(s), rng() % 5000);
+            h.update(s.first(n));
+            s = s.subspan(n);
+        }
+        assert(h.value() == crc32c_table(buffer));
+    }
+
+    cout << "checksum tests passed\n";
+    return 0;
+}
@@ -0,0 +1,96 @@
+#include "codec_stream.hpp"
+#include <cassert>
+#include <iostream>
+#include <random>
+
+// g++ -std=c++23 -O2 -mssse3 test_codec.cpp -lz -lzstd -llz4 比较 SSSE3 编码和逐字节的参考实现;
+// 不带 -mssse3 编译时只检查逐组的实现
+
+string reference_base64(span<const byte> in, string_view chars, bool padding)
+{
+    string out;
+    size_t i {};
+    for (; i + 3 <= size(in); i += 3)
+    {
+        uint32_t v = to_integer<uint32_t>(in[i]) << 16 | to_integer<uint32_t>(in[i + 1]) << 8 | to_integer<uint32_t>(in[i + 2]);
+        for (int shift : {18, 12, 6, 0}) { out += chars[v >> shift & 0x3f]; }
+    }
+
+    size_t rest = size(in) - i;
+    if (rest == 0) { return out; }
+
+    uint32_t v = to_integer<uint32_t>(in[i]) << 16 | (rest == 2 ? to_integer<uint32_t>(in[i + 1]) << 8 : 0);
+    out += chars[v >> 18 & 0x3f];
+    out += chars[v >> 12 & 0x3f];
+    if (rest == 2) { out += chars[v >> 6 & 0x3f]; }
+    if (padding) { out += rest == 2 ? "=" : "=="; }
+    return out;
+}
+
+// 每次只给 transform 很小的输入和输出, 让一组数据跨越两次调用
+template <typename Filter>
+vector<byte> in_pieces(Filter filter, span<const byte> in, mt19937_64& rng)
+{
+    vector<byte> out;
+    array<byte, 11> buffer;
+    while (true)
+    {
+        size_t n = min<size_t>(size(in), rng() % 40);
+        filter_result r = filter.transform(in.first(n), buffer, n == size(in) ? filter_flush::finish : filter_flush::none);
+        out.insert(out.end(), buffer.begin(), buffer.begin() + static_cast<ptrdiff_t>(r.produced));
+        in = in.subspan(r.consumed);
+        if (r.end) { return out; }
+    }
+}
+
+int main()
+{
+    // RFC 4648 第 10 节的测试向量
+    for (auto [plain, encoded] : {pair {"", ""}, {"f", "Zg=="}, {"fo", "Zm8="}, {"foo", "Zm9v"}, {"foob", "Zm9vYg=="}, {"fooba", "Zm9vYmE="}, {"foobar", "Zm9vYmFy"}})
+    {
+        string_view text {plain};
+        assert(encode_base64(as_bytes(span {text})) == encoded);
+
+        vector<byte> decoded = decode_base64(encoded);
+        assert(string_view(reinterpret_cast<const char*>(data(decoded)), size(decoded)) == text);
+    }
+
+    mt19937_64 rng {42};
+    for (int round = 0; round < 500; ++round)
+    {
+        vector<byte> plain(rng() % 300);
+        for (byte& b : plain) { b = static_cast<byte>(rng()); }
+
+        for (auto alphabet : {base64_alphabet::standard, base64_alphabet::url})
+        {
+            bool padding = alphabet == base64_alphabet::standard;
+            string encoded = encode_base64(plain, alphabet, padding);
+            assert(encoded == reference_base64(plain, codec_detail::base64_chars(alphabet), padding));
+            assert(decode_base64(encoded, alphabet) == plain);
+
+            vector<byte> pieces = in_pieces(base64_encoder {alphabet, padding}, plain, rng);
+            assert(string_view(reinterpret_cast<const char*>(data(pieces)), size(pieces)) == encoded);
+            assert(in_pieces(base64_decoder {alphabet}, as_bytes(span {encoded}), rng) == plain);
+        }
+
+        string hex = encode_hex(plain);
+        assert(size(hex) == 2 * size(plain));
+        assert(decode_hex(hex) == plain);
+    }
+
+    // 非法的字符落在 SIMD 处理的一整块中间
+    string bad(64, 'A');
+    bad[37] = '*';
+    try
+    {
+        (void)decode_base64(bad);
+        assert(false);
+    }
+    catch (const encoding_error& e)
+    {
+        assert(e.offset == 36);
+    }
+
+    cout << "codec tests passed\n";
+    return 0;
+}
@@ -0,0 +1,168 @@
+#include "csv_stream.hpp"
+#include <cassert>
+#include <cstring>
+#include <iostream>
+#include <random>
+
+// g++ -std=c++23 -O2 -mavx2 -mpclmul test_csv.cpp 和逐字符的解析比较 csv_reader 的结果;
+// 不带 -mavx2 -mpclmul 编译时检查 SSE2 和移位实现的 prefix_xor
+
+// 每次 read() 最多给 chunk 字节, 记录经常跨越 refill()
+struct chunked_source
+{
+    string_view text;
+    size_t chunk;
+
+    size_t read(span<byte> s)
+    {
+        size_t n = min({size(s), size(text), chunk});
+        memcpy(data(s), data(text), n);
+        text.remove_prefix(n);
+        return n;
+    }
+};
+
+using records = vector<vector<string>>;
+
+// 逐字符的参考实现: 引号只在字段开头有意义, 引号内的 "" 是一个引号, 字段末尾的 \r 去掉
+records parse_reference(string_view text)
+{
+    records result;
+    size_t i {};
+    while (i < size(text))
+    {
+        vector<string> record;
+        string field;
+        bool in_quotes {false};
+        bool field_start {true};
+        while (true)
+        {
+            if (i == size(text) || (!in_quotes && (text[i] == ',' || text[i] == '\n')))
+            {
+                bool end = i == size(text) || text[i] == '\n';
+                if (end && field.ends_with('\r')) { field.pop_back(); }
+                record.push_back(std::move(field));
+                field.clear();
+                field_start = true;
+                if (i++ == size(text) || end) { break; }
+                continue;
+            }
+
+            char c = text[i++];
+            if (in_quotes && c == '"')
+            {
+                if (i < size(text) && text[i] == '"') { field += text[i++]; }
+                else { in_quotes = false; }
+            }
+            else if (field_start && c == '"') { in_quotes = true; }
+            else { field += c; }
+            field_start = false;
+        }
+        result.push_back(std::move(record));
+    }
+    return result;
+}
+
+template <buffered_input Source>
+records parse_all(Source& in)
+{
+    csv_reader reader {in};
+    records result;
+    while (auto record = reader.next()) { result.emplace_back(record->begin(), record->end()); }
+    return result;
+}
+
+// 字段中有引号包围的分隔符, 换行和 "" 转义, 也有超过 64 字节的长字段
+string random_csv(mt19937_64& rng)
+{
+    string text;
+    size_t max_length = rng() % 3 == 0 ? 200 : 12;
+    for (size_t n = rng() % 50; n > 0; --n)
+    {
+        for (size_t fields = 1 + rng() % 6, f = 0; f < fields; ++f)
+        {
+            if (f > 0) { text += ','; }
+            size_t length = rng() % max_length;
+            if (rng() % 3 == 0)
+            {
+                text += '"';
+                for (size_t k = 0; k < length; ++k)
+                {
+                    switch (rng() % 6)
+                    {
+                        case 0: text += "\"\""; break;
+                        case 1: text += ','; break;
+                        case 2: text += '\n'; break;
+                        default: text += static_cast<char>('a' + k % 26);
+                    }
+                }
+                text += '"';
+            }
+            else
+            {
+                for (size_t k = 0; k < length; ++k) { text += static_cast<char>('0' + rng() % 10); }
+            }
+        }
+        text += rng() % 4 == 0 ? "\r\n" : "\n";
+    }
+
+    // 一半的样本最后一条记录没有换行
+    if (rng() % 2 == 0 && text.ends_with('\n'))
+    {
+        text.pop_back();
+        if (text.ends_with('\r')) { text.pop_back(); }
+    }
+    return text;
+}
+
+int main()
+{
+    mt19937_64 rng {42};
+
+    for (int round = 0; round < 500; ++round)
+    {
+        string text = random_csv(rng);
+        records expected = parse_reference(text);
+
+        ISpanStream whole {span<const char> {text}};
+        assert(parse_all(whole) == expected);
+
+        for (size_t chunk : {1, 7, 64, 1000})
+        {
+            IBUfStream<chunked_source, 32> in {chunked_source {text, chunk}};
+            assert(parse_all(in) == expected);
+        }
+    }
+
+    // 已知的例子: 转义的引号, \r\n, 最后一条没有换行的记录
+    string_view sample {"a,\"b,\"\"c\"\"\"\r\n\"multi\nline\",\n1,2"};
+    ISpanStream in {span<const char> {sample}};
+    assert(parse_all(in) == (records {{"a", "b,\"c\""}, {"multi\nline", ""}, {"1", "2"}}));
+
+    // TSV 不处理引号, 字段可以交给 ISpanStream 解析
+    string_view tsv {"1\t2.5\t\"x\"\n1f\t3\t\n"};
+    ISpanStream tsv_in {span<const char> {tsv}};
+    csv_reader reader {tsv_in, '\t', '\0'};
+    assert(size(*reader.next()) == 3);
+    assert(reader.field_as<int>(0) == 1 && reader.field_as<double>(1) == 2.5 && reader.current()[2] == "\"x\"");
+    assert(size(*reader.next()) == 3);
+    int hex {};
+    reader.parse(0).setbase(16) << hex;
+    assert(hex == 0x1f);
+    assert(!reader.next());
+
+    // 没有结束的引号
+    string_view unterminated {"a,\"bc\n"};
+    ISpanStream bad {span<const char> {unterminated}};
+    try
+    {
+        (void)parse_all(bad);
+        assert(false);
+    }
+    catch (const runtime_error&)
+    {
+    }
+
+    cout << "csv tests passed\n";
+    return 0;
+}
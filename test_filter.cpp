@@ -0,0 +1,96 @@
+#include "filter_stream.hpp"
+#include <cassert>
+#include <iostream>
+#include <random>
+
+// g++ -std=c++23 -O2 test_filter.cpp -lz -lzstd -llz4 压缩后再通过很小的输出缓冲区解压
+
+struct string_sink
+{
+    string bytes;
+
+    void write(span<const char> s) { bytes.append(data(s), size(s)); }
+};
+
+template <typename Encoder>
+string compress(string_view text, Encoder encoder)
+{
+    string_sink sink;
+    filter_sink out {sink, std::move(encoder), 4096};
+    out.write(span<const char> {text});
+    out.finish();
+    return sink.bytes;
+}
+
+// 每次 read() 只给 n 字节的空间, 输入结束时解码器里还留着没有输出的数据
+template <typename Decoder>
+string decompress(string_view compressed, Decoder decoder, size_t n)
+{
+    ISpanStream in {span<const char> {compressed}};
+    filter_reader reader {in, std::move(decoder)};
+    string text;
+    vector<byte> buffer(n);
+    while (size_t k = reader.read(buffer)) { text.append(reinterpret_cast<const char*>(data(buffer)), k); }
+    return text;
+}
+
+// 编码器和解码器不能复制, 由 make_encoder() 和 make_decoder() 每次新建
+template <typename MakeEncoder, typename MakeDecoder>
+void round_trip(const string& text, MakeEncoder make_encoder, MakeDecoder make_decoder)
+{
+    string compressed = compress(text, make_encoder());
+    for (size_t n : {1, 7, 4096}) { assert(decompress(compressed, make_decoder(), n) == text); }
+
+    // 截断的流仍然报错
+    for (size_t cut : {size_t {1}, size(compressed) / 2})
+    {
+        try
+        {
+            (void)decompress(string_view {compressed}.substr(0, size(compressed) - cut), make_decoder(), 7);
+            assert(false);
+        }
+        catch (const runtime_error&)
+        {
+        }
+    }
+}
+
+int main()
+{
+    mt19937_64 rng {42};
+    string text;
+    for (int i = 0; i < 20000; ++i) { text += "line " + to_string(rng() % 1000) + '\n'; }
+
+    auto raw_encoder = [] { return zlib_encoder {zlib_format::raw}; };
+    auto raw_decoder = [] { return zlib_decoder {zlib_format::raw}; };
+    auto gzip_encoder = [] { return zlib_encoder {zlib_format::gzip}; };
+    auto gzip_decoder = [] { return zlib_decoder {zlib_format::gzip}; };
+    auto zstd = [] { return zstd_encoder {}; };
+    auto unzstd = [] { return zstd_decoder {}; };
+    auto lz4 = [] { return lz4_encoder {}; };
+    auto unlz4 = [] { return lz4_decoder {}; };
+
+    round_trip(text, raw_encoder, raw_decoder);
+    round_trip(text, gzip_encoder, gzip_decoder);
+    round_trip(text, zstd, unzstd);
+    round_trip(text, lz4, unlz4);
+
+    // 结尾是长的重复时, 最后几个字节的输入在 raw deflate 中展开成很多输出, 解码器已经读完输入但还没有输出完
+    for (int round = 0; round < 50; ++round)
+    {
+        string tail;
+        for (size_t i = rng() % 5000; i > 0; --i) { tail += static_cast<char>('a' + rng() % 3); }
+        tail += string(rng() % 2000, 'x');
+
+        round_trip(tail, raw_encoder, raw_decoder);
+        round_trip(tail, zstd, unzstd);
+        round_trip(tail, lz4, unlz4);
+    }
+
+    // 空的流
+    round_trip(string {}, zstd, unzstd);
+    round_trip(string {}, lz4, unlz4);
+
+    cout << "filter tests passed\n";
+    return 0;
+}
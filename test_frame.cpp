@@ -0,0 +1,128 @@
+#include "frame_stream.hpp"
+#include <cassert>
+#include <iostream>
+#include <random>
+
+// g++ -std=c++23 -O2 test_frame.cpp 写入各种长度的帧再读回, 包括 end_frame() 回填的 varint 帧头
+
+struct string_sink
+{
+    string bytes;
+
+    void write(span<const char> s) { bytes.append(data(s), size(s)); }
+};
+
+// 每次最多读 n 字节, 让帧头和帧的内容跨越 IBUfStream 的多次 refill()
+struct chunked_input
+{
+    string_view text;
+    size_t n;
+
+    size_t read(span<byte> s)
+    {
+        size_t k = min({size(s), size(text), n});
+        memcpy(data(s), data(text), k);
+        text.remove_prefix(k);
+        return k;
+    }
+};
+
+string payload_of(size_t n, mt19937_64& rng)
+{
+    string s(n, '\0');
+    for (char& c : s) { c = static_cast<char>(rng()); }
+    return s;
+}
+
+void round_trip(const frame_format& format, mt19937_64& rng)
+{
+    frame_writer writer {string_sink {}, format, 4096};
+    vector<string> payloads;
+    for (size_t n : {0, 1, 127, 128, 300, 4095, 4096, 4097, 20000, 70000})
+    {
+        payloads.push_back(payload_of(n, rng));
+
+        // 一半的帧分几次写入, 由 end_frame() 回填长度; 另一半整帧写入
+        if (size(payloads) % 2 == 0) { writer.write_frame(span<const char> {payloads.back()}); }
+        else
+        {
+            writer.begin_frame();
+            string_view rest {payloads.back()};
+            while (!rest.empty())
+            {
+                size_t k = min<size_t>(size(rest), 1 + rng() % 5000);
+                writer.write(span<const char> {rest.substr(0, k)});
+                rest.remove_prefix(k);
+            }
+            writer.end_frame();
+        }
+    }
+    writer.flush();
+    string_view encoded {writer.get().bytes};
+
+    // 整个窗口一次可见
+    {
+        ISpanStream in {span<const char> {encoded}};
+        size_t i {};
+        for (span<const byte> frame : frames(in, format))
+        {
+            assert(i < size(payloads));
+            assert(string_view(reinterpret_cast<const char*>(data(frame)), size(frame)) == payloads[i]);
+            ++i;
+        }
+        assert(i == size(payloads));
+    }
+
+    // 每次只读到很少的字节
+    {
+        IBUfStream<chunked_input, 1024> in {chunked_input {encoded, 7}};
+        for (const string& expected : payloads)
+        {
+            optional<span<const byte>> frame = read_frame(in, format);
+            assert(frame && string_view(reinterpret_cast<const char*>(data(*frame)), size(*frame)) == expected);
+        }
+        assert(!read_frame(in, format));
+    }
+
+    // 截断的帧
+    {
+        ISpanStream in {span<const char> {encoded.substr(0, size(encoded) - 1)}};
+        try
+        {
+            while (read_frame(in, format)) {}
+            assert(false);
+        }
+        catch (const runtime_error&)
+        {
+        }
+    }
+}
+
+int main()
+{
+    mt19937_64 rng {42};
+
+    round_trip(frame_format {}, rng);
+    round_trip(frame_format {frame_header::fixed32, endian::big}, rng);
+    round_trip(frame_format {frame_header::fixed64, endian::little}, rng);
+
+    // 超过 compact_limit 的帧用补齐到预留长度的 varint, 仍然能按普通的 LEB128 解码
+    frame_format format;
+    frame_writer writer {string_sink {}, format};
+    string payload(frame_writer<string_sink>::compact_limit + 1, 'x');
+    writer.begin_frame();
+    writer.write(span<const char> {payload});
+    writer.end_frame();
+    writer.flush();
+
+    const string& bytes = writer.get().bytes;
+    size_t reserved = frame_detail::reserved_header(format);
+    assert(size(bytes) == reserved + size(payload));
+    uint64_t length {};
+    auto p = reinterpret_cast<const byte*>(data(bytes));
+    assert(decode_varint(p, p + size(bytes), length) == p + reserved);
+    assert(length == size(payload));
+
+    cout << "frame tests passed\n";
+    return 0;
+}
@@ -0,0 +1,101 @@
+#include "mmapstream.hpp"
+#include <cassert>
+#include <filesystem>
+#include <iostream>
+#include <thread>
+
+// g++ -std=c++23 -O2 test_mmap.cpp 检查 mmap_istream 的读取, seekg 和 follow 模式下的追加, 截断和轮转
+
+void append(const string& path, string_view text)
+{
+    fd_ostream out {path, sync_policy {durability::none}, O_WRONLY | O_CREAT | O_APPEND};
+    out.write(span<const char> {text});
+}
+
+string as_text(span<const byte> s)
+{
+    return {reinterpret_cast<const char*>(data(s)), size(s)};
+}
+
+int main()
+{
+    string dir = "/tmp/test_mmap";
+    filesystem::remove_all(dir);
+    filesystem::create_directory(dir);
+    string path = dir + "/a.log";
+
+    // 整个文件就是窗口, 没有 follow 时 refill() 总是返回 0
+    {
+        append(path, "hello world");
+        streams::mmap_istream in {path};
+        assert(as_text(in.window()) == "hello world");
+        assert(in.refill() == 0);
+
+        array<byte, 5> buffer;
+        assert(as_text(in.read(buffer)) == "hello");
+        assert(in.tellg() == 5);
+        in.seekg(6);
+        assert(as_text(in.read(buffer)) == "world");
+        assert(in.read(buffer).empty());
+        in.seekg(100);
+        assert(in.tellg() == 11);
+        filesystem::remove(path);
+    }
+
+    append(path, "abc\npartial");
+    streams::mmap_istream in {path, huge_page::none, read_mode::follow};
+    in.consume(4);
+
+    // 追加: 映射扩大, 没有读完的部分留在窗口中
+    append(path, " line\n");
+    assert(in.refill() == 6);
+    assert(as_text(in.window()) == "partial line\n");
+    in.consume(13);
+
+    // 轮转: 旧文件的内容读完之前 refill() 返回 0, 之后才打开新文件
+    append(path, "tail");
+    filesystem::rename(path, path + ".1");
+    append(path, "new\n");
+    assert(in.refill() == 4);
+    assert(as_text(in.window()) == "tail");
+    assert(in.refill() == 0);
+    in.consume(4);
+    assert(in.refill() == 4);
+    assert(as_text(in.window()) == "new\n");
+    in.consume(4);
+
+    // 截断: 还没有读的部分超过一页, 新的文件末尾之后的页换成零页, 不会 SIGBUS
+    append(path, string(20000, 'x'));
+    assert(in.refill() == 20000);
+    in.consume(10);
+    filesystem::resize_file(path, 0);
+    append(path, "t\n");
+    assert(in.refill() == 0);
+    span<const byte> rest = in.window();
+    assert(size(rest) == 20000 - 10);
+    assert(ranges::count(rest, byte {0}) >= 20000 - 4096);
+    assert(in.refill() == 0);
+    in.consume(size(rest));
+    assert(in.refill() == 2);
+    assert(as_text(in.window()) == "t\n");
+    in.consume(2);
+
+    // 没有变化时 refill() 等待 inotify 通知, stop() 从其他线程唤醒它
+    jthread writer {[&] {
+        this_thread::sleep_for(50ms);
+        append(path, "more\n");
+    }};
+    assert(in.refill() == 5);
+    assert(as_text(in.window()) == "more\n");
+    in.consume(5);
+
+    jthread stopper {[&] {
+        this_thread::sleep_for(50ms);
+        in.stop();
+    }};
+    assert(in.refill() == 0);
+
+    filesystem::remove_all(dir);
+    cout << "mmap tests passed\n";
+    return 0;
+}
@@ -0,0 +1,93 @@
+#include "positional_stream.hpp"
+#include <cassert>
+#include <future>
+#include <iostream>
+#include <thread>
+
+// g++ -std=c++23 -O2 test_positional.cpp 检查每个线程的块缓存, 以及 write_at() 使所有线程和所有副本的缓存失效
+
+string read_text(const positional_stream& file, uint64_t offset, size_t n)
+{
+    string text(n, '\0');
+    text.resize(file.read_at(offset, as_writable_bytes(span {text})));
+    return text;
+}
+
+// 绕过 positional_stream 修改文件, 缓存中的块不会失效
+void overwrite(const string& path, uint64_t offset, string_view text)
+{
+    positional_stream raw {path, O_WRONLY};
+    raw.write_at(offset, as_bytes(span {text}));
+}
+
+int main()
+{
+    string path = "/tmp/test_positional";
+    string content;
+    for (int i = 0; i < 1000; ++i) { content += to_string(i % 10); }
+    {
+        positional_stream out {path, O_WRONLY | O_CREAT | O_TRUNC};
+        out.write_at(0, as_bytes(span {content}));
+    }
+
+    positional_stream file {path, O_RDWR, 4, 64};
+    assert(file.size() == 1000);
+
+    // 跨越块边界的读取, 最后一块不满
+    assert(read_text(file, 60, 10) == content.substr(60, 10));
+    assert(read_text(file, 990, 20) == content.substr(990));
+    assert(read_text(file, 2000, 5).empty());
+
+    // 读过的块来自缓存
+    overwrite(path, 60, "abcd");
+    assert(read_text(file, 60, 4) == content.substr(60, 4));
+
+    // 其他线程有自己的缓存, 第一次读到的是文件中的新内容
+    string other;
+    jthread {[&] { other = read_text(file, 60, 4); }}.join();
+    assert(other == "abcd");
+
+    // 超过 cache_blocks 个块时淘汰最久没有用过的块
+    for (uint64_t block = 2; block < 6; ++block) { (void)read_text(file, block * 64, 1); }
+    assert(read_text(file, 60, 4) == "abcd");
+
+    // 大块读取不经过缓存
+    overwrite(path, 0, "wxyz");
+    assert(read_text(file, 0, 200).substr(0, 4) == "wxyz");
+
+    // 复制和移动出的对象共享缓存, 一个副本的 write_at() 使所有线程和副本的缓存失效
+    positional_stream copy = file;
+    positional_stream moved = std::move(copy);
+    (void)read_text(file, 128, 4);
+    overwrite(path, 128, "1234");
+    assert(read_text(moved, 128, 4) == content.substr(128, 4));
+
+    string before;
+    string after;
+    promise<void> cached;
+    promise<void> written;
+    jthread reader {[&] {
+        before = read_text(file, 128, 4);
+        cached.set_value();
+        written.get_future().wait();
+        after = read_text(file, 128, 4);
+    }};
+    cached.get_future().wait();
+    moved.write_at(130, as_bytes(span {string_view {"!"}}));
+    written.set_value();
+    reader.join();
+    assert(before == "1234");
+    assert(after == "12!4");
+    assert(read_text(file, 128, 4) == "12!4");
+
+    // 一次读到多个缓冲区
+    array<byte, 3> a;
+    array<byte, 5> b;
+    array<span<byte>, 2> parts {span<byte> {a}, span<byte> {b}};
+    assert(file.read_at(128, parts) == 8);
+    assert(a[2] == byte {'!'} && b[0] == byte {'4'});
+
+    unlink(path.c_str());
+    cout << "positional tests passed\n";
+    return 0;
+}
@@ -0,0 +1,129 @@
+#include "sort_stream.hpp"
+#include <cassert>
+#include <iostream>
+#include <mutex>
+#include <random>
+#include <set>
+
+// g++ -std=c++23 -O2 test_sort.cpp 和 std::stable_sort 比较外部排序的结果
+
+string read_file(const string& path)
+{
+    string text;
+    stdio_file_istream in {path};
+    in.read_all(text);
+    return text;
+}
+
+void write_file(const string& path, string_view text)
+{
+    fd_ostream out {path, sync_policy {durability::none}};
+    out.write(span<const char> {text});
+}
+
+vector<string_view> split_lines(string_view text)
+{
+    vector<string_view> lines;
+    while (!text.empty())
+    {
+        size_t p = text.find('\n');
+        lines.push_back(text.substr(0, p));
+        text.remove_prefix(p == string_view::npos ? size(text) : p + 1);
+    }
+    return lines;
+}
+
+// 记下调用键函数的线程, 检查一批数据确实分给了多个线程排序
+struct recording_key
+{
+    field_key key;
+    shared_ptr<mutex> m {make_shared<mutex>()};
+    shared_ptr<set<thread::id>> threads {make_shared<set<thread::id>>()};
+
+    string_view operator()(string_view record) const
+    {
+        {
+            lock_guard lock {*m};
+            threads->insert(this_thread::get_id());
+        }
+        return key(record);
+    }
+};
+
+int main()
+{
+    mt19937_64 rng {42};
+
+    // 败者树每次给出的都是当前元素最小的输入, 结束的输入用 SIZE_MAX 表示
+    for (size_t k : {1, 2, 3, 5, 8, 13})
+    {
+        vector<vector<size_t>> inputs(k);
+        vector<size_t> all;
+        for (auto& input : inputs)
+        {
+            input.resize(rng() % 50);
+            for (size_t& v : input) { all.push_back(v = rng() % 1000); }
+            ranges::sort(input);
+        }
+        ranges::sort(all);
+
+        vector<size_t> next(k);
+        auto current = [&](size_t i) { return next[i] < size(inputs[i]) ? inputs[i][next[i]] : SIZE_MAX; };
+        loser_tree tree {k, [&](size_t a, size_t b) { return current(a) < current(b) || (current(a) == current(b) && a < b); }};
+
+        vector<size_t> merged;
+        while (current(tree.winner()) != SIZE_MAX)
+        {
+            size_t w = tree.winner();
+            merged.push_back(current(w));
+            ++next[w];
+            tree.replay(w);
+        }
+        assert(merged == all);
+    }
+
+    // 键相同的记录很多, 检查稳定性; 很小的 memory 和 fan_in 产生多个 run 和多轮合并
+    string input_path = "/tmp/test_sort_input";
+    string output_path = "/tmp/test_sort_output";
+    string text;
+    for (int i = 0; i < 20000; ++i)
+    {
+        text += to_string(rng() % 100000);
+        text += '\t';
+        text += to_string(rng() % 50);
+        text += '\t';
+        text += to_string(i);
+        text += '\n';
+    }
+    write_file(input_path, text);
+
+    vector<string_view> expected = split_lines(text);
+    field_key key {'\t', 1};
+    ranges::stable_sort(expected, [&](string_view a, string_view b) { return key(a) < key(b); });
+
+    // 一批只有几百条记录, 调小 min_slice 才会并行排序
+    for (size_t threads : {1, 4})
+    {
+        sort_options options;
+        options.memory = 16 * 1024;
+        options.fan_in = 4;
+        options.threads = threads;
+        options.min_slice = 64;
+        recording_key recording {key};
+        sort_file(input_path, output_path, options, recording);
+
+        string sorted = read_file(output_path);
+        assert(split_lines(sorted) == expected);
+        assert(threads == 1 ? size(*recording.threads) == 1 : size(*recording.threads) > 2);
+    }
+
+    // 只有一批时不使用临时文件, 最后一条没有分隔符的记录在输出中补上
+    write_file(input_path, "b\na\nc");
+    sort_file(input_path, output_path);
+    assert(read_file(output_path) == "a\nb\nc\n");
+
+    unlink(input_path.c_str());
+    unlink(output_path.c_str());
+    cout << "sort tests passed\n";
+    return 0;
+}
@@ -0,0 +1,99 @@
+#include "any_stream.hpp"
+#include <cassert>
+#include <iostream>
+#include <thread>
+
+// g++ -std=c++23 -O2 test_try.cpp 检查 try_ 系列函数返回的 stream_error, 以及它们不抛出异常
+
+int main()
+{
+    // 格式错误的记录跳过这一行继续
+    {
+        string_view text {"1 2\nx 3\n99999999999 4\n5"};
+        ISpanStream in {span<const char> {text}};
+        vector<int> values;
+        vector<stream_error> errors;
+        while (true)
+        {
+            expected<int, stream_error> v = in.try_parse<int>();
+            if (v) { values.push_back(*v); }
+            else if (v.error() == stream_error::end_of_stream) { break; }
+            else
+            {
+                errors.push_back(v.error());
+                in.skip_line();
+            }
+        }
+        assert((values == vector<int> {1, 2, 5}));
+        assert((errors == vector<stream_error> {stream_error::invalid_input, stream_error::out_of_range}));
+    }
+
+    // try_getline: 行比缓冲区长时是 no_space, 到了末尾是 end_of_stream
+    {
+        string_view text {"short\na much longer line\n"};
+        any_istream in {ISpanStream {span<const char> {text}}};
+        array<char, 8> line;
+        assert(in.try_getline(line).value() == 5 && string_view {data(line)} == "short");
+        assert(in.try_getline(line).error() == stream_error::no_space);
+        assert(string_view {data(line)} == "a much ");
+        in.ignore(100, '\n');
+        assert(in.try_getline(line).error() == stream_error::end_of_stream);
+        assert(in.try_get().error() == stream_error::end_of_stream);
+
+        any_istream flags {ISpanStream {span<const char> {string_view {"true x"}}}};
+        assert(flags.try_parse<bool>().value());
+        assert(flags.try_parse<bool>().error() == stream_error::invalid_input);
+    }
+
+    // 错误码和抛出的异常
+    {
+        array<char, 4> buffer;
+        span_ostream out {buffer};
+        assert(out.try_write(span<const char> {string_view {"abc"}}));
+        assert(out.try_write(span<const char> {string_view {"de"}}).error() == stream_error::no_space);
+        try
+        {
+            out.write(span<const char> {string_view {"de"}});
+            assert(false);
+        }
+        catch (const system_error& e)
+        {
+            assert(e.code() == stream_error::no_space);
+            assert(e.code().category() == stream_category());
+        }
+    }
+
+    // io_error 保留 errno
+    {
+        fd_ostream out {"/dev/full", sync_policy {durability::none}, O_WRONLY};
+        errno = 0;
+        assert(out.try_write(span<const char> {string_view {"x"}}).error() == stream_error::io_error);
+        assert(errno == ENOSPC);
+        try
+        {
+            out.write(span<const char> {string_view {"x"}});
+            assert(false);
+        }
+        catch (const system_error& e)
+        {
+            assert(e.code() == errc::no_space_on_device);
+        }
+    }
+
+    // 后台 fdatasync 的错误 (/dev/null 不支持同步) 由下一次 try_write 返回, 而不是抛出
+    {
+        fd_ostream out {"/dev/null", sync_policy {durability::periodic, 1}, O_WRONLY};
+        assert(out.try_write(span<const char> {string_view {"x"}}));
+
+        expected<void, stream_error> r;
+        for (int i = 0; i < 200 && r; ++i)
+        {
+            this_thread::sleep_for(10ms);
+            r = out.try_write(span<const char> {string_view {"x"}});
+        }
+        assert(!r && r.error() == stream_error::io_error && errno == EINVAL);
+    }
+
+    cout << "try tests passed\n";
+    return 0;
+}
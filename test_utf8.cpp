@@ -0,0 +1,133 @@
+#include "utf8_stream.hpp"
+#include <cassert>
+#include <iostream>
+#include <random>
+
+// g++ -std=c++23 -O2 -mssse3 test_utf8.cpp -lz -lzstd -llz4 比较 SIMD 和逐字节两种验证方法;
+// 不带 -mssse3 编译时 scan_utf8 就是逐字节的方法
+
+void append_utf8(string& s, char32_t c)
+{
+    if (c < 0x80) { s += static_cast<char>(c); }
+    else if (c < 0x800)
+    {
+        s += static_cast<char>(0xc0 | c >> 6);
+        s += static_cast<char>(0x80 | (c & 0x3f));
+    }
+    else if (c < 0x10000)
+    {
+        s += static_cast<char>(0xe0 | c >> 12);
+        s += static_cast<char>(0x80 | (c >> 6 & 0x3f));
+        s += static_cast<char>(0x80 | (c & 0x3f));
+    }
+    else
+    {
+        s += static_cast<char>(0xf0 | c >> 18);
+        s += static_cast<char>(0x80 | (c >> 12 & 0x3f));
+        s += static_cast<char>(0x80 | (c >> 6 & 0x3f));
+        s += static_cast<char>(0x80 | (c & 0x3f));
+    }
+}
+
+char32_t random_code_point(mt19937_64& rng)
+{
+    switch (rng() % 4)
+    {
+        case 0: return static_cast<char32_t>(rng() % 0x80);
+        case 1: return static_cast<char32_t>(0x80 + rng() % (0x800 - 0x80));
+        case 2:
+        {
+            auto c = static_cast<char32_t>(0x800 + rng() % (0x10000 - 0x800));
+            return c >= 0xd800 && c <= 0xdfff ? U'€' : c;
+        }
+        default: return static_cast<char32_t>(0x10000 + rng() % (0x110000 - 0x10000));
+    }
+}
+
+// 每次只给 transform 很小的输出空间, 让字符跨越两次调用
+template <typename Filter>
+string transcode(Filter filter, span<const byte> in)
+{
+    string out;
+    array<byte, 7> buffer;
+    while (true)
+    {
+        filter_result r = filter.transform(in, buffer, filter_flush::finish);
+        out.append(reinterpret_cast<const char*>(data(buffer)), r.produced);
+        in = in.subspan(r.consumed);
+        if (r.end) { return out; }
+    }
+}
+
+int main()
+{
+    mt19937_64 rng {42};
+
+    for (int round = 0; round < 2000; ++round)
+    {
+        string text;
+        size_t characters = rng() % 200;
+        for (size_t i = 0; i < characters; ++i) { append_utf8(text, random_code_point(rng)); }
+
+        // 大约一半的样本改坏一个字节, 其中一些是结尾被截断的字符
+        if (!text.empty() && rng() % 2 == 0) { text[rng() % size(text)] = static_cast<char>(rng()); }
+        if (!text.empty() && rng() % 8 == 0) { text.pop_back(); }
+
+        auto p = reinterpret_cast<const unsigned char*>(data(text));
+        utf8_scan simd = scan_utf8(as_bytes(span {text}));
+        utf8_scan scalar = utf8_detail::scan_scalar(p, size(text), 0);
+        assert(simd.valid == scalar.valid && simd.error == scalar.error);
+    }
+
+    // Latin-1 的每个字节都是一个码点
+    string latin1;
+    string expected;
+    for (int round = 0; round < 4; ++round)
+    {
+        for (int c = 0; c < 256; ++c)
+        {
+            latin1 += static_cast<char>(c);
+            append_utf8(expected, static_cast<char32_t>(c));
+        }
+        latin1 += string(40, 'a');
+        expected += string(40, 'a');
+    }
+    assert(transcode(latin1_to_utf8 {}, as_bytes(span {latin1})) == expected);
+
+    // 带 BOM 的 UTF-16 大端, 包括代理对和 8 个一组的 ASCII
+    vector<byte> utf16 {byte {0xfe}, byte {0xff}};
+    expected.clear();
+    auto put_unit = [&](char32_t u) {
+        utf16.push_back(static_cast<byte>(u >> 8));
+        utf16.push_back(static_cast<byte>(u & 0xff));
+    };
+    for (int i = 0; i < 5000; ++i)
+    {
+        char32_t c = rng() % 3 == 0 ? U'a' + static_cast<char32_t>(rng() % 26) : random_code_point(rng);
+        append_utf8(expected, c);
+        if (c >= 0x10000)
+        {
+            put_unit(0xd800 + ((c - 0x10000) >> 10));
+            put_unit(0xdc00 + ((c - 0x10000) & 0x3ff));
+        }
+        else { put_unit(c); }
+    }
+    string converted = transcode(utf16_to_utf8 {}, utf16);
+    assert(converted == expected);
+    assert(!scan_utf8(as_bytes(span {converted})).error);
+
+    // 不成对的代理
+    vector<byte> unpaired {byte {0x41}, byte {0}, byte {0x00}, byte {0xdc}};
+    try
+    {
+        (void)transcode(utf16_to_utf8 {}, unpaired);
+        assert(false);
+    }
+    catch (const encoding_error& e)
+    {
+        assert(e.offset == 2);
+    }
+
+    cout << "utf8 tests passed\n";
+    return 0;
+}
@@ -0,0 +1,130 @@
+#include "binary_stream.hpp"
+#include <cassert>
+#include <iostream>
+#include <random>
+
+// g++ -std=c++23 -O2 -msse2 -mbmi2 test_varint.cpp 比较 decode_varints 的 SIMD 解码和逐个 decode_varint 的结果;
+// 不带 -mbmi2 编译时检查 SSE2 路径中代替 pext 的移位拼接
+
+// 每次只给 7 字节, varint 经常跨越缓冲区边界
+struct chunked_source
+{
+    span<const char> bytes;
+
+    size_t read(span<byte> s)
+    {
+        size_t n = min<size_t>({size(s), size(bytes), 7});
+        memcpy(data(s), data(bytes), n);
+        bytes = bytes.subspan(n);
+        return n;
+    }
+};
+
+struct string_sink
+{
+    string bytes;
+
+    void write(span<const char> s) { bytes.append(data(s), size(s)); }
+};
+
+// 编码长度在 1 到 10 字节之间均匀分布, 也有连续很多个单字节的段
+uint64_t random_value(mt19937_64& rng)
+{
+    if (rng() % 4 == 0) { return rng() % 128; }
+    return rng() >> (rng() % 64);
+}
+
+pair<size_t, size_t> decode_scalar(span<const byte> in, span<uint64_t> out)
+{
+    const byte* p = data(in);
+    size_t n {};
+    while (n < size(out))
+    {
+        const byte* next = decode_varint(p, data(in) + size(in), out[n]);
+        if (next == nullptr) { break; }
+        p = next;
+        ++n;
+    }
+    return {static_cast<size_t>(p - data(in)), n};
+}
+
+int main()
+{
+    mt19937_64 rng {42};
+
+    for (int round = 0; round < 2000; ++round)
+    {
+        string_sink sink;
+        vector<uint64_t> values(rng() % 300);
+        for (uint64_t& v : values) { v = random_value(rng); }
+        if (rng() % 4 == 0) { values.insert(values.end(), 40, 1); }
+        write_varints<uint64_t>(sink, values);
+
+        // 有时去掉末尾几个字节, 最后一个 varint 不完整; 输出空间也不一定够放所有的值
+        auto in = as_bytes(span {sink.bytes});
+        if (!in.empty() && rng() % 3 == 0) { in = in.first(size(in) - 1 - rng() % min<size_t>(size(in), 9)); }
+        vector<uint64_t> simd(size(values));
+        vector<uint64_t> scalar(size(values));
+        size_t capacity = rng() % 2 == 0 ? size(values) : rng() % (size(values) + 1);
+
+        auto r = decode_varints(in, span {simd}.first(capacity));
+        assert(r == decode_scalar(in, span {scalar}.first(capacity)));
+        assert(ranges::equal(span {simd}.first(r.second), span {values}.first(r.second)));
+        if (size(in) == size(sink.bytes) && capacity == size(values)) { assert(r.first == size(in) && r.second == size(values)); }
+    }
+
+    // 超过 64 位的 varint 在两种解码中都报错
+    string overlong(11, '\xff');
+    overlong.back() = '\x01';
+    string padded = string(20, '\x01') + overlong + string(20, '\x01');
+    array<uint64_t, 64> out;
+    for (string_view s : {string_view {overlong}, string_view {padded}})
+    {
+        try
+        {
+            (void)decode_varints(as_bytes(span {s}), out);
+            assert(false);
+        }
+        catch (const system_error& e)
+        {
+            assert(e.code() == errc::value_too_large);
+        }
+    }
+
+    // 通过很小的缓冲区读取, 交替使用单个和批量读取
+    string_sink sink;
+    vector<uint64_t> values(10000);
+    for (uint64_t& v : values) { v = random_value(rng); }
+    write_varints<uint64_t>(sink, values);
+    write_zigzag(sink, -5);
+
+    IBUfStream<chunked_source, 16> in {chunked_source {span<const char> {sink.bytes}}};
+    for (size_t i = 0; i < size(values);)
+    {
+        if (i % 3 == 0) { assert(read_varint<uint64_t>(in) == values[i++]); }
+        else
+        {
+            array<uint64_t, 37> batch;
+            size_t n = read_varints(in, span {batch}.first(min<size_t>(size(batch), size(values) - i)));
+            assert(ranges::equal(span {batch}.first(n), span {values}.subspan(i, n)));
+            i += n;
+        }
+    }
+    assert(read_zigzag<int>(in) == -5);
+
+    // 流在 varint 中间结束
+    string truncated {"\x80\x80"};
+    ISpanStream short_input {span<const char> {truncated}};
+    try
+    {
+        (void)read_varint<uint64_t>(short_input);
+        assert(false);
+    }
+    catch (const system_error& e)
+    {
+        assert(e.code() == stream_error::end_of_stream);
+    }
+
+    cout << "varint tests passed\n";
+    return 0;
+}
@@ -0,0 +1,406 @@
+#pragma once
+
+#include "filter_stream.hpp"
+#include "stream.hpp"
+#include <array>
+#include <bit>
+#include <cstring>
+
+#if defined(__SSSE3__)
+#include <immintrin.h>
+#endif
+
+// 非法的文本编码, offset 是第一个非法序列在流中的位置
+struct encoding_error : runtime_error
+{
+    uint64_t offset;
+
+    encoding_error(const char* what, uint64_t offset_) : runtime_error(what), offset {offset_} {}
+};
+
+struct utf8_scan
+{
+    size_t valid; // 完整且合法的字符组成的前缀的长度
+    bool error;   // 为 true 时 valid 是第一个非法序列的位置, 否则 valid 之后是不完整的字符
+};
+
+namespace utf8_detail
+{
+    // 从 p 开始的一个字符的长度, 非法时返回 0, 数据不完整但目前合法时返回 -1
+    // 第二个字节的范围按 Unicode 表 3-7 排除超长编码, 代理和超过 U+10FFFF 的码点
+    inline int sequence_length(const unsigned char* p, size_t n)
+    {
+        unsigned char c = p[0];
+        if (c < 0x80) { return 1; }
+
+        int length {};
+        unsigned char lo = 0x80;
+        unsigned char hi = 0xbf;
+        if (c >= 0xc2 && c <= 0xdf) { length = 2; }
+        else if (c >= 0xe0 && c <= 0xef)
+        {
+            length = 3;
+            if (c == 0xe0) { lo = 0xa0; }
+            if (c == 0xed) { hi = 0x9f; }
+        }
+        else if (c >= 0xf0 && c <= 0xf4)
+        {
+            length = 4;
+            if (c == 0xf0) { lo = 0x90; }
+            if (c == 0xf4) { hi = 0x8f; }
+        }
+        else { return 0; }
+
+        for (int k = 1; k < length; ++k)
+        {
+            if (static_cast<size_t>(k) >= n) { return -1; }
+
+            unsigned char b = p[k];
+            if (k == 1 ? b < lo || b > hi : (b & 0xc0) != 0x80) { return 0; }
+        }
+        return length;
+    }
+
+    inline utf8_scan scan_scalar(const unsigned char* p, size_t n, size_t i)
+    {
+        while (i < n)
+        {
+            int length = sequence_length(p + i, n - i);
+            if (length == 0) { return {i, true}; }
+            if (length < 0) { return {i, false}; }
+            i += static_cast<size_t>(length);
+        }
+        return {n, false};
+    }
+
+#if defined(__SSSE3__)
+    // Keiser, Lemire: Validating UTF-8 In Less Than One Instruction Per Byte
+    // 用前一个字节的高低半字节和当前字节的高半字节查三张表, 三个结果的与是这两个字节组合的错误类型
+    constexpr char too_short = 1 << 0;   // 前导字节后面不是后续字节
+    constexpr char too_long = 1 << 1;    // ASCII 后面是后续字节
+    constexpr char overlong_3 = 1 << 2;  // 11100000 100_____
+    constexpr char too_large = 1 << 3;   // 11110100 1001____ 等
+    constexpr char surrogate = 1 << 4;   // 11101101 101_____
+    constexpr char overlong_2 = 1 << 5;  // 1100000_ 10______
+    constexpr char too_large_1000 = 1 << 6;
+    constexpr char overlong_4 = 1 << 6;  // 11110000 1000____
+    constexpr char two_conts = static_cast<char>(1 << 7);
+    constexpr char carry = too_short | too_long | two_conts;
+
+    struct simd_state
+    {
+        __m128i previous = _mm_setzero_si128();
+        __m128i incomplete = _mm_setzero_si128();
+        __m128i error = _mm_setzero_si128();
+    };
+
+    inline __m128i high_nibbles(__m128i v)
+    {
+        return _mm_and_si128(_mm_srli_epi16(v, 4), _mm_set1_epi8(0x0f));
+    }
+
+    inline void check_vector(simd_state& state, __m128i input)
+    {
+        const __m128i byte_1_high = _mm_setr_epi8(too_long, too_long, too_long, too_long, too_long, too_long, too_long, too_long, two_conts, two_conts,
+                                                  two_conts, two_conts, too_short | overlong_2, too_short, too_short | overlong_3 | surrogate,
+                                                  too_short | too_large | too_large_1000 | overlong_4);
+        const __m128i byte_1_low = _mm_setr_epi8(
+            carry | overlong_3 | overlong_2 | overlong_4, carry | overlong_2, carry, carry, carry | too_large, carry | too_large | too_large_1000,
+            carry | too_large | too_large_1000, carry | too_large | too_large_1000, carry | too_large | too_large_1000, carry | too_large | too_large_1000,
+            carry | too_large | too_large_1000, carry | too_large | too_large_1000, carry | too_large | too_large_1000,
+            carry | too_large | too_large_1000 | surrogate, carry | too_large | too_large_1000, carry | too_large | too_large_1000);
+        const __m128i byte_2_high = _mm_setr_epi8(too_short, too_short, too_short, too_short, too_short, too_short, too_short, too_short,
+                                                  too_long | overlong_2 | two_conts | overlong_3 | too_large_1000 | overlong_4,
+                                                  too_long | overlong_2 | two_conts | overlong_3 | too_large,
+                                                  too_long | overlong_2 | two_conts | surrogate | too_large,
+                                                  too_long | overlong_2 | two_conts | surrogate | too_large, too_short, too_short, too_short, too_short);
+
+        __m128i prev1 = _mm_alignr_epi8(input, state.previous, 15);
+        __m128i special = _mm_and_si128(_mm_and_si128(_mm_shuffle_epi8(byte_1_high, high_nibbles(prev1)),
+                                                      _mm_shuffle_epi8(byte_1_low, _mm_and_si128(prev1, _mm_set1_epi8(0x0f)))),
+                                        _mm_shuffle_epi8(byte_2_high, high_nibbles(input)));
+
+        // 三字节和四字节字符的第三, 四个字节必须是后续字节, 两张表只检查了相邻的两个字节
+        __m128i prev2 = _mm_alignr_epi8(input, state.previous, 14);
+        __m128i prev3 = _mm_alignr_epi8(input, state.previous, 13);
+        __m128i must_be_continuation = _mm_or_si128(_mm_subs_epu8(prev2, _mm_set1_epi8(static_cast<char>(0xe0 - 0x80))),
+                                                    _mm_subs_epu8(prev3, _mm_set1_epi8(static_cast<char>(0xf0 - 0x80))));
+        must_be_continuation = _mm_and_si128(must_be_continuation, _mm_set1_epi8(static_cast<char>(0x80)));
+
+        state.error = _mm_or_si128(state.error, _mm_xor_si128(must_be_continuation, special));
+
+        // 最后三个字节开始的字符没有在这个向量中结束
+        const __m128i max_value = _mm_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, static_cast<char>(0xf0 - 1),
+                                                static_cast<char>(0xe0 - 1), static_cast<char>(0xc0 - 1));
+        state.incomplete = _mm_subs_epu8(input, max_value);
+        state.previous = input;
+    }
+
+    // 按 64 字节的块验证, 返回第一个有错误的块的开头; 之前的块都合法, 但最后一个字符可能延续到返回的位置之后
+    inline size_t scan_blocks(const unsigned char* p, size_t n)
+    {
+        simd_state state;
+        size_t i {};
+        for (; i + 64 <= n; i += 64)
+        {
+            __m128i v[4];
+            for (int k = 0; k < 4; ++k) { v[k] = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p + i + 16 * k)); }
+
+            __m128i any = _mm_or_si128(_mm_or_si128(v[0], v[1]), _mm_or_si128(v[2], v[3]));
+            if (_mm_movemask_epi8(any) == 0)
+            {
+                // 全是 ASCII, 只需检查上一个块结尾的字符是否完整
+                if (_mm_movemask_epi8(_mm_cmpeq_epi8(state.incomplete, _mm_setzero_si128())) != 0xffff) { return i; }
+                state.previous = v[3];
+                state.incomplete = _mm_setzero_si128();
+                continue;
+            }
+
+            for (int k = 0; k < 4; ++k) { check_vector(state, v[k]); }
+            if (_mm_movemask_epi8(_mm_cmpeq_epi8(state.error, _mm_setzero_si128())) != 0xffff) { return i; }
+        }
+        return i;
+    }
+#endif
+} // namespace utf8_detail
+
+// 验证 s 中的 UTF-8, 结尾不完整的字符不算错误, 由调用者决定是否补充数据
+inline utf8_scan scan_utf8(span<const byte> s)
+{
+    auto p = reinterpret_cast<const unsigned char*>(data(s));
+    size_t n = size(s);
+    size_t i {};
+
+#if defined(__SSSE3__)
+    // 从 i 之前最后一个字符的开头起, 用逐字节的方法找出准确的位置
+    size_t blocks = utf8_detail::scan_blocks(p, n);
+    i = blocks;
+    while (i > 0 && blocks - i < 3 && (p[i - 1] & 0xc0) == 0x80) { --i; }
+    if (i > 0 && p[i - 1] >= 0xc0) { --i; }
+#endif
+
+    return utf8_detail::scan_scalar(p, n, i);
+}
+
+// 只暴露验证过的字节的 buffered_input, 遇到非法的 UTF-8 时抛出 encoding_error
+// 需要 >> 和 getline 时用 any_istream 包装: any_istream in {utf8_checked {source}};
+template <buffered_input Source>
+class utf8_checked
+{
+    Source& in;
+    size_t checked {};    // window 开头这么多字节已经验证过
+    uint64_t position {}; // window 开头在流中的位置
+
+    void check(span<const byte> w)
+    {
+        if (checked >= size(w)) { return; }
+
+        utf8_scan r = scan_utf8(w.subspan(checked));
+        if (r.error) { throw encoding_error("Invalid UTF-8.", position + checked + r.valid); }
+        checked += r.valid;
+    }
+
+public:
+    explicit utf8_checked(Source& in_) : in {in_} {}
+
+    span<const byte> window()
+    {
+        span<const byte> w = in.window();
+        check(w);
+
+        // 窗口中只有一个不完整的字符
+        while (checked == 0 && !w.empty())
+        {
+            if (in.refill() == 0) { throw encoding_error("Truncated UTF-8 sequence.", position); }
+            w = in.window();
+            check(w);
+        }
+        return w.first(checked);
+    }
+
+    void consume(size_t n)
+    {
+        in.consume(n);
+        checked -= n;
+        position += n;
+    }
+
+    size_t refill()
+    {
+        size_t n = in.refill();
+        span<const byte> w = in.window();
+        check(w);
+        if (n == 0 && checked < size(w)) { throw encoding_error("Truncated UTF-8 sequence.", position + checked); }
+        return n;
+    }
+};
+
+namespace utf8_detail
+{
+    // 输出空间放不下一个完整的字符时, 剩下的字节留到下一次输出
+    struct pending_output
+    {
+        array<byte, 4> bytes {};
+        size_t first {};
+        size_t last {};
+
+        [[nodiscard]]
+        bool empty() const
+        {
+            return first == last;
+        }
+
+        void drain(span<byte> out, size_t& o)
+        {
+            size_t n = min(last - first, size(out) - o);
+            copy_n(bytes.begin() + static_cast<ptrdiff_t>(first), n, out.begin() + static_cast<ptrdiff_t>(o));
+            first += n;
+            o += n;
+        }
+
+        // 写入 c 的 UTF-8 编码, 放不下的部分保存起来
+        void encode(char32_t c, span<byte> out, size_t& o)
+        {
+            size_t length {};
+            if (c < 0x80) { bytes[length++] = static_cast<byte>(c); }
+            else if (c < 0x800)
+            {
+                bytes[length++] = static_cast<byte>(0xc0 | c >> 6);
+                bytes[length++] = static_cast<byte>(0x80 | (c & 0x3f));
+            }
+            else if (c < 0x10000)
+            {
+                bytes[length++] = static_cast<byte>(0xe0 | c >> 12);
+                bytes[length++] = static_cast<byte>(0x80 | (c >> 6 & 0x3f));
+                bytes[length++] = static_cast<byte>(0x80 | (c & 0x3f));
+            }
+            else
+            {
+                bytes[length++] = static_cast<byte>(0xf0 | c >> 18);
+                bytes[length++] = static_cast<byte>(0x80 | (c >> 12 & 0x3f));
+                bytes[length++] = static_cast<byte>(0x80 | (c >> 6 & 0x3f));
+                bytes[length++] = static_cast<byte>(0x80 | (c & 0x3f));
+            }
+            first = 0;
+            last = length;
+            drain(out, o);
+        }
+    };
+} // namespace utf8_detail
+
+// Latin-1 (ISO 8859-1) 转为 UTF-8, 用于 filter_reader
+class latin1_to_utf8
+{
+    utf8_detail::pending_output pending;
+
+public:
+    filter_result transform(span<const byte> in, span<byte> out, filter_flush mode)
+    {
+        size_t i {};
+        size_t o {};
+        pending.drain(out, o);
+
+        while (pending.empty() && i < size(in) && o < size(out))
+        {
+            // 8 字节都是 ASCII 时直接复制
+            if (i + 8 <= size(in) && o + 8 <= size(out))
+            {
+                uint64_t v;
+                memcpy(&v, data(in) + i, 8);
+                if ((v & 0x8080808080808080) == 0)
+                {
+                    memcpy(data(out) + o, &v, 8);
+                    i += 8;
+                    o += 8;
+                    continue;
+                }
+            }
+
+            pending.encode(to_integer<char32_t>(in[i++]), out, o);
+        }
+        return {i, o, mode == filter_flush::finish && i == size(in) && pending.empty()};
+    }
+};
+
+// UTF-16 转为 UTF-8, 用于 filter_reader; 开头的 BOM 决定字节序并被去掉, 没有 BOM 时使用 order
+// 不成对的代理抛出 encoding_error, 位置是输入中的字节偏移量
+class utf16_to_utf8
+{
+    endian order;
+    bool started {false};
+    uint64_t position {};
+    utf8_detail::pending_output pending;
+
+    [[nodiscard]]
+    char32_t unit(const byte* p) const
+    {
+        auto a = to_integer<char32_t>(p[0]);
+        auto b = to_integer<char32_t>(p[1]);
+        return order == endian::little ? a | b << 8 : a << 8 | b;
+    }
+
+public:
+    explicit utf16_to_utf8(endian order_ = endian::little) : order {order_} {}
+
+    filter_result transform(span<const byte> in, span<byte> out, filter_flush mode)
+    {
+        size_t i {};
+        size_t o {};
+        pending.drain(out, o);
+
+        if (!started && size(in) >= 2)
+        {
+            started = true;
+            if (in[0] == byte {0xff} && in[1] == byte {0xfe})
+            {
+                order = endian::little;
+                i = 2;
+            }
+            else if (in[0] == byte {0xfe} && in[1] == byte {0xff})
+            {
+                order = endian::big;
+                i = 2;
+            }
+        }
+
+        while (pending.empty() && i + 2 <= size(in) && o < size(out))
+        {
+#if defined(__SSSE3__)
+            // 8 个 ASCII 码元打包成 8 个字节
+            if (i + 16 <= size(in) && o + 8 <= size(out))
+            {
+                __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data(in) + i));
+                if (order == endian::big) { v = _mm_shuffle_epi8(v, _mm_setr_epi8(1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14)); }
+                if (_mm_movemask_epi8(_mm_cmpeq_epi16(_mm_and_si128(v, _mm_set1_epi16(static_cast<short>(0xff80))), _mm_setzero_si128())) == 0xffff)
+                {
+                    _mm_storel_epi64(reinterpret_cast<__m128i*>(data(out) + o), _mm_packus_epi16(v, v));
+                    i += 16;
+                    o += 8;
+                    continue;
+                }
+            }
+#endif
+            char32_t c = unit(data(in) + i);
+            size_t units = 2;
+            if (c >= 0xd800 && c <= 0xdbff)
+            {
+                if (i + 4 > size(in)) { break; }
+
+                char32_t low = unit(data(in) + i + 2);
+                if (low < 0xdc00 || low > 0xdfff) { throw encoding_error("Unpaired UTF-16 surrogate.", position + i); }
+                c = 0x10000 + ((c - 0xd800) << 10) + (low - 0xdc00);
+                units = 4;
+            }
+            else if (c >= 0xdc00 && c <= 0xdfff) { throw encoding_error("Unpaired UTF-16 surrogate.", position + i); }
+
+            pending.encode(c, out, o);
+            i += units;
+        }
+
+        bool end = mode == filter_flush::finish && pending.empty();
+        if (end && i < size(in) && o < size(out)) { throw encoding_error("Truncated UTF-16 sequence.", position + i); }
+
+        position += i;
+        return {i, o, end && i == size(in)};
+    }
+};